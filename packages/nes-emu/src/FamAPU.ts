@@ -1,3 +1,5 @@
+import { hashToString, isSimdSupported } from './WasmFeature';
+
 export class FamAPU {
     private static instance: FamAPU;
     private irqCallback = 0;
@@ -7,7 +9,7 @@ export class FamAPU {
     }
     public static async getAPU(): Promise<FamAPU> {
         if (!this.instance) {
-            const wasmModule = await import('./wasm/apu.js');
+            const wasmModule = isSimdSupported() ? await import('./wasm/apu_simd.js') : await import('./wasm/apu.js');
             const module = await wasmModule.default();
             this.instance = new FamAPU(module);
         }
@@ -23,12 +25,13 @@ export class FamAPU {
             this.module._setDmcCallback(this.dmcCallback);
         }
     }
-    public setIrqCallback(callback?: (flag: number) => void) {
+    // IRQのコールバック(sourceはFamCPUのIrqSourceのFRAMEかDMC)
+    public setIrqCallback(callback?: (source: number, flag: number) => void) {
         if (this.irqCallback) {
             this.module.removeFunction(this.irqCallback);
         }
         if (callback) {
-            this.irqCallback = this.module.addFunction(callback, 'vi');
+            this.irqCallback = this.module.addFunction(callback, 'vii');
             this.module._setIrqCallback(this.irqCallback);
         }
     }
@@ -53,6 +56,10 @@ export class FamAPU {
     public setVolume(volume: number): void {
         this.module._setVolume(volume);
     }
+    // APUの状態(フレームカウンタと各チャンネル)のハッシュ(16桁の16進数)
+    public hashState(): string {
+        return hashToString(this.module.HEAPU32, this.module._hashState());
+    }
     public reset(): void {
         this.module._reset();
     }
@@ -1,9 +1,58 @@
+import { hashToString } from './WasmFeature';
+
+/**
+ * 停止条件/停止理由
+ */
+export const enum StopReason {
+    PC = 0x01,
+    READ = 0x02,
+    WRITE = 0x04,
+    SCANLINE = 0x08,
+    CYCLES = 0x10,
+    FRAME = 0x20,
+    BRK = 0x40,
+    FAULT = 0x80
+};
+
+/**
+ * ウォッチポイントの種類
+ */
+export const enum WatchKind {
+    READ = 0x01,
+    WRITE = 0x02,
+    EXEC = 0x04
+};
+
+/**
+ * Code/Data Logger のフラグ(PRG-ROM)
+ */
+export const enum CdlFlag {
+    OPCODE = 0x01,
+    OPERAND = 0x02,
+    DATA = 0x04,
+    INDIRECT = 0x08,
+    PCM = 0x10
+};
+
+/**
+ * IRQの要因(要因ごとに要求と取り消しをする)
+ */
+export const enum IrqSource {
+    FRAME = 0,
+    DMC = 1,
+    MAPPER = 2
+};
+
 export class FamCPU {
     private static instance: FamCPU;
     private apuStepCallback = 0;
     private memReadCallback = 0;
     private memWriteCallback = 0;
     private debugCallback = 0;
+    private chrBankCallback = 0;
+    private mirrorCallback = 0;
+    private mapperWriteCallback = 0;
+    private dmaCallback = 0;
 
     private constructor(private readonly module: any) {
     }
@@ -24,8 +73,12 @@ export class FamCPU {
     public powerOff(): void {
         this.module._powerOff();
     }
-    public irq(flag: number = 1): void {
-        this.module._irq(flag);
+    public irq(source: IrqSource, flag: number = 1): void {
+        this.module._irq(source, flag);
+    }
+    // 今のバスアクセスからstep終了までのCPUサイクル(PPUのsyncCpuに渡す)
+    public getBusCycle(): number {
+        return this.module._getBusCycle();
     }
     public skip(cycle: number): void {
         this.module._skip(cycle);
@@ -33,6 +86,245 @@ export class FamCPU {
     public step(cycle: number): number {
         return this.module._step(cycle);
     }
+    /**
+     * 停止条件のいずれかを満たすか、指定サイクルまで実行する
+     * @param cycle 実行するCPUサイクル
+     * @returns reason: 停止理由(0ならサイクルを使い切った), cycle: 停止したフレーム内のCPUサイクル
+     */
+    public runUntil(cycle: number): { reason: number; cycle: number; } {
+        const reason = this.module._runUntil(cycle);
+        return { reason, cycle: this.module._getStopCycle() };
+    }
+    /**
+     * 停止条件を設定する
+     * @param flags StopReasonの組み合わせ、0で無効
+     */
+    public setStopCondition(flags: number): void {
+        this.module._setStopCondition(flags);
+    }
+    public setBreakPoint(addr: number, flag = true): void {
+        this.module._setBreakPoint(addr, flag ? 1 : 0);
+    }
+    public clearBreakPoints(): void {
+        this.module._clearBreakPoints();
+    }
+    public setWatchRange(start: number, end = start): void {
+        this.module._setWatchRange(start, end);
+    }
+    /**
+     * @param line 0-239: 表示, 241: VBlank, 261: プリレンダー
+     * @param dot 0-340
+     */
+    public setStopScanline(line: number, dot = 0): void {
+        this.module._setStopScanline(line, dot);
+    }
+    public setStopCycles(cycle: number): void {
+        this.module._setStopCycles(cycle);
+    }
+    /**
+     * ウォッチポイントを追加する(停止条件に関係なくstep()でも有効)
+     * @param kind WatchKindの組み合わせ
+     * @returns 番号、空きがなければ-1
+     */
+    public addWatchPoint(start: number, end: number, kind: number): number {
+        return this.module._addWatchPoint(start, end, kind);
+    }
+    public removeWatchPoint(index: number): void {
+        this.module._removeWatchPoint(index);
+    }
+    public clearWatchPoints(): void {
+        this.module._clearWatchPoints();
+    }
+    public getStopReason(): number {
+        return this.module._getStopReason();
+    }
+    public getStopCycle(): number {
+        return this.module._getStopCycle();
+    }
+    public getStopAddr(): number {
+        return this.module._getStopAddr();
+    }
+    public resume(): void {
+        this.module._resume();
+    }
+    public startFrame(): void {
+        this.module._startFrame();
+    }
+    /**
+     * PRGバンクの切り替えを通知する
+     * @param bank 0-3($8000,$A000,$C000,$E000)
+     * @param offset PRG-ROM内のオフセット
+     */
+    public setPrgBankOffset(bank: number, offset: number): void {
+        this.module._setPrgBankOffset(bank, offset);
+    }
+    /**
+     * ネイティブのマッパーを選ぶ
+     * @param mapper iNESのマッパー番号(-1: 使わない)
+     * @param chrSize CHR-ROMのサイズ(0: CHR-RAM)
+     * @param mirrorMode ヘッダのミラーモード
+     * @returns 対応しているマッパーならtrue
+     */
+    public initMapper(mapper: number, chrSize = 0, mirrorMode = 0): boolean {
+        return this.module._initMapper(mapper, chrSize, mirrorMode) !== 0;
+    }
+    // バンクを初期状態に戻す
+    public resetMapper(): void {
+        this.module._resetMapper();
+    }
+    // PRG-ROMをwasm側にコピーする
+    public loadPrgRom(bankList: Uint8Array[]): void {
+        const buf = this.module._loadPrgRom(bankList.length * 0x4000);
+        bankList.forEach((bank, i) => this.module.HEAPU8.set(bank, buf + i * 0x4000));
+    }
+    // 内部RAM(コピーではない)
+    public getRam(): Uint8Array {
+        return new Uint8Array(this.module.HEAPU8.buffer, this.module._getRam(), 0x800);
+    }
+    // WRAM $6000-$7FFF(コピーではない)
+    public getWram(): Uint8Array {
+        return new Uint8Array(this.module.HEAPU8.buffer, this.module._getWram(), 0x2000);
+    }
+    // 前回の呼び出し以降にWRAMへ書き込んだかどうか
+    public checkWramWrite(): boolean {
+        return this.module._checkWramWrite() !== 0;
+    }
+    /**
+     * CPUの状態(レジスタ、サイクル、RAM、WRAM、バンク)のハッシュ
+     * @param ext ネイティブのマッパーでないときに、TS側のRAM/WRAMを渡す
+     * @returns 16桁の16進数
+     */
+    public hashState(ext?: Uint8Array): string {
+        let size = 0;
+        if (ext) {
+            size = Math.min(ext.length, 0x2800);
+            this.module.HEAPU8.set(ext.subarray(0, size), this.module._getHashBuffer());
+        }
+        return hashToString(this.module.HEAPU32, this.module._hashState(size));
+    }
+    // 監視やAPU通知を行わない読み込み
+    public readBus(addr: number): number {
+        return this.module._readBus(addr);
+    }
+    public setChrBankCallback(callback?: (bank: number, offset: number) => void) {
+        if (this.chrBankCallback) {
+            this.module.removeFunction(this.chrBankCallback);
+        }
+        if (callback) {
+            this.chrBankCallback = this.module.addFunction(callback, 'vii');
+            this.module._setChrBankCallback(this.chrBankCallback);
+        } else {
+            this.chrBankCallback = 0;
+            this.module._setChrBankCallback(0);
+        }
+    }
+    public setMirrorCallback(callback?: (mode: number) => void) {
+        if (this.mirrorCallback) {
+            this.module.removeFunction(this.mirrorCallback);
+        }
+        if (callback) {
+            this.mirrorCallback = this.module.addFunction(callback, 'vi');
+            this.module._setMirrorCallback(this.mirrorCallback);
+        } else {
+            this.mirrorCallback = 0;
+            this.module._setMirrorCallback(0);
+        }
+    }
+    // スプライトDMAの転送データ(コピーではない)
+    public getDmaBuffer(): Uint8Array {
+        return new Uint8Array(this.module.HEAPU8.buffer, this.module._getDmaBuffer(), 256);
+    }
+    // スプライトDMA($4014)の転送データをPPUへ渡すコールバック
+    public setDmaCallback(callback?: () => void) {
+        if (this.dmaCallback) {
+            this.module.removeFunction(this.dmaCallback);
+        }
+        if (callback) {
+            this.dmaCallback = this.module.addFunction(callback, 'v');
+            this.module._setDmaCallback(this.dmaCallback);
+        } else {
+            this.dmaCallback = 0;
+            this.module._setDmaCallback(0);
+        }
+    }
+    // PPU側で処理するマッパーのレジスタ(MMC3のIRQ)
+    public setMapperWriteCallback(callback?: (addr: number, data: number) => void) {
+        if (this.mapperWriteCallback) {
+            this.module.removeFunction(this.mapperWriteCallback);
+        }
+        if (callback) {
+            this.mapperWriteCallback = this.module.addFunction(callback, 'vii');
+            this.module._setMapperWriteCallback(this.mapperWriteCallback);
+        } else {
+            this.mapperWriteCallback = 0;
+            this.module._setMapperWriteCallback(0);
+        }
+    }
+    /**
+     * CDLを開始する
+     * @param size PRG-ROMのサイズ
+     * @returns CDLが無効なビルドではfalse
+     */
+    public initCdl(size: number): boolean {
+        return this.module._initCdl(size) !== 0;
+    }
+    /**
+     * CDLの記録(コピーではない)
+     */
+    public getCdl(): Uint8Array | null {
+        const size = this.module._getCdlSize();
+        if (!size) {
+            return null;
+        }
+        return new Uint8Array(this.module.HEAPU8.buffer, this.module._getCdlData(), size);
+    }
+    /**
+     * 以前のCDLを合成する
+     */
+    public mergeCdl(data: Uint8Array): void {
+        const cdl = this.getCdl();
+        if (cdl) {
+            const size = Math.min(cdl.length, data.length);
+            for (let i = 0; i < size; i++) {
+                cdl[i] |= data[i];
+            }
+        }
+    }
+    /**
+     * CPUを通らない読み込み(DMC)を記録する
+     */
+    public logCdl(addr: number, flag: number): void {
+        this.module._logCdl(addr, flag);
+    }
+    /**
+     * バスのアクセス統計を設定する
+     * @param enable 有効にするかどうか
+     * @param perFrame true: フレームごとにリセット, false: 累積
+     */
+    public setBusStat(enable: boolean, perFrame = true): void {
+        this.module._setBusStat(enable ? 1 : 0, perFrame ? 1 : 0);
+    }
+    /**
+     * バスのアクセス統計(コピーではない)
+     * read, write, exec: アドレスごと(0x10000個)
+     * ioRead, ioWrite: 0-7=$2000-$2007, 8-0x1f=$4000-$4017
+     * @returns 一度もsetBusStatで有効にしていなければnull
+     */
+    public getBusStat(): { read: Uint32Array; write: Uint32Array; exec: Uint32Array; ioRead: Uint32Array; ioWrite: Uint32Array; } | null {
+        const stat = this.module._getBusStat();
+        if (!stat) {
+            return null;
+        }
+        const io = this.module._getIoStat();
+        const buffer = this.module.HEAPU32.buffer;
+        return {
+            read: new Uint32Array(buffer, stat, 0x10000),
+            write: new Uint32Array(buffer, stat + 0x40000, 0x10000),
+            exec: new Uint32Array(buffer, stat + 0x80000, 0x10000),
+            ioRead: new Uint32Array(buffer, io, 0x20),
+            ioWrite: new Uint32Array(buffer, io + 0x80, 0x20)
+        };
+    }
     public setApuStepCallback(callback?: (cycle: number) => void) {
         if (this.apuStepCallback) {
             this.module.removeFunction(this.apuStepCallback);
@@ -77,6 +369,45 @@ export class FamCPU {
             this.debugCallback = 0;
         }
     }
+    /**
+     * 複数の命令をまとめて逆アセンブルする
+     * @param start 開始アドレス
+     * @param count 命令数(最大512)
+     * @returns 1行ずつのテキストと次の命令のアドレス
+     */
+    public disassembleRange(start: number, count: number): { lines: string[]; next: number; } {
+        const next = this.module._disassembleRange(start, count, 0);
+        const bytes = new Uint8Array(this.module.HEAPU8.buffer, this.module._getDisasmBuffer());
+        let length = 0;
+        while (bytes[length] !== 0) length++;
+        const text = new TextDecoder().decode(bytes.subarray(0, length));
+        const lines = text.split('\n');
+        lines.pop();
+        return { lines, next };
+    }
+    /**
+     * 逆アセンブルで使うシンボルを登録する
+     * @param name 63バイトまで
+     */
+    public addSymbol(addr: number, name: string): void {
+        const buf = this.module._getSymbolBuffer();
+        const bytes = new TextEncoder().encode(name).subarray(0, 63);
+        this.module.HEAPU8.set(bytes, buf);
+        this.module.HEAPU8[buf + bytes.length] = 0;
+        this.module._addSymbol(addr);
+    }
+    public removeSymbol(addr: number): void {
+        this.module._removeSymbol(addr);
+    }
+    public clearSymbols(): void {
+        this.module._clearSymbols();
+    }
+    /**
+     * 逆アセンブル用のPRG-ROMキャッシュを捨てる(ROMの入れ替え時)
+     */
+    public clearDisasmCache(): void {
+        this.module._clearDisasmCache();
+    }
     public getOperandText(addr: number): [string, number] {
         const next = this.module._makeOperandText(addr);
         const buf = this.module._getOperandText();
@@ -2,16 +2,16 @@ import { IFamCanvas, IFamPad, IFamSound, Mapper, NesFile, PadButton } from "./Ne
 
 export class PPUCanvas implements IFamCanvas {
     private context: CanvasRenderingContext2D;
-    private image: ImageData;
     private clip: boolean;
     private adjust?: () => void;
+    // 幅が256以外(NTSCフィルター)の画面を置いてから拡大縮小する
+    private wide?: CanvasRenderingContext2D;
 
     // コンストラクタでCanvasのコンテキストを取得
     public constructor(private element: HTMLCanvasElement) {
         this.clip = element.height * 256 / element.width < 230;
         this.context = element.getContext('2d')!;
         const height = this.clip ? 224 : 240;
-        this.image = this.context.createImageData(256, height);
         if (element.width >= 512) {
             // 拡大する
             const scale = element.width / 256;
@@ -28,14 +28,39 @@ export class PPUCanvas implements IFamCanvas {
         this.context.clearRect(0, 0, this.element.width, this.element.height);
     }
 
-    render(image: Uint8ClampedArray): void {
-        this.image.data.set(image);
-        this.context.putImageData(this.image, 0, 0);
+    render(image: Uint8ClampedArray, dirty?: { start: number; count: number; }[], width = 256): void {
+        const height = image.length / 4 / width;
+        if (width !== 256) {
+            this.renderWide(image, width, height);
+            return;
+        }
+        // 渡された画面(acquireFrameのバッファ)をそのまま置く
+        const frame = new ImageData(image, 256, height);
+        if (dirty && !this.adjust) {
+            // 変わった行だけ転送する
+            for (const range of dirty) {
+                this.context.putImageData(frame, 0, 0, 0, range.start, 256, range.count);
+            }
+        } else {
+            // 拡大で左上が上書きされているので全体を置き直す
+            this.context.putImageData(frame, 0, 0);
+        }
         if (this.adjust) {
             this.adjust();
         }
     }
 
+    private renderWide(image: Uint8ClampedArray, width: number, height: number): void {
+        if (!this.wide || this.wide.canvas.width !== width || this.wide.canvas.height !== height) {
+            const canvas = document.createElement('canvas');
+            canvas.width = width;
+            canvas.height = height;
+            this.wide = canvas.getContext('2d')!;
+        }
+        this.wide.putImageData(new ImageData(image, width, height), 0, 0);
+        this.context.drawImage(this.wide.canvas, 0, 0, width, height, 0, 0, this.element.width, this.element.height);
+    }
+
     isClip(): boolean {
         return this.clip;
     }
@@ -49,6 +74,11 @@ export class PPUCanvasWebGL implements IFamCanvas {
     private vertexArray: Float32Array;
     private clip: boolean;
     private height: number;
+    // テクスチャを確保済みか(以降は変わった行だけ転送する)
+    private allocated = false;
+    // テクスチャの大きさ(NTSCフィルターや拡大で変わる)
+    private width = 256;
+    private textureHeight = 0;
 
     constructor(element: HTMLCanvasElement) {
         this.clip = element.height * 256 / element.width < 230;
@@ -124,9 +154,29 @@ export class PPUCanvasWebGL implements IFamCanvas {
         return buffer;
     }
 
-    render(image: Uint8ClampedArray): void {
+    render(image: Uint8ClampedArray, dirty?: { start: number; count: number; }[], width = 256): void {
         this.gl.bindTexture(this.gl.TEXTURE_2D, this.texture);
-        this.gl.texImage2D(this.gl.TEXTURE_2D, 0, this.gl.RGBA, 256, this.height, 0, this.gl.RGBA, this.gl.UNSIGNED_BYTE, image);
+        const height = image.length / 4 / width;
+        if (width !== this.width || height !== this.textureHeight) {
+            // 縮小するときは補間する
+            this.width = width;
+            this.textureHeight = height;
+            this.allocated = false;
+            const filter = width > 512 ? this.gl.LINEAR : this.gl.NEAREST;
+            this.gl.texParameteri(this.gl.TEXTURE_2D, this.gl.TEXTURE_MIN_FILTER, filter);
+            this.gl.texParameteri(this.gl.TEXTURE_2D, this.gl.TEXTURE_MAG_FILTER, filter);
+        }
+        if (dirty && this.allocated) {
+            // 変わった行だけ転送する
+            for (const range of dirty) {
+                const begin = range.start * width * 4;
+                this.gl.texSubImage2D(this.gl.TEXTURE_2D, 0, 0, range.start, width, range.count, this.gl.RGBA, this.gl.UNSIGNED_BYTE,
+                    image.subarray(begin, begin + range.count * width * 4));
+            }
+        } else {
+            this.gl.texImage2D(this.gl.TEXTURE_2D, 0, this.gl.RGBA, width, height, 0, this.gl.RGBA, this.gl.UNSIGNED_BYTE, image);
+            this.allocated = true;
+        }
 
         this.gl.useProgram(this.program);
         this.gl.bindBuffer(this.gl.ARRAY_BUFFER, this.buffer);
@@ -223,7 +273,29 @@ export class WorkerSound implements IFamSound {
     }
 }
 
-export class Mapper0 extends Mapper {
+/**
+ * wasm側(cpu.cpp)で動くマッパー
+ * バンク切り替えはwasm内で行うので、ここでは登録と初期化だけ
+ */
+abstract class NativeMapper extends Mapper {
+    protected isNative(): boolean {
+        return true;
+    }
+    protected initRom(): void {
+        this.cpu!.resetMapper();
+    }
+    protected writeRom(addr: number, data: number): void {
+        // wasm側で処理するので呼ばれない
+    }
+    protected readRom(addr: number): number {
+        return this.cpu!.readBus(addr);
+    }
+    protected readExtRam(addr: number): number {
+        return addr >= 0x6000 ? this.cpu!.readBus(addr) : 0;
+    }
+}
+
+export class Mapper0 extends NativeMapper {
     private constructor(nesFile: NesFile) {
         super(nesFile);
     }
@@ -232,238 +304,36 @@ export class Mapper0 extends Mapper {
     public static create(nes: NesFile): Mapper {
         return new Mapper0(nes);
     }
-    protected writeRom(addr: number, data: number): void {
-        // Mapper0ではROMへの書き込みは無視されます
-    }
-    protected initRom(): void {
-        this.setChrBank(0, 0);
-        this.setPrgBank(1, this.getPrgBankCount() - 1);
-        if (this.nesFile.prgBankList.length > 1) {
-            this.setPrgBank(0, 0);
-        }
-    }
 }
-export class Mapper1 extends Mapper {
-    private count: number;
-    private data: number;
-    /**
-     * 0-1: ミラーリング(0=)
-     * 2: PRGバンク固定: 0-8000切り替え, 1-c000切り替え
-     * 3: PRG単位: 0-32k, 1-16k
-     * 4: CHR単位: 0-8k, 1-4k
-     */
-    private mode: number = 0;
-
-    private pageInfo = {
-        lowPage: 0,
-        highPage: 0,
-        swapPage: 0,
-        size512: false
-    };
+export class Mapper1 extends NativeMapper {
+    private constructor(nesFile: NesFile) {
+        super(nesFile);
+    }
 
     @Mapper.entry(1)
     public static create(nes: NesFile): Mapper {
         return new Mapper1(nes);
     }
-
+}
+class Mapper2 extends NativeMapper {
     private constructor(nesFile: NesFile) {
         super(nesFile);
-        this.count = 0;
-        this.data = 0;
     }
 
-    protected initRom(): void {
-        this.count = 0;
-        this.data = 0;
-        this.setChrBankSize(0x1000);
-        // 16k=on, low=on
-        this.mode = 0xc;
-        this.pageInfo.size512 = this.getPrgBankCount() > 16;
-        this.pageInfo.lowPage = -1;
-        this.pageInfo.highPage = -1;
-        this.selectPrgPage(0, (this.getPrgBankCount() - 1) & 0xf, 0);
-        this.setChrBank(0, 0);
-        this.setChrBank(1, 1);
-    }
-    protected writeRom(addr: number, data: number): void {
-        //console.log("MapperWrite: " + addr.toString(16) + "=" + data.toString(16));
-        if ((data & 0x80) > 0) {
-            this.count = this.data = 0;
-            this.mode |= 0xc;   // PRG-ROM bank mode = 3 にする
-            return;
-        }
-        this.data |= ((data & 1) << this.count);
-        this.count++;
-        if (this.count < 5) {
-            return;
-        }
-        let reg = this.data;
-        this.data = 0;
-        this.count = 0;
-        if (addr < 0xa000) {
-            // 設定
-            this.mode = reg;
-            this.ppu?.setMirrorMode(reg & 3);
-            //console.log("Change Mode:" + this.mode.toString(16));
-        } else if (addr < 0xc000) {
-            if (this.pageInfo.size512) {
-                this.selectPrgPage(this.pageInfo.lowPage, this.pageInfo.highPage, reg & 0x10);
-            }
-            // CHR bank0
-            if (this.mode & 0x10) {
-                // 4k
-                this.setChrBank(0, reg);
-                //this.selectChrBank(0, reg, 1);
-            } else {
-                // 8k
-                this.setChrBank(0, reg & ~1).setChrBank(1, reg | 1);
-                //this.selectChrBank(0, reg);
-            }
-        } else if (addr < 0xe000) {
-            // CHR bank0
-            if (this.mode & 0x10) {
-                // 4k
-                this.setChrBank(1, reg);
-                //this.selectChrBank(1, reg, 1);
-            } else {
-                // 8k
-                //this.setChrBank(0, reg >> 1, 8);
-            }
-        } else {
-            // prg
-            //console.log("Prg:" + reg);
-            if (this.mode & 0x8) {
-                // 16k
-                if (this.mode & 4) {
-                    // last fix, 8000 change
-                    this.selectPrgPage(reg & 0xf, (this.getPrgBankCount() - 1) & 0xf, this.pageInfo.swapPage);
-                } else {
-                    // first fix, c000 change
-                    this.selectPrgPage(0, reg & 0xf, this.pageInfo.swapPage);
-                }
-            } else {
-                // 32k TODO
-                this.selectPrgPage(reg & 0xe, (reg & 0xe) | 1, this.pageInfo.swapPage);
-            }
-        }
-    }
-    private selectPrgPage(low: number, high: number, swap: number): void {
-        if (low != this.pageInfo.lowPage || swap != this.pageInfo.swapPage) {
-            this.pageInfo.lowPage = low;
-            this.setPrgBank(0, swap | low);
-            //console.log("Change Low:" + low + " swap:" + swap);
-        }
-        if (high != this.pageInfo.highPage || swap != this.pageInfo.swapPage) {
-            this.pageInfo.highPage = high;
-            this.setPrgBank(1, swap | high);
-            //console.log("Change High:" + high + " swap:" + swap);
-        }
-        this.pageInfo.swapPage = swap;
-    }
-}
-
-class Mapper2 extends Mapper {
     @Mapper.entry(2)
     public static create(nes: NesFile): Mapper {
         return new Mapper2(nes);
     }
-
+}
+class MapperMMC3 extends NativeMapper {
     private constructor(nesFile: NesFile) {
         super(nesFile);
     }
 
-    protected initRom(): void {
-        this.setPrgBank(0, 0);
-        this.setPrgBank(1, this.nesFile.prgBankList.length - 1);
-        this.setChrBank(0, 0);
-    }
-    protected writeRom(addr: number, data: number): void {
-        //console.log("Change Bank:" + data);
-        this.setPrgBank(0, data);
-    }
-}
-class MapperMMC3 extends Mapper {
-    private selectMode = 0;
-    private pageInfo = {
-        evenPage: 0,
-        oddPage: 1
-    };
-
     @Mapper.entry(4)
     public static create(nes: NesFile): Mapper {
         return new MapperMMC3(nes);
     }
-
-    private constructor(nesFile: NesFile) {
-        super(nesFile);
-    }
-
-    protected initRom(): void {
-        this.pageInfo.evenPage = 0;
-        this.pageInfo.oddPage = 1;
-        this.setPrgBankSize(0x2000).setChrBankSize(0x400);
-        this.setPrgBank(0, this.getPrgBankCount() - 2);
-        this.setPrgBank(1, this.pageInfo.oddPage);
-        this.setPrgBank(2, this.pageInfo.evenPage);
-        this.setPrgBank(3, this.getPrgBankCount() - 1);
-    }
-    private selectChrBank(bank: number, index: number, size: number): void {
-        const vram = bank * 0x400;
-        const chr = this.nesFile.prgBankList[index >> 4];
-        const from = (index & 15) * 0x400;
-        for (let i = 0; i < size * 0x400; i++) {
-            this.ppu!.writeVram(vram + i, chr[from + i]);
-        }
-    }
-    protected writeRom(addr: number, data: number): void {
-        if (addr < 0xa000) {
-            if (addr & 1) {
-                // odd bank
-                let bank = 0;
-                let chr = true;
-                let size = 2;
-                const mode = this.selectMode & 7;
-                if (mode === 6) {
-                    this.pageInfo.evenPage = data;
-                    if (this.selectMode & 0x40) {
-                        this.setPrgBank(2, data);
-                    } else {
-                        this.setPrgBank(0, data);
-                    }
-                } else if (mode === 7) {
-                    this.pageInfo.oddPage = data;
-                    this.setPrgBank(1, data);
-                } else {
-                    // R0*2, R1*2, R2, R3, R4, R5
-                    // R2, R3, R4, R5, R0*2, R1*2
-                    let size = 2;
-                    let bank = 0;
-                    if (mode < 2) {
-                        bank = mode * 2;
-                    } else {
-                        size = 1;
-                        bank = mode + 2;
-                    }
-                    if (this.selectMode & 0x80) {
-                        bank ^= 4;
-                    }
-                    for (let i = 0; i < size; i++) {
-                        this.setChrBank(bank + i, data + i);
-                    }
-                }
-            } else {
-                // even
-                this.selectMode = data;
-                if (data & 0x40) {
-                    this.setPrgBank(0, this.getPrgBankCount() - 2);
-                    this.setPrgBank(2, this.pageInfo.evenPage);
-                } else {
-                    this.setPrgBank(0, this.pageInfo.evenPage);
-                    this.setPrgBank(2, this.getPrgBankCount() - 2);
-                }
-            }
-        }
-    }
 }
 
 class MMC1java extends Mapper {
@@ -511,6 +381,7 @@ class MMC1java extends Mapper {
         const offset = (romPage & 1) > 0 ? 0x2000 : 0;
         const bank = this.nesFile.prgBankList[(romPage >> 1) % this.nesFile.prgBankList.length];
         this.prgBankMap[page] = bank.subarray(offset, offset + 0x2000);
+        this.cpu!.setPrgBankOffset(page, ((romPage >> 1) % this.nesFile.prgBankList.length) * 0x4000 + offset);
         return this;
     }
     //@Mapper.entry(1)
@@ -1,8 +1,43 @@
+import { hashToString, isSimdSupported } from './WasmFeature';
+
+/**
+ * Code/Data Logger のフラグ(CHR-ROM)
+ */
+export const enum ChrCdlFlag {
+    RENDER = 0x01,
+    READ = 0x02
+};
+
+/**
+ * ネームテーブルの参照先(0-3は内部VRAM)
+ */
+export const enum NameTableSource {
+    FILL = 0x04,
+    // CHR-ROMの1KBページ番号とORする
+    CHR = 0x100
+};
+
+/**
+ * ドット絵向けの拡大(renderScaled)
+ */
+export const enum ScaleMode {
+    SCALE_2X = 1,
+    SCALE_3X = 2,
+    SCALE_4X = 3,
+    // xBR-lite(2倍)
+    XBR = 4
+};
+
+/**
+ * PPUのwasmはメモリが増えることがある(キャプチャ、フレームの記録、拡大)
+ * HEAPのビューは保持せず、呼び出しのたびに作る
+ */
 export class FamPPU {
     // コールバック関数の参照を保持するための変数
     private vblankCallback = 0;
     private hblankCallback = 0;
     private cpuCallback = 0;
+    private irqCallback = 0;
 
     // シングルトンインスタンスを保持するための変数
     private static instance: FamPPU;
@@ -14,7 +49,7 @@ export class FamPPU {
     // PPUのインスタンスを取得するためのメソッド
     public static async getPPU(): Promise<FamPPU> {
         if (!this.instance) {
-            const wasmModule = await import('./wasm/ppu.js');
+            const wasmModule = isSimdSupported() ? await import('./wasm/ppu_simd.js') : await import('./wasm/ppu.js');
             const module = await wasmModule.default();
             this.instance = new FamPPU(module);
         }
@@ -49,6 +84,23 @@ export class FamPPU {
         }
     }
 
+    /**
+     * HBlankコールバックを呼ぶラインを設定する
+     * @param lines ライン番号(0-261)、省略時は表示ライン(0-239)すべて
+     */
+    public setHblankLines(lines?: number[]) {
+        const mask = new Uint32Array(this.module.HEAPU32.buffer, this.module._getHblankMask(), 9);
+        mask.fill(0);
+        if (!lines) {
+            lines = [...Array(240).keys()];
+        }
+        for (const line of lines) {
+            if (line >= 0 && line < 262) {
+                mask[line >> 5] |= 1 << (line & 31);
+            }
+        }
+    }
+
     // CPUコールバックを設定するメソッド
     public setCpuCallback(callback?: (cycle: number) => void) {
         if (this.cpuCallback) {
@@ -63,13 +115,41 @@ export class FamPPU {
         }
     }
 
+    // スキャンラインIRQ(MMC3)のコールバックを設定するメソッド
+    public setIrqCallback(callback?: (flag: number) => void) {
+        if (this.irqCallback) {
+            this.module.removeFunction(this.irqCallback);
+        }
+        if (callback) {
+            this.irqCallback = this.module.addFunction(callback, 'vi');
+            this.module._setIrqCallback(this.irqCallback);
+        } else {
+            this.irqCallback = 0;
+            this.module._setIrqCallback(0);
+        }
+    }
+
+    /**
+     * MMC3のIRQレジスタへの書き込み
+     * @param addr $C000, $C001, $E000, $E001
+     */
+    public writeMapper(addr: number, data: number): void {
+        this.module._writeMapper(addr, data);
+    }
+
+    // スキャンラインIRQを止める
+    public resetMapper(): void {
+        this.module._resetMapper();
+    }
+
     /**
      * 画面をレンダリングする
      * @param clip 上下8ドットずつをクリップするかどうか
-     * @returns レンダリングされた画面のピクセルデータ
+     * @param skip 画素の合成を省略する(タイミングやSprite0ヒットは変わらない)
+     * @returns レンダリングされた画面のピクセルデータ(スキップ時は前のフレーム)
      */
-    public renderScreen(clip = false): Uint8ClampedArray {
-        const ret = this.module._renderScreen();
+    public renderScreen(clip = false, skip = false): Uint8ClampedArray {
+        const ret = this.module._renderScreen(skip ? 1 : 0);
         if (clip) {
             return new Uint8ClampedArray(this.module.HEAPU32.buffer, ret + 256 * 8 * 4, 256 * 224 * 4);
         } else {
@@ -77,6 +157,257 @@ export class FamPPU {
         }
     }
 
+    /**
+     * トリプルバッファを使うか(有効にするとrenderScreenのたびに画面をpublishする)
+     * @param enable 使う場合はtrue
+     */
+    public setTripleBuffer(enable: boolean): void {
+        this.module._setTripleBuffer(enable ? 1 : 0);
+    }
+
+    /**
+     * publishされた最新の画面を受け取る(コピーしない)
+     * 次にacquireFrameを呼ぶまで、PPUはこの画面を書き換えない
+     * @param clip renderScreenと同じ
+     * @returns 画面とフレーム番号(前回から1つ進んでいればgetDirtyRangesが使える)
+     */
+    public acquireFrame(clip = false): { image: Uint8ClampedArray; frame: number; } {
+        const ret = this.module._acquireFrame();
+        const frame = this.module._getAcquiredFrame();
+        if (clip) {
+            return { image: new Uint8ClampedArray(this.module.HEAPU32.buffer, ret + 256 * 8 * 4, 256 * 224 * 4), frame };
+        } else {
+            return { image: new Uint8ClampedArray(this.module.HEAPU32.buffer, ret, 256 * 240 * 4), frame };
+        }
+    }
+
+    /**
+     * CPUのバスアクセスの位置まで描画を進める(レジスタやバンクに触る直前に呼ぶ)
+     * @param remain FamCPU.getBusCycle()
+     */
+    public syncCpu(remain: number): void {
+        this.module._syncCpu(remain);
+    }
+
+    /**
+     * CPUをまとめて進めるタイル数
+     * @param tiles 1: タイルごと, 32: ラインごと(syncCpuを使う場合)
+     */
+    public setCpuInterleave(tiles: number): void {
+        this.module._setCpuInterleave(tiles);
+    }
+
+    /**
+     * 直前のフレームのレジスタ書き込み
+     * @returns dotはPPUサイクル(0がpre renderライン、ラインnのドットdは(n + 1) * 341 + d)
+     */
+    public getWriteLog(): { dot: number; addr: number; value: number; }[] {
+        const count = this.module._getWriteLogCount();
+        const log = new Uint32Array(this.module.HEAPU32.buffer, this.module._getWriteLog(), count * 2);
+        const ret: { dot: number; addr: number; value: number; }[] = [];
+        for (let i = 0; i < count; i++) {
+            ret.push({ dot: log[i * 2], addr: 0x2000 | (log[i * 2 + 1] >> 8), value: log[i * 2 + 1] & 0xff });
+        }
+        return ret;
+    }
+
+    /**
+     * パターンテーブルのデバッグ表示(128x128)
+     * @param table 0: $0000, 1: $1000
+     * @param palette 0-3: BG, 4-7: スプライト
+     * @param onlyIfChanged trueなら、前回から変わっていないときnull
+     */
+    public renderPatternView(table: number, palette: number, onlyIfChanged = false): Uint8ClampedArray | null {
+        return this.viewImage(this.module._renderPatternView(table, palette, onlyIfChanged ? 1 : 0), 128, 128);
+    }
+
+    /**
+     * 4つのネームテーブルのデバッグ表示(512x480、次のフレームのスクロール位置に枠)
+     * @param onlyIfChanged trueなら、前回から変わっていないときnull
+     */
+    public renderNameTableView(onlyIfChanged = false): Uint8ClampedArray | null {
+        return this.viewImage(this.module._renderNameTableView(onlyIfChanged ? 1 : 0), 512, 480);
+    }
+
+    /**
+     * スプライト(OAM)のデバッグ表示(64x128、8x16のセルに8x8個)
+     * @param onlyIfChanged trueなら、前回から変わっていないときnull
+     */
+    public renderOamView(onlyIfChanged = false): Uint8ClampedArray | null {
+        return this.viewImage(this.module._renderOamView(onlyIfChanged ? 1 : 0), 64, 128);
+    }
+
+    /**
+     * パレットのデバッグ表示(128x16、上がBG、下がスプライト)
+     * @param onlyIfChanged trueなら、前回から変わっていないときnull
+     */
+    public renderPaletteView(onlyIfChanged = false): Uint8ClampedArray | null {
+        return this.viewImage(this.module._renderPaletteView(onlyIfChanged ? 1 : 0), 128, 16);
+    }
+
+    private viewImage(ptr: number, width: number, height: number): Uint8ClampedArray | null {
+        return ptr ? new Uint8ClampedArray(this.module.HEAPU32.buffer, ptr, width * height * 4) : null;
+    }
+
+    /**
+     * 背景のキャッシュを使うか(ネームテーブルを描いた画像から転送する、既定は使う)
+     * @param enable 使わない場合はfalse
+     */
+    public setBgCache(enable: boolean): void {
+        this.module._setBgCache(enable ? 1 : 0);
+    }
+
+    /**
+     * NTSCフィルターを使うか(有効にしてからrenderNtscを呼ぶ)
+     * @param enable 使う場合はtrue
+     */
+    public setNtscFilter(enable: boolean): void {
+        this.module._setNtscFilter(enable ? 1 : 0);
+    }
+
+    /**
+     * 直前のrenderScreenの画面をNTSCフィルターで変換する
+     * @param clip 上下8ドットずつをクリップするかどうか
+     * @returns 幅602ピクセルの画面
+     */
+    public renderNtsc(clip = false): Uint8ClampedArray {
+        const ret = this.module._renderNtsc();
+        if (clip) {
+            return new Uint8ClampedArray(this.module.HEAPU32.buffer, ret + 602 * 8 * 4, 602 * 224 * 4);
+        } else {
+            return new Uint8ClampedArray(this.module.HEAPU32.buffer, ret, 602 * 240 * 4);
+        }
+    }
+
+    /**
+     * 直前のrenderScreenの画面を拡大する(変わった行の近くだけ作り直す)
+     * @param mode 拡大の方法
+     * @param clip 上下8ドットずつをクリップするかどうか
+     * @returns 拡大した画面と幅、作り直した行の範囲(出力の行)
+     */
+    public renderScaled(mode: ScaleMode, clip = false): { image: Uint8ClampedArray; width: number; dirty: { start: number; count: number; }[]; } {
+        const scale = mode === ScaleMode.SCALE_3X ? 3 : mode === ScaleMode.SCALE_4X ? 4 : 2;
+        const width = 256 * scale;
+        const ret = this.module._renderScaled(mode);
+        const dirty = this.toRanges(this.module._getScaledDirtyLines(), clip, scale);
+        if (clip) {
+            return { image: new Uint8ClampedArray(this.module.HEAPU32.buffer, ret + width * 8 * scale * 4, width * 224 * scale * 4), width, dirty };
+        } else {
+            return { image: new Uint8ClampedArray(this.module.HEAPU32.buffer, ret, width * 240 * scale * 4), width, dirty };
+        }
+    }
+
+    /**
+     * 画素を合成するラインの範囲(複数のインスタンスで分担して描画する)
+     * @param start 最初のライン(0-239)
+     * @param count ライン数
+     */
+    public setRenderBand(start = 0, count = 240): void {
+        this.module._setRenderBand(start, count);
+    }
+
+    /**
+     * 画面キャプチャを始める(パレット番号を前のフレームとの差分で圧縮して記録する)
+     * @param keyInterval キーフレームの間隔(フレーム数、0は最初だけ)
+     */
+    public startCapture(keyInterval = 600): void {
+        this.module._startCapture(keyInterval);
+    }
+
+    /**
+     * 画面キャプチャを止めて、記録を返す(tools/capture_decodeでY4M/PNGにできる)
+     * @returns 記録のコピー(PPU側の記録は捨てる)
+     */
+    public stopCapture(): Uint8Array {
+        this.module._stopCapture();
+        const ptr = this.module._getCaptureData();
+        const data = this.module.HEAPU8.slice(ptr, ptr + this.module._getCaptureSize());
+        this.module._clearCapture();
+        return data;
+    }
+
+    // 記録したフレーム数
+    public getCaptureFrames(): number {
+        return this.module._getCaptureFrames();
+    }
+
+    /**
+     * 描画の記録(別のPPUインスタンスでreplayFrameするため)
+     * @param enable 記録する場合はtrue
+     */
+    public setFrameRecord(enable: boolean): void {
+        this.module._setFrameRecord(enable ? 1 : 0);
+    }
+
+    // 直前のrenderScreenの記録(コピー)、溢れた場合はnull
+    public getFrameLog(): Uint32Array | null {
+        const size = this.module._getFrameLogSize();
+        if (size < 0) {
+            return null;
+        }
+        return new Uint32Array(this.module.HEAPU32.buffer, this.module._getFrameLog(), size).slice();
+    }
+
+    /**
+     * 記録した1フレームを描画する(CHR-ROMはloadChrRomで読み込んでおく)
+     * @param log getFrameLogの戻り値
+     * @param clip renderScreenと同じ
+     */
+    public replayFrame(log: Uint32Array, clip = false): Uint8ClampedArray {
+        // 確保でメモリが増えることがあるので、HEAPU32は後で取る
+        const ptr = this.module._getReplayBuffer();
+        this.module.HEAPU32.set(log, ptr >> 2);
+        const ret = this.module._replayFrame(log.length);
+        if (clip) {
+            return new Uint8ClampedArray(this.module.HEAPU32.buffer, ret + 256 * 8 * 4, 256 * 224 * 4);
+        } else {
+            return new Uint8ClampedArray(this.module.HEAPU32.buffer, ret, 256 * 240 * 4);
+        }
+    }
+
+    // 画面のハッシュ(16桁の16進数、tools/capture_decode --hashと同じ値)
+    public hashScreen(): string {
+        return hashToString(this.module.HEAPU32, this.module._hashScreen());
+    }
+
+    // PPUの状態(レジスタ、VRAM、OAM、パレット、ページの割り当て)のハッシュ
+    public hashState(): string {
+        return hashToString(this.module.HEAPU32, this.module._hashState());
+    }
+
+    // 直前のrenderScreenで画面が変わったか(変わっていなければ転送を省略できる)
+    public isScreenChanged(): boolean {
+        return this.module._isScreenChanged() !== 0;
+    }
+
+    /**
+     * 直前のrenderScreenで変わったラインの範囲
+     * @param clip renderScreenと同じ(上8ラインを除いた行番号にする)
+     * @returns 変わった行の範囲(start行からcount行)
+     */
+    public getDirtyRanges(clip = false): { start: number; count: number; }[] {
+        return this.toRanges(this.module._getDirtyLines(), clip, 1);
+    }
+
+    // ラインのビットマップを行の範囲にする(scaleは出力の倍率)
+    private toRanges(ptr: number, clip: boolean, scale: number): { start: number; count: number; }[] {
+        const bits = new Uint32Array(this.module.HEAPU32.buffer, ptr, 8);
+        const top = clip ? 8 : 0;
+        const bottom = clip ? 232 : 240;
+        const ranges: { start: number; count: number; }[] = [];
+        let start = -1;
+        for (let line = top; line <= bottom; line++) {
+            const dirty = line < bottom && (bits[line >> 5] & (1 << (line & 31))) !== 0;
+            if (dirty && start < 0) {
+                start = line;
+            } else if (!dirty && start >= 0) {
+                ranges.push({ start: (start - top) * scale, count: (line - start) * scale });
+                start = -1;
+            }
+        }
+        return ranges;
+    }
+
     // メモリにデータを書き込むメソッド
     public writeMem(addr: number, data: number) {
         //console.log("VRAM:" + addr.toString(16) + "=" + data.toString(16));
@@ -98,11 +429,97 @@ export class FamPPU {
         return this.module._readVram(addr);
     }
 
+    // VRAMをまとめて読み込む(コピーを返す)
+    public readVramRange(addr: number, length: number): Uint8Array {
+        const buf = this.module._readVramRange(addr, length);
+        return new Uint8Array(this.module.HEAPU8.buffer, buf, Math.min(length, 0x4000)).slice();
+    }
+
+    // VRAMにまとめて書き込む
+    public writeVramRange(addr: number, data: Uint8Array) {
+        const length = Math.min(data.length, 0x4000);
+        this.module.HEAPU8.set(data.subarray(0, length), this.module._getVramTransferBuffer());
+        this.module._writeVramRange(addr, length);
+    }
+
+    /**
+     * ネームテーブルの参照先を設定する(マッパー制御)
+     * @param index 0-3($2000,$2400,$2800,$2C00)
+     * @param source 0-3: 内部VRAM, NameTableSource.FILL, NameTableSource.CHR | ページ番号
+     */
+    public setNameTableSource(index: number, source: number) {
+        this.module._setNameTableSource(index, source);
+    }
+
+    // フィルモードのタイルと属性(0-3)
+    public setFillTile(tile: number, attr: number) {
+        this.module._setFillTile(tile, attr);
+    }
+
     // スプライトにデータを書き込むメソッド
     public writeSprite(addr: number, data: number) {
         this.module._writeSprite(addr, data);
     }
 
+    // スプライトDMA(256バイトをまとめて書き込む)
+    public writeSpriteDma(data: Uint8Array) {
+        this.module.HEAPU8.set(data, this.module._getDmaBuffer());
+        this.module._writeSpriteDma();
+    }
+
+    /**
+     * CHRバンクの切り替えを通知する
+     * @param bank 0-7(1KB単位)
+     * @param offset CHR-ROM内のオフセット、-1はCHR-RAM
+     */
+    public setChrBankOffset(bank: number, offset: number): void {
+        this.module._setChrBankOffset(bank, offset);
+    }
+
+    // CHR-ROMをwasm側にコピーする
+    public loadChrRom(bankList: Uint8Array[]): void {
+        const buf = this.module._loadChrRom(bankList.length * 0x2000);
+        bankList.forEach((bank, i) => this.module.HEAPU8.set(bank, buf + i * 0x2000));
+    }
+
+    /**
+     * CHRバンクを切り替える
+     * @param bank 0-7(1KB単位)
+     * @param offset CHR-ROM内のオフセット
+     */
+    public setChrBank(bank: number, offset: number): void {
+        this.module._setChrBank(bank, offset);
+    }
+
+    /**
+     * CDLを開始する
+     * @param size CHR-ROMのサイズ
+     * @returns CDLが無効なビルドではfalse
+     */
+    public initCdl(size: number): boolean {
+        return this.module._initCdl(size) !== 0;
+    }
+
+    // CDLの記録(コピーではない)
+    public getCdl(): Uint8Array | null {
+        const size = this.module._getCdlSize();
+        if (!size) {
+            return null;
+        }
+        return new Uint8Array(this.module.HEAPU8.buffer, this.module._getCdlData(), size);
+    }
+
+    // 以前のCDLを合成する
+    public mergeCdl(data: Uint8Array): void {
+        const cdl = this.getCdl();
+        if (cdl) {
+            const size = Math.min(cdl.length, data.length);
+            for (let i = 0; i < size; i++) {
+                cdl[i] |= data[i];
+            }
+        }
+    }
+
     /**
      * ミラーモードを設定するメソッド
      * @param mode 0: 1画面 lower, 1: １画面 upper, 2:垂直ミラー, 3:水平ミラー, 4:4画面
@@ -1,7 +1,8 @@
 import { FamAPU } from "./FamAPU";
-import { FamCPU } from "./FamCPU";
-import { FamPPU } from "./FamPPU";
+import { CdlFlag, FamCPU, IrqSource } from "./FamCPU";
+import { FamPPU, ScaleMode } from "./FamPPU";
 import { openDB } from "idb";
+import { isSimdSupported } from "./WasmFeature";
 
 // IndexedDB のデータベースを開く
 const DB_NAME = "WebNes";
@@ -102,7 +103,12 @@ export class NesFile {
  * 画面描画
  */
 export interface IFamCanvas {
-    render(image: Uint8ClampedArray): void;
+    /**
+     * @param image 画面全体
+     * @param dirty 前回から変わった行の範囲(省略時は全体)
+     * @param width 画面の幅(NTSCフィルターや拡大で256以外になる)
+     */
+    render(image: Uint8ClampedArray, dirty?: { start: number; count: number; }[], width?: number): void;
     isClip(): boolean;
     powerOff(): void;
 }
@@ -149,6 +155,23 @@ export abstract class Mapper {
     protected ppu?: FamPPU;
     protected apu?: FamAPU;
     protected canvas?: IFamCanvas;
+    // 描画用のWorker(setDeferredRender)、ラインを分担する
+    private renderWorkers: Worker[] = [];
+    // 返事を待っているWorkerの数
+    private renderPending = 0;
+    // Workerから返ってきたラインを集めた画面(240ライン)
+    private renderImage = new Uint8ClampedArray(256 * 240 * 4);
+    private renderDirty: { start: number; count: number; }[] = [];
+    private renderClip = false;
+    // NTSCフィルター(setNtscFilter)
+    private ntscFilter = false;
+    // ドット絵向けの拡大(setScaleMode)
+    private scaleMode?: ScaleMode;
+    // 最後にacquireFrameで受け取った画面の番号
+    private acquiredFrame = -1;
+    // 毎フレームのハッシュの出力先(setHashStream)
+    private hashStream?: (line: string) => void;
+    private hashFrame = 0;
     protected padList: (IFamPad | null)[] = [null, null, null, null];
     protected sound?: IFamSound;
     protected padData: {
@@ -183,6 +206,16 @@ export abstract class Mapper {
 
     private soundCount = 0;
 
+    /**
+     * Code/Data Logger が有効なビルドかどうか
+     */
+    protected cdlEnabled = false;
+
+    /**
+     * wasm側のマッパーで動いているかどうか
+     */
+    protected native = false;
+
     protected constructor(protected nesFile: NesFile) {
     }
 
@@ -231,26 +264,39 @@ export abstract class Mapper {
         this.cpu.setMemReadCallback((addr: number) => this.readMem(addr));
         this.cpu.setMemWriteCallback((addr: number, data: number) => this.writeMem(addr, data));
         //this.cpu.setApuStepCallback((cycle: number) => this.stepApu(cycle));
-        this.ppu.setHblankCallback(y => {
-            if (y === 0 || y === 131 || y == 65 || y == 196) {
-                this.stepApu();
-            }
-        });
+        // APUは1フレーム4回(240Hz)
+        this.ppu.setHblankLines([0, 65, 131, 196]);
+        this.ppu.setTripleBuffer(true);
+        this.ppu.setHblankCallback(() => this.stepApu());
         this.apu.setDmcCallback(addr => {
             this.cpu.skip(4);
+            if (this.cdlEnabled) {
+                this.cpu.logCdl(addr, CdlFlag.PCM);
+            }
             return this.readMem(addr);
         });
+        const dmaBuf = this.cpu.getDmaBuffer();
+        this.cpu.setDmaCallback(() => this.ppu!.writeSpriteDma(dmaBuf));
         this.ppu.setVblankCallback(() => this.vblank());
         this.ppu.setCpuCallback((cycle: number) => this.stepCpu(cycle));
-        this.apu.setIrqCallback(flag => this.cpu!.irq(flag));
+        // PPUへのアクセスはsyncCpuで位置を合わせるので、CPUはラインごとにまとめて進める
+        this.ppu.setCpuInterleave(32);
+        this.apu.setIrqCallback((source, flag) => this.cpu!.irq(source, flag));
         this.ppu.setMirrorMode(this.nesFile.mirrorMode);
+        this.native = this.initNative();
         if (this.nesFile.batteryBacked) {
-            this.batteryRam = new Uint8Array(0x2000);
+            this.batteryRam = this.native ? this.cpu.getWram() : new Uint8Array(0x2000);
             const data = await loadBinaryData(await this.nesFile.getId());
             if (data) {
                 this.batteryRam.set(data);
             }
         }
+        this.cdlEnabled = this.cpu.initCdl(this.nesFile.prgBankList.length * 0x4000);
+        if (this.cdlEnabled) {
+            this.ppu.initCdl(this.nesFile.chrBankList.length * 0x2000);
+            await this.loadCdl();
+        }
+        this.cpu.clearDisasmCache();
         this.initRom();
         let counter = 0;
         let outFlag = false;
@@ -304,12 +350,77 @@ export abstract class Mapper {
         });
         */
     }
+    /**
+     * wasm側のマッパーを使う場合はtrueを返す
+     */
+    protected isNative(): boolean {
+        return false;
+    }
+    /**
+     * wasm側のマッパーを初期化する
+     * RAM, WRAM, PRG-ROMの読み書きとバンク切り替えはwasm内で行う
+     */
+    private initNative(): boolean {
+        this.ppu!.resetMapper();
+        if (!this.isNative()) {
+            this.cpu!.initMapper(-1);
+            return false;
+        }
+        this.cpu!.loadPrgRom(this.nesFile.prgBankList);
+        this.ppu!.loadChrRom(this.nesFile.chrBankList);
+        this.cpu!.setChrBankCallback((bank, offset) => {
+            this.ppu!.syncCpu(this.cpu!.getBusCycle());
+            this.ppu!.setChrBank(bank, offset);
+        });
+        this.cpu!.setMirrorCallback(mode => {
+            this.ppu!.syncCpu(this.cpu!.getBusCycle());
+            this.ppu!.setMirrorMode(mode);
+        });
+        this.cpu!.setMapperWriteCallback((addr, data) => this.ppu!.writeMapper(addr, data));
+        this.ppu!.setIrqCallback(flag => this.cpu!.irq(IrqSource.MAPPER, flag));
+        if (!this.cpu!.initMapper(this.nesFile.mapper, this.nesFile.chrBankList.length * 0x2000, this.nesFile.mirrorMode)) {
+            return false;
+        }
+        this.ram = this.cpu!.getRam();
+        return true;
+    }
     private stepApu(): void {
         const buf = this.apu!.step(this.sound.samples);
         if (this.sound) {
             this.sound.play(buf);
         }
     }
+    /**
+     * 保存済みのCDLを現在の記録に合成する
+     */
+    public async loadCdl(): Promise<void> {
+        const data = await loadBinaryData(await this.nesFile.getId() + ".cdl");
+        if (data) {
+            const prg = this.cpu!.getCdl();
+            this.cpu!.mergeCdl(data);
+            if (prg) {
+                this.ppu!.mergeCdl(data.subarray(prg.length));
+            }
+        }
+    }
+    /**
+     * CDLを保存する(PRG, CHRの順)
+     * @returns 保存したデータ、CDLが無効なビルドではnull
+     */
+    public async saveCdl(): Promise<Uint8Array | null> {
+        const prg = this.cpu!.getCdl();
+        if (!prg) {
+            return null;
+        }
+        const chr = this.ppu!.getCdl();
+        const data = new Uint8Array(prg.length + (chr ? chr.length : 0));
+        data.set(prg);
+        if (chr) {
+            data.set(chr, prg.length);
+        }
+        await saveBinaryData(await this.nesFile.getId() + ".cdl", data);
+        return data;
+    }
     public setPad(player: number, pad: IFamPad | null): Mapper {
         this.padList[player] = pad;
         return this;
@@ -324,6 +435,7 @@ export abstract class Mapper {
         let fromAddr = index * this.prgBankSize;
         for (let offset = 0; offset < this.prgBankSize; offset += 0x2000) {
             this.prgBankMap[(addr >> 13) & 3] = this.nesFile.prgBankList[fromAddr >> 14].subarray(fromAddr & 0x3fff, (fromAddr & 0x3fff) + 0x2000);
+            this.cpu!.setPrgBankOffset((addr >> 13) & 3, fromAddr);
             addr += 0x2000;
             fromAddr += 0x2000;
         }
@@ -345,6 +457,9 @@ export abstract class Mapper {
         for (let i = 0; i < this.chrBankSize; i++) {
             this.ppu!.writeVram(addr + i, chr[(fromAddr & 0x1fff) + i]);
         }
+        for (let i = 0; i < this.chrBankSize; i += 0x400) {
+            this.ppu!.setChrBankOffset((addr + i) >> 10, fromAddr + i);
+        }
         return this;
     }
     public getPrgBankSize(): number {
@@ -395,6 +510,7 @@ export abstract class Mapper {
         if (addr < 0x2000) {
             return this.ram[addr & 0x7ff];
         } else if (addr < 0x4000) {
+            this.ppu!.syncCpu(this.cpu!.getBusCycle());
             return this.ppu!.readMem(addr);
         } else if (addr == 0x4016 || addr == 0x4017) {
             // controller
@@ -426,14 +542,8 @@ export abstract class Mapper {
             this.ram[addr & 0x7ff] = data;
         } else if (addr < 0x4000) {
             //console.log("ppu.writeMem(0x" + addr.toString(16) + ",0x" + data.toString(16) + ");");
+            this.ppu!.syncCpu(this.cpu!.getBusCycle());
             this.ppu!.writeMem(addr, data);
-        } else if (addr == 0x4014) {
-            // Sprite DMA
-            const startAddr = data << 8;
-            for (let i = 0; i < 256; i++) {
-                this.ppu!.writeMem(0x2004, this.readMem(startAddr + i));
-            }
-            this.cpu!.skip(513);
         } else if (addr == 0x4016) {
             // TODO controller
             if (this.padData.reg !== (data & 1)) {
@@ -447,6 +557,8 @@ export abstract class Mapper {
         } else if (addr < 0x8000) {
             this.writeExtRam(addr, data);
         } else {
+            // バンク切り替えの位置まで描画を進める
+            this.ppu!.syncCpu(this.cpu!.getBusCycle());
             this.writeRom(addr, data);
         }
     }
@@ -497,22 +609,205 @@ export abstract class Mapper {
 
     /**
      * フレームを進める
+     * @param skip 画面を描画しない(早送りなど)
      */
-    public stepFrame(): void {
-        const image = this.ppu!.renderScreen(this.canvas!.isClip());
-        this.canvas!.render(image);
+    public stepFrame(skip = false): void {
+        this.cpu!.startFrame();
+        const clip = this.canvas!.isClip();
+        this.ppu!.renderScreen(clip, skip || this.renderWorkers.length > 0);
+        if (this.renderWorkers.length) {
+            if (!skip) {
+                this.postRenderFrame(clip);
+            }
+        } else if (!skip && this.ntscFilter) {
+            // 色副搬送波の位相がフレームごとに変わるので、毎回全体を転送する
+            this.canvas!.render(this.ppu!.renderNtsc(clip), undefined, 602);
+        } else if (!skip && this.scaleMode) {
+            const scaled = this.ppu!.renderScaled(this.scaleMode, clip);
+            if (scaled.dirty.length) {
+                this.canvas!.render(scaled.image, scaled.dirty, scaled.width);
+            }
+        } else if (!skip) {
+            // 毎フレーム受け取って、番号が飛んだら全体を転送する
+            const frame = this.ppu!.acquireFrame(clip);
+            const next = frame.frame === this.acquiredFrame + 1;
+            this.acquiredFrame = frame.frame;
+            if (!next) {
+                this.canvas!.render(frame.image);
+            } else if (this.ppu!.isScreenChanged()) {
+                this.canvas!.render(frame.image, this.ppu!.getDirtyRanges(clip));
+            }
+        }
+        if (this.hashStream) {
+            const hash = this.hashState();
+            this.hashStream(`${this.hashFrame++} ${hash.screen} ${hash.cpu} ${hash.ppu} ${hash.apu}`);
+        }
+        if (this.stopCallback) {
+            const reason = this.cpu!.getStopReason();
+            if (reason) {
+                this.stopPlay();
+                this.stopCallback({ reason, cycle: this.cpu!.getStopCycle(), addr: this.cpu!.getStopAddr() });
+            }
+        }
+        if (this.native && this.batteryRam && this.cpu!.checkWramWrite()) {
+            this.batteryCount = 10;
+        }
         if (this.batteryCount > 0) {
             this.batteryCount--;
             if (this.batteryCount === 0) {
                 //console.log("Save Battery");
                 this.nesFile.getId().then(id => {
-                    saveBinaryData(id, this.batteryRam).then();
+                    saveBinaryData(id, this.batteryRam.slice()).then();
                 });
             }
         }
     }
 
+    /**
+     * NTSCのコンポジット信号のフィルターを通して表示する(幅602ピクセル)
+     * Workerでの描画(setDeferredRender)中は使わない
+     */
+    public setNtscFilter(enable: boolean): void {
+        this.ntscFilter = enable;
+        this.ppu!.setNtscFilter(enable);
+        // 次のフレームは全体を転送する
+        this.acquiredFrame = -1;
+    }
+
+    /**
+     * ドット絵向けの拡大をしてから表示する
+     * @param mode 拡大の方法、省略時は拡大しない
+     */
+    public setScaleMode(mode?: ScaleMode): void {
+        this.scaleMode = mode;
+    }
+
+    /**
+     * 画面と状態のハッシュ(ビルドや描画方法の違いで結果がずれていないかを調べる)
+     * TS側のマッパーのレジスタは含まない
+     */
+    public hashState(): { screen: string; cpu: string; ppu: string; apu: string; } {
+        let ext: Uint8Array | undefined;
+        if (!this.native) {
+            ext = new Uint8Array(0x2800);
+            ext.set(this.ram);
+            if (this.batteryRam) {
+                ext.set(this.batteryRam, 0x800);
+            }
+        }
+        return { screen: this.ppu!.hashScreen(), cpu: this.cpu!.hashState(ext), ppu: this.ppu!.hashState(), apu: this.apu!.hashState() };
+    }
+
+    /**
+     * 毎フレームのハッシュを1行("フレーム 画面 CPU PPU APU")にして渡す
+     * 2回の実行の出力をdiffすれば、ずれ始めたフレームと場所がわかる
+     * @param callback 省略時は止める
+     */
+    public setHashStream(callback?: (line: string) => void): void {
+        this.hashStream = callback;
+        this.hashFrame = 0;
+    }
+
+    /**
+     * 画面キャプチャを始める(バグ報告や比較用)
+     * Workerでの描画(setDeferredRender)中は画面が記録されない
+     * @param keyInterval キーフレームの間隔(フレーム数)
+     */
+    public startCapture(keyInterval = 600): void {
+        this.ppu!.startCapture(keyInterval);
+    }
+
+    // 画面キャプチャを止めて記録を返す
+    public stopCapture(): Uint8Array {
+        return this.ppu!.stopCapture();
+    }
+
+    /**
+     * 描画をWorkerで行う(このスレッドではCPUとPPUのタイミングだけ進める)
+     * Workerが前のフレームを描画中なら、そのフレームは表示しない
+     * @param enable Workerで描画する場合はtrue
+     * @param bands Workerの数(ラインを分担する)
+     */
+    public setDeferredRender(enable: boolean, bands = 1): void {
+        this.renderWorkers.forEach(worker => worker.terminate());
+        this.renderWorkers = [];
+        this.renderDirty = [];
+        this.ppu!.setFrameRecord(enable);
+        if (!enable) {
+            return;
+        }
+        bands = Math.min(8, Math.max(1, bands));
+        const lines = Math.ceil(240 / bands);
+        // readyが来るまでは送らない
+        this.renderPending = bands;
+        for (let i = 0; i < bands; i++) {
+            // worker/ppu-render.ts(apu-player.jsと同じassetsに置く)
+            const worker = new Worker('assets/ppu-render.js', { type: 'module' });
+            worker.onmessage = (event: MessageEvent) => this.receiveRenderFrame(event.data);
+            worker.postMessage({ type: 'init', chrBankList: this.nesFile.chrBankList, start: i * lines, count: lines, simd: isSimdSupported() });
+            this.renderWorkers.push(worker);
+        }
+    }
+
+    private postRenderFrame(clip: boolean): void {
+        if (this.renderPending > 0) {
+            return;
+        }
+        // 記録が溢れたフレームは表示しない
+        const log = this.ppu!.getFrameLog();
+        if (log) {
+            this.renderClip = clip;
+            this.renderPending = this.renderWorkers.length;
+            this.renderWorkers.forEach((worker, i) => {
+                // 最後のWorkerにはバッファごと渡す
+                const last = i === this.renderWorkers.length - 1;
+                const data = last ? log : log.slice();
+                worker.postMessage({ type: 'frame', log: data }, [data.buffer]);
+            });
+        }
+    }
+
+    private receiveRenderFrame(data: any): void {
+        if (data.type === 'frame') {
+            const image = data.image as Uint8ClampedArray;
+            for (const range of data.dirty as { start: number; count: number; }[]) {
+                this.renderImage.set(image.subarray(range.start * 256 * 4, (range.start + range.count) * 256 * 4), range.start * 256 * 4);
+                this.renderDirty.push(range);
+            }
+        }
+        this.renderPending--;
+        if (this.renderPending > 0 || !this.renderDirty.length) {
+            return;
+        }
+        if (this.renderClip) {
+            // 上下8ラインを除く
+            const dirty: { start: number; count: number; }[] = [];
+            for (const range of this.renderDirty) {
+                const start = Math.max(8, range.start);
+                const end = Math.min(232, range.start + range.count);
+                if (start < end) {
+                    dirty.push({ start: start - 8, count: end - start });
+                }
+            }
+            if (dirty.length) {
+                this.canvas?.render(this.renderImage.subarray(256 * 8 * 4, 256 * 232 * 4), dirty);
+            }
+        } else {
+            this.canvas?.render(this.renderImage, this.renderDirty);
+        }
+        this.renderDirty = [];
+    }
+
     private playFlag = false;
+    private stopCallback?: (info: { reason: number; cycle: number; addr: number; }) => void;
+
+    /**
+     * CPUが停止条件で止まった時に再生を止めて通知する
+     * 再開は cpu.resume() の後に startPlay()
+     */
+    public setStopCallback(callback?: (info: { reason: number; cycle: number; addr: number; }) => void): void {
+        this.stopCallback = callback;
+    }
 
     public startPlay(): void {
         if (!this.playFlag) {
@@ -0,0 +1,30 @@
+// (func (result v128) i32.const 0 i8x16.splat i8x16.popcnt) だけのモジュール
+const simdTestModule = new Uint8Array([
+    0, 97, 115, 109, 1, 0, 0, 0, 1, 5, 1, 96, 0, 1, 123, 3, 2, 1, 0, 10, 10, 1, 8, 0, 65, 0, 253, 15, 253, 98, 11
+]);
+
+let simdSupported: boolean | undefined;
+
+/**
+ * WASM SIMDが使えるかどうか(xxx_simd.jsを読み込めるか)
+ */
+export function isSimdSupported(): boolean {
+    if (simdSupported === undefined) {
+        try {
+            simdSupported = WebAssembly.validate(simdTestModule);
+        } catch (e) {
+            simdSupported = false;
+        }
+    }
+    return simdSupported;
+}
+
+/**
+ * wasmが返した64bitのハッシュ(uint32 x 2、下位が先)を16桁の16進数にする
+ * @param heap モジュールのHEAPU32
+ * @param ptr hashStateなどの戻り値
+ */
+export function hashToString(heap: Uint32Array, ptr: number): string {
+    const index = ptr >> 2;
+    return heap[index + 1].toString(16).padStart(8, '0') + heap[index].toString(16).padStart(8, '0');
+}
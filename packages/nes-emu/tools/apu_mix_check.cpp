@@ -0,0 +1,41 @@
+/**
+ * step()の合成結果をチャンネルごとのバッファから1サンプルずつ求めた値と比べる
+ * 5チャンネルを鳴らして、183, 184, 200サンプルのstepを繰り返す
+ * apu_mix_check [step数]
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include "../wasm/apu.cpp"
+
+int main(int argc, char **argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 600;
+    powerOff();
+    setVolume(300);
+    static const uint8_t regs[][2] = {{0x15, 0x0f}, {0x00, 0xbf}, {0x02, 0x80}, {0x03, 0x01}, {0x04, 0x7f}, {0x06, 0x40}, {0x07, 0x02}, {0x08, 0xff}, {0x0a, 0x30}, {0x0b, 0x01}, {0x0c, 0x3f}, {0x0e, 0x03}, {0x0f, 0x01}, {0x11, 0x40}};
+    for (auto &r : regs)
+    {
+        writeMem(0x4000 | r[0], r[1]);
+    }
+    static const int sampleCount[3] = {183, 184, 200};
+    int bad = 0;
+    for (int n = 0; n < count; n++)
+    {
+        int samples = sampleCount[n % 3];
+        // 途中で音量と周波数を変える
+        writeMem(0x4011, (n * 7) & 0x7f);
+        writeMem(0x400a, (n * 13) & 0xff);
+        const uint8_t *result = step(samples);
+        for (int i = 0; i < samples; i++)
+        {
+            int expect = std::min(255, pulseMixValue[squareBuf[0][i] + squareBuf[1][i]] + tndMixValue[triangleBuf[i] * 3 + noiseBuf[i] * 2 + dmcBuf[i]]);
+            if (result[i] != expect && bad++ < 10)
+            {
+                fprintf(stderr, "mismatch: step %d sample %d: %d != %d\n", n, i, result[i], expect);
+            }
+        }
+    }
+    printf("%d steps, %d mismatches\n", count, bad);
+    return bad ? 1 : 0;
+}
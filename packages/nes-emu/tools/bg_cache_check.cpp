@@ -0,0 +1,129 @@
+/**
+ * 背景のキャッシュ(setBgCache)を使った画面を、使わない画面と比べる
+ * フレームごとにスナップショットへ戻して、同じ操作をキャッシュなし/ありで描画する
+ * 操作は途中のスクロール、$2000/$2001、CHRバンク、ミラー、VRAMの書き込みを乱数で作る
+ * bg_cache_check [フレーム数]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include "../wasm/ppu.cpp"
+
+static std::mt19937 eventRandom;
+
+static void cpuCycle(int cycles)
+{
+    int kind = eventRandom() % 60;
+    if (kind == 0)
+    {
+        syncCpu(eventRandom() % (cycles + 1));
+        writeMem(0x2001, (eventRandom() & 1) ? 0x1e : 0x0a);
+    }
+    else if (kind == 1)
+    {
+        syncCpu(eventRandom() % (cycles + 1));
+        writeMem(0x2005, eventRandom() & 0xff);
+    }
+    else if (kind == 2)
+    {
+        // ネームテーブルへの書き込み
+        writeMem(0x2006, 0x20 | (eventRandom() & 0xf));
+        writeMem(0x2006, eventRandom() & 0xff);
+        writeMem(0x2007, eventRandom() & 0xff);
+    }
+    else if (kind == 3)
+    {
+        syncCpu(eventRandom() % (cycles + 1));
+        setChrBank(eventRandom() & 7, (eventRandom() % 8) * 0x400);
+    }
+    else if (kind == 4)
+    {
+        syncCpu(0);
+        writeMem(0x2000, 0x10 | (eventRandom() & 0x13));
+    }
+    else if (kind == 5)
+    {
+        // パターンへの書き込み
+        writeMem(0x2006, eventRandom() & 0x1f);
+        writeMem(0x2006, eventRandom() & 0xff);
+        writeMem(0x2007, eventRandom() & 0xff);
+    }
+    else if (kind == 6)
+    {
+        setMirrorMode(eventRandom() % 4);
+    }
+    else if (kind == 7 && (eventRandom() & 7) == 0)
+    {
+        setNameTableSource(eventRandom() & 3, (eventRandom() & 1) ? NT_SOURCE_FILL : (eventRandom() & 3));
+        setFillTile(eventRandom() & 0xff, eventRandom() & 3);
+    }
+}
+
+// 同じ状態、同じ操作で1フレームを描画する
+static void renderFrame(const RenderSnapshot &snap, unsigned seed, bool cache)
+{
+    loadRenderSnapshot(&snap);
+    setBgCache(cache);
+    // 前の描画と入力が同じラインを使い回さない
+    lineInputValid = false;
+    eventRandom.seed(seed);
+    renderScreen(0);
+}
+
+int main(int argc, char **argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 400;
+    std::mt19937 random(11);
+    setCpuCallback(cpuCycle);
+    // キャッシュはラインの途中でCPUを動かさないときに使う
+    setCpuInterleave(32);
+    uint8_t *rom = loadChrRom(0x2000);
+    for (int i = 0; i < 0x2000; i++)
+    {
+        rom[i] = random();
+    }
+    for (int addr = 0; addr < 0x3000; addr++)
+    {
+        writeVram(addr, random() & 0xff);
+    }
+    for (int addr = 0; addr < 32; addr++)
+    {
+        writeVram(0x3f00 + addr, random() & 0x3f);
+    }
+    for (int addr = 0; addr < 256; addr++)
+    {
+        writeSprite(addr, random() & 0xff);
+    }
+    writeMem(0x2000, 0x10);
+    writeMem(0x2001, 0x1e);
+    static RenderSnapshot snap;
+    static uint32_t expect[256 * 240];
+    int bad = 0;
+    for (int frame = 0; frame < count; frame++)
+    {
+        // フレームの間の書き込み
+        int writes = random() % 50;
+        for (int i = 0; i < writes; i++)
+        {
+            writeVram(random() % 0x3000, random() & 0xff);
+        }
+        saveRenderSnapshot(snap);
+        unsigned seed = random();
+        renderFrame(snap, seed, false);
+        std::memcpy(expect, screen, sizeof(expect));
+        renderFrame(snap, seed, true);
+        for (int y = 0; y < 240; y++)
+        {
+            if (std::memcmp(expect + y * 256, screen + y * 256, 256 * 4))
+            {
+                if (bad++ < 10)
+                {
+                    fprintf(stderr, "mismatch: frame=%d line=%d\n", frame, y);
+                }
+                break;
+            }
+        }
+    }
+    printf("%d frames, %d mismatches\n", count, bad);
+    return bad ? 1 : 0;
+}
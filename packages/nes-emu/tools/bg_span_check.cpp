@@ -0,0 +1,81 @@
+/**
+ * renderBgSpanを1ピクセルずつの描画(以前のrenderScreenのループ)と比べる
+ * パターン、属性、fineX、スプライトの有無/優先度/Sprite0、描画するピクセルを乱数で作る
+ * bg_span_check [回数]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include "../wasm/ppu.cpp"
+
+// 以前の1ピクセルずつの描画
+static bool renderBgReference(uint16_t *dst, uint16_t pattern0, uint16_t pattern1, int attr, int fineX, uint8_t pixels)
+{
+    bool hit = false;
+    int bit = 0x8000 >> fineX;
+    for (int dx = 0; dx < 8; dx++, bit >>= 1)
+    {
+        if (!(pixels & (0x80 >> dx)))
+        {
+            continue;
+        }
+        int pix = ((pattern0 & bit) ? 1 : 0) | ((pattern1 & bit) ? 2 : 0);
+        if (pix > 0)
+        {
+            if (dst[dx] & 0x400)
+            {
+                hit = true;
+            }
+            if (!(dst[dx] & 0x200))
+            {
+                dst[dx] = palette[((attr << ((bit & 0xff) ? 2 : 0)) & 0xc) | pix] | 0x100;
+            }
+        }
+    }
+    return hit;
+}
+
+int main(int argc, char **argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 200000;
+    std::mt19937 random(1);
+    for (int i = 0; i < 32; i++)
+    {
+        palette[i] = (i * 3 + 1) & 0x3f;
+    }
+    // 背景色, 背面スプライト, 前面スプライト, 前面のSprite0
+    static const uint16_t spriteValue[4] = {0x05, 0x105, 0x305, 0x705};
+    int bad = 0;
+    for (int n = 0; n < count; n++)
+    {
+        uint16_t pattern0 = random();
+        uint16_t pattern1 = random();
+        int attr = random() & 0x0f;
+        int fineX = random() & 7;
+        // 4回に1回は行の途中で分割した場合
+        uint8_t pixels = (random() & 3) ? 0xff : random();
+        uint16_t expect[8], actual[8];
+        uint8_t sprites = 0;
+        for (int dx = 0; dx < 8; dx++)
+        {
+            int kind = random() & 3;
+            expect[dx] = actual[dx] = spriteValue[kind];
+            if (kind)
+            {
+                sprites |= 0x80 >> dx;
+            }
+        }
+        bool expectHit = renderBgReference(expect, pattern0, pattern1, attr, fineX, pixels);
+        bool actualHit = renderBgSpan(actual, pattern0, pattern1, attr, fineX, sprites, pixels);
+        if (expectHit != actualHit || std::memcmp(expect, actual, sizeof(expect)))
+        {
+            if (bad++ < 10)
+            {
+                fprintf(stderr, "mismatch: pattern=%04x/%04x attr=%x fineX=%d sprites=%02x pixels=%02x\n",
+                        pattern0, pattern1, attr, fineX, sprites, pixels);
+            }
+        }
+    }
+    printf("%d inputs, %d mismatches\n", count, bad);
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,261 @@
+/**
+ * 画面キャプチャ(FamPPU.stopCapture)をY4MかPNGにする
+ * capture_decode <入力> <出力.y4m> [最初のフレーム] [フレーム数]
+ * capture_decode <入力> <出力%05d.png> [最初のフレーム] [フレーム数]
+ * capture_decode <入力> --hash [最初のフレーム] [フレーム数]
+ *   フレームごとに"番号 画面のハッシュ"を出力する(FamPPU.hashScreenと同じ値)
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "../wasm/capture.h"
+#include "../wasm/hash.h"
+
+// 60.0988Hz(NTSC)
+#define FRAME_RATE "39375000:655171"
+
+static uint32_t crcTable[256];
+
+static void initCrc()
+{
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+        {
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        crcTable[n] = c;
+    }
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = crcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void putBE32(std::vector<uint8_t> &out, uint32_t value)
+{
+    for (int i = 3; i >= 0; i--)
+    {
+        out.push_back(value >> (i * 8));
+    }
+}
+
+static void putChunk(FILE *fp, const char *type, const std::vector<uint8_t> &data)
+{
+    std::vector<uint8_t> chunk;
+    putBE32(chunk, data.size());
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    putBE32(chunk, crc32(0, chunk.data() + 4, chunk.size() - 4));
+    fwrite(chunk.data(), 1, chunk.size(), fp);
+}
+
+// 無圧縮(deflateのstored block)のPNG
+static bool writePng(const char *path, const uint32_t *rgba, int width, int height)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+    {
+        return false;
+    }
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    fwrite(signature, 1, sizeof(signature), fp);
+    std::vector<uint8_t> ihdr;
+    putBE32(ihdr, width);
+    putBE32(ihdr, height);
+    ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0});
+    putChunk(fp, "IHDR", ihdr);
+
+    std::vector<uint8_t> raw;
+    for (int y = 0; y < height; y++)
+    {
+        raw.push_back(0);
+        for (int x = 0; x < width; x++)
+        {
+            uint32_t c = rgba[y * width + x];
+            raw.insert(raw.end(), {(uint8_t)c, (uint8_t)(c >> 8), (uint8_t)(c >> 16)});
+        }
+    }
+    std::vector<uint8_t> idat = {0x78, 0x01};
+    uint32_t a = 1, b = 0;
+    for (size_t pos = 0; pos < raw.size();)
+    {
+        size_t len = std::min<size_t>(raw.size() - pos, 0xffff);
+        bool last = pos + len == raw.size();
+        idat.insert(idat.end(), {(uint8_t)last, (uint8_t)len, (uint8_t)(len >> 8), (uint8_t)~len, (uint8_t)(~len >> 8)});
+        idat.insert(idat.end(), raw.begin() + pos, raw.begin() + pos + len);
+        pos += len;
+    }
+    for (uint8_t v : raw)
+    {
+        a = (a + v) % 65521;
+        b = (b + a) % 65521;
+    }
+    putBE32(idat, (b << 16) | a);
+    putChunk(fp, "IDAT", idat);
+    putChunk(fp, "IEND", {});
+    return fclose(fp) == 0;
+}
+
+// BT.601(リミテッドレンジ)の4:4:4
+static void writeY4mFrame(FILE *fp, const uint32_t *rgba, int count)
+{
+    std::vector<uint8_t> planes(count * 3);
+    for (int i = 0; i < count; i++)
+    {
+        int r = rgba[i] & 0xff;
+        int g = (rgba[i] >> 8) & 0xff;
+        int b = (rgba[i] >> 16) & 0xff;
+        planes[i] = (66 * r + 129 * g + 25 * b + 128 + (16 << 8)) >> 8;
+        planes[count + i] = (-38 * r - 74 * g + 112 * b + 128 + (128 << 8)) >> 8;
+        planes[count * 2 + i] = (112 * r - 94 * g - 18 * b + 128 + (128 << 8)) >> 8;
+    }
+    fputs("FRAME\n", fp);
+    fwrite(planes.data(), 1, planes.size(), fp);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s <capture> <out.y4m | out%%05d.png | --hash> [first] [count]\n", argv[0]);
+        return 1;
+    }
+    int first = argc > 3 ? atoi(argv[3]) : 0;
+    int count = argc > 4 ? atoi(argv[4]) : -1;
+    FILE *in = fopen(argv[1], "rb");
+    if (!in)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    std::vector<uint8_t> data;
+    uint8_t buf[0x10000];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(in);
+
+    CaptureHeader header;
+    if (data.size() < sizeof(header))
+    {
+        fprintf(stderr, "%s: too short\n", argv[1]);
+        return 1;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION)
+    {
+        fprintf(stderr, "%s: not a capture (version %u)\n", argv[1], header.version);
+        return 1;
+    }
+    initCrc();
+    std::string out = argv[2];
+    bool hash = out == "--hash";
+    bool y4m = out.size() >= 4 && out.compare(out.size() - 4, 4, ".y4m") == 0;
+    FILE *video = nullptr;
+    if (y4m)
+    {
+        video = fopen(out.c_str(), "wb");
+        if (!video)
+        {
+            perror(out.c_str());
+            return 1;
+        }
+        fprintf(video, "YUV4MPEG2 W256 H%d F" FRAME_RATE " Ip A8:7 C444\n", CAPTURE_LINES);
+    }
+
+    std::vector<uint8_t> plane(CAPTURE_PLANE_SIZE), delta(CAPTURE_PLANE_SIZE);
+    std::vector<uint32_t> rgba(256 * CAPTURE_LINES);
+    bool haveKey = false;
+    int frame = 0;
+    int written = 0;
+    size_t pos = sizeof(header);
+    while (pos + sizeof(CaptureRecord) <= data.size() && (count < 0 || written < count))
+    {
+        CaptureRecord record;
+        std::memcpy(&record, data.data() + pos, sizeof(record));
+        pos += sizeof(record);
+        if (record.size > data.size() - pos)
+        {
+            fprintf(stderr, "frame %d: truncated\n", frame);
+            break;
+        }
+        const uint8_t *payload = data.data() + pos;
+        pos += record.size;
+        if (record.type == CAPTURE_KEY)
+        {
+            if (!captureDecode(payload, record.size, plane.data(), CAPTURE_PLANE_SIZE))
+            {
+                fprintf(stderr, "frame %d: broken key frame\n", frame);
+                return 1;
+            }
+            haveKey = true;
+        }
+        else if (record.type == CAPTURE_DELTA && record.size)
+        {
+            if (!captureDecode(payload, record.size, delta.data(), CAPTURE_PLANE_SIZE))
+            {
+                fprintf(stderr, "frame %d: broken delta frame\n", frame);
+                return 1;
+            }
+            for (int i = 0; i < CAPTURE_PLANE_SIZE; i++)
+            {
+                plane[i] ^= delta[i];
+            }
+        }
+        else if (record.type != CAPTURE_DELTA)
+        {
+            fprintf(stderr, "frame %d: unknown type %u\n", frame, record.type);
+            return 1;
+        }
+        if (haveKey && frame >= first)
+        {
+            for (int y = 0; y < CAPTURE_LINES; y++)
+            {
+                const uint8_t *index = plane.data() + CAPTURE_LINES + y * 256;
+                for (int x = 0; x < 256; x++)
+                {
+                    rgba[y * 256 + x] = captureColor(header, plane[y], index[x]);
+                }
+            }
+            if (hash)
+            {
+                printf("%d %016llx\n", frame, (unsigned long long)hash64(rgba.data(), rgba.size() * 4));
+            }
+            else if (y4m)
+            {
+                writeY4mFrame(video, rgba.data(), rgba.size());
+            }
+            else
+            {
+                char path[1024];
+                snprintf(path, sizeof(path), out.c_str(), frame);
+                if (!writePng(path, rgba.data(), 256, CAPTURE_LINES))
+                {
+                    perror(path);
+                    return 1;
+                }
+            }
+            written++;
+        }
+        frame++;
+    }
+    if (video)
+    {
+        fclose(video);
+    }
+    fprintf(stderr, "%d frames written\n", written);
+    return 0;
+}
@@ -0,0 +1,6 @@
+#pragma once
+/**
+ * wasm/のcppをネイティブでビルドするための置き換え(確認用のツールだけで使う)
+ */
+#define EMSCRIPTEN_KEEPALIVE
+#define EM_ASM(...) ((void)0)
@@ -0,0 +1,48 @@
+/**
+ * convertLine(パレット番号からRGBA)を色の表から直接求めた値と比べる
+ * $2001のグレースケール/強調ビットとlineBufを乱数で作る
+ * rgba_convert_check [回数]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include "../wasm/ppu.cpp"
+
+static uint32_t referenceColor(int mode, int col)
+{
+    if (mode & GRAY_SCALE)
+    {
+        return grayPalette[col];
+    }
+    uint32_t emphasisFlag = ((mode & 0x80) ? 0x0000ff : 0) | ((mode & 0x40) ? 0x00ff00 : 0) | ((mode & 0x20) ? 0xff0000 : 0);
+    return (colorPalette[col] & ~emphasisFlag) | (emphasisColor[col] & emphasisFlag);
+}
+
+int main(int argc, char **argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 2000;
+    std::mt19937 random(2);
+    int bad = 0;
+    for (int n = 0; n < count; n++)
+    {
+        state.ctrl2001 = random() & 0xff;
+        for (int x = 0; x < 256; x++)
+        {
+            // 上位ビット(スプライトの印)は変換で無視される
+            lineBuf[x] = random() & 0x7ff;
+        }
+        updateRgbaPalette();
+        uint32_t line[256];
+        convertLine(line);
+        for (int x = 0; x < 256; x++)
+        {
+            uint32_t expect = referenceColor(state.ctrl2001, lineBuf[x] & 0x3f);
+            if (line[x] != expect && bad++ < 10)
+            {
+                fprintf(stderr, "mismatch: $2001=%02x index=%03x %08x != %08x\n", state.ctrl2001, lineBuf[x], line[x], expect);
+            }
+        }
+    }
+    printf("%d lines, %d mismatches\n", count, bad);
+    return bad ? 1 : 0;
+}
@@ -1,7 +1,10 @@
 #include <emscripten.h>
 #include <functional>
+#include "simd.h"
+#include "hash.h"
 
-static std::function<void(int)> irqCallback;
+// IRQの要求(要因, 1: 要求 0: 取り消し)
+static std::function<void(int, int)> irqCallback;
 // DMCのメモリ読み込み
 static std::function<int(int)> dmcCallback;
 
@@ -18,6 +21,10 @@ static std::function<int(int)> dmcCallback;
 
 #define FRAME_CYCLE 7457
 
+// IRQの要因(cpu.cppのIRQ_SOURCE_xxxと同じ)
+#define IRQ_SOURCE_FRAME 0
+#define IRQ_SOURCE_DMC 1
+
 struct _reg
 {
     int stepMode;
@@ -35,6 +42,8 @@ static int lengthIndexData[] = {0x0a, 0xfe, 0x14, 0x02, 0x28,
 
 // 1step=183 or 184 or 200までのサンプル数の返却
 static uint8_t sampleResult[256];
+// チャンネルごとのバッファ(SIMDで16サンプル単位に処理するので切り上げておく)
+#define SAMPLE_BUF_SIZE 208
 
 // 音声合成用
 static uint8_t pulseMixValue[31];
@@ -43,11 +52,11 @@ static uint16_t tndMixValue[3 * 15 + 2 * 15 + 127 + 1];
 extern "C" EMSCRIPTEN_KEEPALIVE void setVolume(int volumeMax)
 {
     EM_ASM({ console.log("APU Set Volume: " + $0); }, volumeMax);
-    for (int i = 1; i < sizeof(pulseMixValue); i++)
+    for (int i = 1; i < (int)(sizeof(pulseMixValue) / sizeof(pulseMixValue[0])); i++)
     {
         pulseMixValue[i] = (uint8_t)(volumeMax * 95.88 / ((8128.8 / i) + 100));
     }
-    for (int i = 1; i < sizeof(tndMixValue); i++)
+    for (int i = 1; i < (int)(sizeof(tndMixValue) / sizeof(tndMixValue[0])); i++)
     {
         tndMixValue[i] = (uint16_t)(volumeMax * 163.67 / (24329.8 / i + 100));
     }
@@ -71,6 +80,28 @@ struct EnvelopeData
     uint8_t period;
     uint8_t count;
 };
+static void hashSweep(HashState &h, const SweepData &sweep)
+{
+    hashValue(h, sweep.enabled);
+    hashValue(h, sweep.period);
+    hashValue(h, sweep.count);
+    hashValue(h, sweep.value);
+    hashValue(h, sweep.upFlag);
+}
+
+static void hashEnvelope(HashState &h, const EnvelopeData &env)
+{
+    hashValue(h, env.enabled);
+    hashValue(h, env.period);
+    hashValue(h, env.count);
+}
+
+static uint8_t squareWaveValue[4][8] = {
+    {0, 1, 0, 0, 0, 0, 0, 0},
+    {0, 1, 1, 0, 0, 0, 0, 0},
+    {0, 1, 1, 1, 1, 0, 0, 0},
+    {1, 0, 0, 1, 1, 1, 1, 1}};
+
 /**
  * 矩形波音声データ出力情報
  * 183サンプル数で7457サイクル進む
@@ -79,14 +110,10 @@ struct SquareOutput
 {
     uint64_t timerCycle;
     uint64_t currentCycle;
-    uint8_t *waveValue;
+    // 最初の波形の開始まではvolumeが0なので、どの波形でもよい
+    uint8_t *waveValue = squareWaveValue[0];
     uint8_t volume;
 };
-static uint8_t squareWaveValue[4][8] = {
-    {0, 1, 0, 0, 0, 0, 0, 0},
-    {0, 1, 1, 0, 0, 0, 0, 0},
-    {0, 1, 1, 1, 1, 0, 0, 0},
-    {1, 0, 0, 1, 1, 1, 1, 1}};
 
 struct TriangleOutput
 {
@@ -336,6 +363,26 @@ public:
             }
         }
     }
+    // 状態をハッシュに足す(hashState)
+    void hash(HashState &h) const
+    {
+        hashValue(h, enableFlag);
+        hashValue(h, loopFlag);
+        hashValue(h, updateFlag);
+        hashValue(h, dutyValue);
+        hashValue(h, volumeValue);
+        hashValue(h, lengthCounter);
+        hashValue(h, timerCount);
+        hashSweep(h, sweepData);
+        hashSweep(h, nextSweep);
+        hashEnvelope(h, envData);
+        hashEnvelope(h, nextEnv);
+        hashValue(h, output.timerCycle);
+        hashValue(h, output.currentCycle);
+        hashValue(h, output.volume);
+        // 波形はポインタなので、表の位置にする
+        hashValue(h, output.waveValue ? (int)(output.waveValue - squareWaveValue[0]) : -1);
+    }
 };
 SquareSound SquareSound::square[2];
 
@@ -468,6 +515,19 @@ public:
             lengthCounter--;
         }
     }
+    // 状態をハッシュに足す(hashState)
+    void hash(HashState &h) const
+    {
+        hashValue(h, enableFlag);
+        hashValue(h, loopFlag);
+        hashValue(h, updateFlag);
+        hashValue(h, lengthCounter);
+        hashValue(h, lineCounter);
+        hashValue(h, lineCounterData);
+        hashValue(h, timerCount);
+        hashValue(h, output.timerCycle);
+        hashValue(h, output.currentCycle);
+    }
 };
 static TriangleSound triangle;
 
@@ -655,6 +715,23 @@ public:
         }
         return ret;
     }
+    // 状態をハッシュに足す(hashState)
+    void hash(HashState &h) const
+    {
+        hashValue(h, enableFlag);
+        hashValue(h, loopFlag);
+        hashValue(h, updateFlag);
+        hashValue(h, shortFlag);
+        hashValue(h, volumeValue);
+        hashValue(h, lengthCounter);
+        hashValue(h, shiftRegister);
+        hashValue(h, timerCount);
+        hashEnvelope(h, envData);
+        hashEnvelope(h, nextEnv);
+        hashValue(h, output.timerCycle);
+        hashValue(h, output.currentCycle);
+        hashValue(h, output.volume);
+    }
 };
 static NoiseSound noise;
 
@@ -724,7 +801,7 @@ public:
             // クリア
             if (irqCallback)
             {
-                irqCallback(0);
+                irqCallback(IRQ_SOURCE_DMC, 0);
             }
         }
     }
@@ -805,7 +882,7 @@ public:
                         sampleSize = 0;
                         if (irqFlag && irqCallback)
                         {
-                            irqCallback(1);
+                            irqCallback(IRQ_SOURCE_DMC, 1);
                         }
                     }
                 }
@@ -835,11 +912,29 @@ public:
             shiftRegister >>= 1;
         }
     }
+    // 状態をハッシュに足す(hashState)
+    void hash(HashState &h) const
+    {
+        hashValue(h, enableFlag);
+        hashValue(h, irqFlag);
+        hashValue(h, loopFlag);
+        hashValue(h, periodIndex);
+        hashValue(h, deltaValue);
+        hashValue(h, sampleBuffer);
+        hashValue(h, sampleSize);
+        hashValue(h, sampleAddr);
+        hashValue(h, nextAddr);
+        hashValue(h, restSize);
+        hashValue(h, counter);
+        hashValue(h, shiftRegister);
+        hashUpdate(h, deltaBuffer, sizeof(deltaBuffer));
+        hashValue(h, bufferIndex);
+    }
 };
 static DeltaSound dmc;
 
 // IRQリクエスト
-extern "C" EMSCRIPTEN_KEEPALIVE void setIrqCallback(void (*callback)(int))
+extern "C" EMSCRIPTEN_KEEPALIVE void setIrqCallback(void (*callback)(int, int))
 {
     irqCallback = callback;
 }
@@ -850,13 +945,14 @@ extern "C" EMSCRIPTEN_KEEPALIVE void setDmcCallback(int (*callback)(int))
     dmcCallback = callback;
 }
 
+// チャンネルごとの出力(stepで合成する)
+static uint8_t squareBuf[2][SAMPLE_BUF_SIZE];
+static uint8_t triangleBuf[SAMPLE_BUF_SIZE];
+static uint8_t noiseBuf[SAMPLE_BUF_SIZE];
+static uint8_t dmcBuf[SAMPLE_BUF_SIZE];
+
 extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *step(int samples)
 {
-    static uint8_t squareBuf[2][200];
-    static uint8_t triangleBuf[200];
-    static uint8_t noiseBuf[200];
-    static uint8_t dmcBuf[200];
-
     reg.frameCounter--;
     if (reg.frameCounter < 0)
     {
@@ -940,7 +1036,7 @@ extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *step(int samples)
         reg.state |= FRAME_IRQ;
         if (irqCallback)
         {
-            irqCallback(1);
+            irqCallback(IRQ_SOURCE_FRAME, 1);
         }
     }
     if (samples > 100)
@@ -951,11 +1047,41 @@ extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *step(int samples)
         triangle.doOutput(triangleBuf, samples);
         noise.doOutput(noiseBuf, samples);
         dmc.doOutput(dmcBuf, samples);
+#ifdef SIMD_ENABLED
+        // 表のインデックス計算と合成をSIMDで行う(表引きだけはスカラー)
+        static uint16_t pulseIndex[SAMPLE_BUF_SIZE];
+        static uint16_t tndIndex[SAMPLE_BUF_SIZE];
+        static uint16_t pulseMix[SAMPLE_BUF_SIZE];
+        static uint16_t tndMix[SAMPLE_BUF_SIZE];
+        int count = (samples + 15) & ~15;
+        for (int i = 0; i < count; i += 8)
+        {
+            simd128 triangle3 = simd_load_u8x8(triangleBuf + i);
+            simd128 noise2 = simd_load_u8x8(noiseBuf + i);
+            triangle3 = simd_add_u16(simd_add_u16(triangle3, triangle3), triangle3);
+            noise2 = simd_add_u16(noise2, noise2);
+            simd_store(pulseIndex + i, simd_add_u16(simd_load_u8x8(squareBuf[0] + i), simd_load_u8x8(squareBuf[1] + i)));
+            simd_store(tndIndex + i, simd_add_u16(simd_add_u16(triangle3, noise2), simd_load_u8x8(dmcBuf + i)));
+        }
+        for (int i = 0; i < count; i++)
+        {
+            pulseMix[i] = pulseMixValue[pulseIndex[i]];
+            tndMix[i] = tndMixValue[tndIndex[i]];
+        }
+        simd128 limit = simd_splat_u16(255);
+        for (int i = 0; i < count; i += 16)
+        {
+            simd128 low = simd_min_u16(simd_add_u16(simd_load(pulseMix + i), simd_load(tndMix + i)), limit);
+            simd128 high = simd_min_u16(simd_add_u16(simd_load(pulseMix + i + 8), simd_load(tndMix + i + 8)), limit);
+            simd_store(sampleResult + i, simd_narrow_u16(low, high));
+        }
+#else
         for (int i = 0; i < samples; i++)
         {
             sampleResult[i] = std::min(255, pulseMixValue[squareBuf[0][i] + squareBuf[1][i]] + tndMixValue[triangleBuf[i] * 3 + noiseBuf[i] * 2 + dmcBuf[i]]);
             // sampleResult[i] = 0.00752 * (squareBuf[0][i] + squareBuf[1][i]) + 0.00851 * triangleBuf[i] + 0.00494 * noiseBuf[i] + 0.00335 * dmcBuf[i];
         }
+#endif
     }
     return sampleResult;
 }
@@ -1050,6 +1176,11 @@ extern "C" EMSCRIPTEN_KEEPALIVE void writeMem(int addr, int val)
         triangle.setEnabled((val & 4) > 0);
         noise.setEnabled((val & 8) > 0);
         dmc.setEnabled((val & 16) > 0);
+        // 書き込みでDMCのIRQは取り消される
+        if (irqCallback)
+        {
+            irqCallback(IRQ_SOURCE_DMC, 0);
+        }
     }
     else if (addr == 0x4017)
     {
@@ -1070,7 +1201,7 @@ extern "C" EMSCRIPTEN_KEEPALIVE void writeMem(int addr, int val)
             reg.state &= ~FRAME_IRQ;
             if (irqCallback)
             {
-                irqCallback(0);
+                irqCallback(IRQ_SOURCE_FRAME, 0);
             }
         }
     }
@@ -1081,16 +1212,40 @@ extern "C" EMSCRIPTEN_KEEPALIVE int readMem(int addr)
     {
         int ret = reg.state;
         reg.state &= ~FRAME_IRQ;
+        // フレームIRQの確認(DMCのIRQは残る)
         if (irqCallback)
         {
-            // 割り込み待ちはクリアしない
-            // irqCallback(0);
+            irqCallback(IRQ_SOURCE_FRAME, 0);
         }
         return ret;
     }
     return 0;
 }
 
+/**
+ * APUの状態(フレームカウンタと各チャンネル)のハッシュ
+ * @return 64bitのハッシュ(uint32 x 2、下位が先)
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *hashState()
+{
+    static uint64_t result;
+    HashState h;
+    hashInit(h);
+    hashValue(h, reg.stepMode);
+    hashValue(h, reg.frameCounter);
+    hashValue(h, reg.irqDisable);
+    hashValue(h, reg.state);
+    hashUpdate(h, reg.squareTimer, sizeof(reg.squareTimer));
+    hashValue(h, reg.triangleTimer);
+    SquareSound::square[0].hash(h);
+    SquareSound::square[1].hash(h);
+    triangle.hash(h);
+    noise.hash(h);
+    dmc.hash(h);
+    result = hashFinal(h);
+    return reinterpret_cast<uint32_t *>(&result);
+}
+
 extern "C" EMSCRIPTEN_KEEPALIVE void reset()
 {
     EM_ASM({
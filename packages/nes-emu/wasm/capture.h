@@ -0,0 +1,186 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * 画面キャプチャ(startCapture)の形式
+ * ヘッダ: CaptureHeader
+ * フレーム: CaptureRecord + 圧縮したプレーン(sizeバイト)
+ * プレーン: ラインのモード(240バイト、$2001のbit0,5-7) + パレット番号(256x240バイト)
+ * キーフレームはプレーンそのもの、差分フレームは前のフレームとのXORを圧縮する
+ * 差分フレームのsizeが0なら、前のフレームと同じ
+ */
+#define CAPTURE_MAGIC 0x4353454e
+#define CAPTURE_VERSION 1
+#define CAPTURE_LINES 240
+#define CAPTURE_PLANE_SIZE (CAPTURE_LINES + 256 * CAPTURE_LINES)
+#define CAPTURE_KEY 1
+#define CAPTURE_DELTA 2
+// これより短い繰り返しはそのまま書く
+#define CAPTURE_MIN_RUN 4
+// 圧縮後の最大サイズ(1バイトずつ繰り返しとそのままが交互に来る場合)
+#define CAPTURE_ENCODE_MAX (CAPTURE_PLANE_SIZE * 2)
+
+struct CaptureHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t keyInterval;
+    uint32_t reserved;
+    // 色の変換表(RGBA): 通常、グレースケール、強調
+    uint32_t palette[3][64];
+};
+
+struct CaptureRecord
+{
+    uint32_t type;
+    uint32_t size;
+};
+
+static inline uint8_t *captureWriteVarint(uint8_t *dst, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        *dst++ = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *dst++ = value;
+    return dst;
+}
+
+static inline const uint8_t *captureReadVarint(const uint8_t *src, const uint8_t *end, uint32_t &value)
+{
+    value = 0;
+    for (int shift = 0; src < end && shift < 32; shift += 7)
+    {
+        uint8_t b = *src++;
+        value |= (b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            return src;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * ランレングス圧縮
+ * varint nが奇数ならn / 2 + CAPTURE_MIN_RUN個の次の1バイト、偶数ならn / 2 + 1バイトがそのまま続く
+ * @return 圧縮後のサイズ(dstはCAPTURE_ENCODE_MAXあればよい)
+ */
+static inline size_t captureEncode(const uint8_t *src, size_t size, uint8_t *dst)
+{
+    uint8_t *out = dst;
+    size_t literal = 0;
+    size_t i = 0;
+    auto flush = [&](size_t end)
+    {
+        if (end > literal)
+        {
+            out = captureWriteVarint(out, (end - literal - 1) * 2);
+            std::memcpy(out, src + literal, end - literal);
+            out += end - literal;
+        }
+    };
+    while (i < size)
+    {
+        uint8_t value = src[i];
+        size_t j = i + 1;
+        if (value == 0)
+        {
+            // 差分フレームはほとんど0なので8バイトずつ飛ばす
+            while (j + 8 <= size)
+            {
+                uint64_t word;
+                std::memcpy(&word, src + j, 8);
+                if (word)
+                {
+                    break;
+                }
+                j += 8;
+            }
+        }
+        while (j < size && src[j] == value)
+        {
+            j++;
+        }
+        if (j - i >= CAPTURE_MIN_RUN)
+        {
+            flush(i);
+            out = captureWriteVarint(out, (uint32_t)(j - i - CAPTURE_MIN_RUN) * 2 + 1);
+            *out++ = value;
+            literal = j;
+        }
+        i = j;
+    }
+    flush(size);
+    return out - dst;
+}
+
+/**
+ * captureEncodeの展開
+ * @return sizeバイトちょうどに展開できたらtrue
+ */
+static inline bool captureDecode(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t size)
+{
+    const uint8_t *end = src + srcSize;
+    size_t pos = 0;
+    while (src < end)
+    {
+        uint32_t n;
+        src = captureReadVarint(src, end, n);
+        if (!src)
+        {
+            return false;
+        }
+        if (n & 1)
+        {
+            size_t count = (n >> 1) + CAPTURE_MIN_RUN;
+            if (src >= end || pos + count > size)
+            {
+                return false;
+            }
+            std::memset(dst + pos, *src++, count);
+            pos += count;
+        }
+        else
+        {
+            size_t count = (n >> 1) + 1;
+            if ((size_t)(end - src) < count || pos + count > size)
+            {
+                return false;
+            }
+            std::memcpy(dst + pos, src, count);
+            src += count;
+            pos += count;
+        }
+    }
+    return pos == size;
+}
+
+/**
+ * ラインのモードでのパレット番号の色(ppu.cppのupdateRgbaPaletteと同じ)
+ */
+static inline uint32_t captureColor(const CaptureHeader &header, int mode, int col)
+{
+    col &= 0x3f;
+    if (mode & 1)
+    {
+        return header.palette[1][col];
+    }
+    uint32_t emphasisFlag = 0;
+    if (mode & 0x80)
+    {
+        emphasisFlag |= 0x0000ff;
+    }
+    if (mode & 0x40)
+    {
+        emphasisFlag |= 0x00ff00;
+    }
+    if (mode & 0x20)
+    {
+        emphasisFlag |= 0xff0000;
+    }
+    return (header.palette[0][col] & ~emphasisFlag) | (header.palette[2][col] & emphasisFlag);
+}
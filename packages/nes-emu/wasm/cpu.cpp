@@ -1,5 +1,10 @@
 #include <emscripten.h>
 #include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "hash.h"
 
 // APUへ通知するステップ数
 #define APU_STEP_COUNT 7457
@@ -13,6 +18,57 @@
 #define FLAG_ZERO 0x02
 #define FLAG_CARRY 0x01
 
+// IRQの要因(irqRequestのbit番号)
+#define IRQ_SOURCE_FRAME 0
+#define IRQ_SOURCE_DMC 1
+#define IRQ_SOURCE_MAPPER 2
+
+// 停止条件/停止理由
+#define STOP_PC 0x01
+#define STOP_READ 0x02
+#define STOP_WRITE 0x04
+#define STOP_SCANLINE 0x08
+#define STOP_CYCLES 0x10
+#define STOP_FRAME 0x20
+#define STOP_BRK 0x40
+// 不正命令は条件に関係なく停止する
+#define STOP_FAULT 0x80
+
+// 命令ごとに確認が必要な条件(それ以外はメモリアクセスで確認する)
+#define STOP_LOOP_MASK (STOP_SCANLINE | STOP_CYCLES | STOP_FRAME | STOP_BRK)
+
+// 監視の種類
+#define WATCH_READ 0x01
+#define WATCH_WRITE 0x02
+#define WATCH_EXEC 0x04
+// アクセス統計(全ページに付ける)
+#define WATCH_STAT 0x08
+#define WATCH_MAX 32
+
+// 1フレームのPPUサイクル(341 * 262)
+#define FRAME_PPU_CYCLES 89342
+
+// Code/Data Logger のフラグ(PRG-ROM 1バイトごと)
+#define CDL_OPCODE 0x01
+#define CDL_OPERAND 0x02
+#define CDL_DATA 0x04
+// (zp,X), (zp),Y で読み込まれた / JMP (abs) の飛び先
+#define CDL_INDIRECT 0x08
+// DMCのサンプル
+#define CDL_PCM 0x10
+// PRG-ROMの最大サイズ
+#define CDL_PRG_MAX 0x80000
+
+// PRG-ROMの最大サイズ(ネイティブのマッパー)
+#define PRG_ROM_MAX 0x80000
+
+// 逆アセンブル1行の最大長(ラベル行を含む)
+#define DISASM_LINE_MAX 256
+// disassembleRangeの内部バッファで出力できる最大行数
+#define DISASM_MAX_LINES 512
+// シンボル名の最大長
+#define SYMBOL_NAME_MAX 64
+
 static std::function<void(int)> apuStepCallback;
 static std::function<void(int, int)> memWriteCallback;
 static std::function<int(int)> memReadCallback;
@@ -30,7 +86,8 @@ struct _reg
     // 起動時はメモリ 0xfffc の値
     unsigned int pc : 16;
     // いろいろなフラグ
-    unsigned int irqRequest : 1;
+    // IRQは要因ごとに1bit、どれかが立っていれば割り込む
+    unsigned int irqRequest : 3;
     unsigned int nmiRequest : 1;
     // 遅延のIRQセット
     char nextIrq;
@@ -41,6 +98,12 @@ struct _cycle
 {
     int cpuCycle;
     int notifyCpuCycle;
+    // フレーム先頭からのCPUサイクル
+    int frameCycle;
+    // 電源投入からのCPUサイクル(DMAの奇数/偶数判定)
+    unsigned int totalCycle;
+    // 今のstepで実行するサイクル数
+    int stepCycle;
 };
 static _cycle cycle;
 
@@ -48,6 +111,8 @@ struct _context
 {
     int addr;
     int cycle;
+    // 実行した命令(割り込み時は-1)
+    int opcode;
 };
 static _context context;
 
@@ -56,7 +121,320 @@ static bool powerOn = true;
 
 // デバッグ出力
 static bool debugFlag = false;
-static bool faultFlag = false;
+
+/**
+ * runUntilの停止条件
+ */
+struct _stopCond
+{
+    // 有効な条件(STOP_xxx)
+    int flags;
+    // 監視するアドレス範囲
+    int watchStart;
+    int watchEnd;
+    // 停止するフレーム内のPPUサイクル
+    int ppuCycle;
+    // 停止までの残りCPUサイクル
+    int cycles;
+    // PCブレークポイント(1アドレス1bit)
+    uint8_t pcMap[0x10000 / 8];
+};
+static _stopCond stopCond;
+
+struct _stopInfo
+{
+    // 停止理由(STOP_xxx)、0なら実行中
+    int reason;
+    // 停止したフレーム内のCPUサイクル
+    int cycle;
+    // 停止したアドレス
+    int addr;
+    // 再開直後に無視するPC
+    int resumePc;
+};
+static _stopInfo stopInfo = {0, 0, 0, -1};
+
+// $8000-$FFFFの8KBごとのPRG-ROM内のオフセット(-1: 未設定)
+static int prgBankOffset[4] = {-1, -1, -1, -1};
+
+/**
+ * ネイティブのマッパー
+ * 設定されている間は RAM, WRAM, PRG-ROM をwasm内で処理し、
+ * $2000-$5FFF だけをコールバックに渡す
+ */
+class Mapper
+{
+public:
+    virtual ~Mapper() {}
+    // 電源投入/リセット時のバンク設定
+    virtual void reset() = 0;
+    // $8000-$FFFFへの書き込み
+    virtual void write(int addr, int val) = 0;
+    // バンクの割り当て以外のレジスタをハッシュに足す(hashState)
+    virtual void hash(HashState &) const
+    {
+    }
+};
+static std::unique_ptr<Mapper> mapper;
+
+struct _rom
+{
+    int prgSize;
+    int chrSize;
+    // ヘッダのミラーモード
+    int mirrorMode;
+    // $8000-$FFFFの8KBごとの参照先
+    uint8_t *prgPage[4];
+    // 1KBごとのCHR-ROM内のオフセット(変更時だけ通知する)
+    int chrBank[8];
+    uint8_t prg[PRG_ROM_MAX];
+};
+static _rom rom;
+// 内部RAM($0000-$07FF)
+static uint8_t ram[0x800];
+// WRAM($6000-$7FFF)
+static uint8_t wram[0x2000];
+static bool wramWritten;
+
+// スプライトDMAの転送データ
+static uint8_t dmaBuf[256];
+// 転送データをPPUへ渡す
+static std::function<void()> dmaCallback;
+
+static std::function<void(int, int)> chrBankCallback;
+static std::function<void(int)> mirrorCallback;
+// PPU側で処理するマッパーのレジスタ(MMC3のIRQ)
+static std::function<void(int, int)> mapperWriteCallback;
+
+static int busRead(int addr)
+{
+    if (mapper)
+    {
+        if (addr < 0x2000)
+        {
+            return ram[addr & 0x7ff];
+        }
+        else if (addr >= 0x8000)
+        {
+            return rom.prgPage[(addr >> 13) & 3][addr & 0x1fff];
+        }
+        else if (addr >= 0x6000)
+        {
+            return wram[addr & 0x1fff];
+        }
+    }
+    if (memReadCallback)
+    {
+        return memReadCallback(addr);
+    }
+    return 0;
+}
+static void busWrite(int addr, int val)
+{
+    if (mapper)
+    {
+        if (addr < 0x2000)
+        {
+            ram[addr & 0x7ff] = val;
+            return;
+        }
+        else if (addr >= 0x8000)
+        {
+            mapper->write(addr, val);
+            return;
+        }
+        else if (addr >= 0x6000)
+        {
+            wram[addr & 0x1fff] = val;
+            wramWritten = true;
+            return;
+        }
+    }
+    if (memWriteCallback)
+    {
+        memWriteCallback(addr, val);
+    }
+}
+
+#ifdef ENABLE_CDL
+struct _cdl
+{
+    // 通常の読み込みに付けるフラグ
+    uint8_t kind;
+    // 次の命令に付けるフラグ
+    uint8_t next;
+    int size;
+    // 8KBごとの記録先(ROM以外は捨てる)
+    uint8_t *page[8];
+    uint8_t sink[0x2000];
+    uint8_t prg[CDL_PRG_MAX];
+};
+static _cdl cdl;
+// 1アクセスにつきORを1回だけ行う
+#define CDL_LOG(addr, flag) (cdl.page[((addr) >> 13) & 7][(addr) & 0x1fff] |= (flag))
+#define CDL_KIND(flag) (cdl.kind = (flag))
+#define CDL_NEXT(flag) (cdl.next = (flag))
+
+static void updateCdlPage()
+{
+    for (int i = 0; i < 8; i++)
+    {
+        int offset = i < 4 ? -1 : prgBankOffset[i - 4];
+        if (offset >= 0 && offset + 0x2000 <= cdl.size)
+        {
+            cdl.page[i] = cdl.prg + offset;
+        }
+        else
+        {
+            cdl.page[i] = cdl.sink;
+        }
+    }
+}
+#else
+#define CDL_LOG(addr, flag)
+#define CDL_KIND(flag)
+#define CDL_NEXT(flag)
+#endif
+
+static void stopCpu(int reason, int addr)
+{
+    if (!stopInfo.reason)
+    {
+        stopInfo.cycle = cycle.frameCycle;
+        stopInfo.addr = addr;
+    }
+    stopInfo.reason |= reason;
+}
+
+/**
+ * ウォッチポイント
+ */
+struct WatchPoint
+{
+    int start;
+    int end;
+    // WATCH_xxx、0なら未使用
+    int kind;
+};
+static WatchPoint watchList[WATCH_MAX];
+
+/**
+ * バスのアクセス統計
+ */
+struct _busStat
+{
+    bool enabled;
+    // フレームごとにリセットする
+    bool perFrame;
+    // 読み込み, 書き込み, 命令実行の回数(0x10000個ずつ、最初に有効にしたときに確保する)
+    std::vector<uint32_t> count;
+    // $2000-$2007(ミラーを含む), $4000-$4017 のレジスタ別の読み込み, 書き込み回数
+    uint32_t io[2][0x20];
+};
+static _busStat busStat;
+
+// 256バイトのページごとの監視フラグ(WATCH_xxx)
+// フラグのないページは通常と同じ速度で動く
+static uint8_t watchPage[256];
+
+static void updateWatchPage()
+{
+    std::memset(watchPage, 0, sizeof(watchPage));
+    for (int i = 0; i < WATCH_MAX; i++)
+    {
+        WatchPoint &wp = watchList[i];
+        for (int page = wp.kind ? wp.start >> 8 : 256; page <= (wp.end >> 8); page++)
+        {
+            watchPage[page] |= wp.kind;
+        }
+    }
+    if (stopCond.flags & (STOP_READ | STOP_WRITE))
+    {
+        int kind = ((stopCond.flags & STOP_READ) ? WATCH_READ : 0) | ((stopCond.flags & STOP_WRITE) ? WATCH_WRITE : 0);
+        for (int page = stopCond.watchStart >> 8; page <= (stopCond.watchEnd >> 8) && page < 256; page++)
+        {
+            watchPage[page] |= kind;
+        }
+    }
+    if (busStat.enabled)
+    {
+        for (int page = 0; page < 256; page++)
+        {
+            watchPage[page] |= WATCH_STAT;
+        }
+    }
+    if (stopCond.flags & STOP_PC)
+    {
+        for (int page = 0; page < 256; page++)
+        {
+            for (int i = 0; i < 32; i++)
+            {
+                if (stopCond.pcMap[page * 32 + i])
+                {
+                    watchPage[page] |= WATCH_EXEC;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * フラグのあるページのアクセスだけが来る
+ * @return 停止する場合はtrue
+ */
+static bool checkWatch(int addr, int kind)
+{
+    int reason = 0;
+    if (kind == WATCH_EXEC)
+    {
+        if (addr == stopInfo.resumePc)
+        {
+            // 再開直後の命令(resumePcはexecuteCpuで消す)
+            return false;
+        }
+        if ((stopCond.flags & STOP_PC) && (stopCond.pcMap[addr >> 3] & (1 << (addr & 7))))
+        {
+            reason = STOP_PC;
+        }
+    }
+    else if ((stopCond.flags & (kind == WATCH_READ ? STOP_READ : STOP_WRITE)) && addr >= stopCond.watchStart && addr <= stopCond.watchEnd)
+    {
+        reason = kind == WATCH_READ ? STOP_READ : STOP_WRITE;
+    }
+    for (int i = 0; !reason && i < WATCH_MAX; i++)
+    {
+        if ((watchList[i].kind & kind) && addr >= watchList[i].start && addr <= watchList[i].end)
+        {
+            reason = kind == WATCH_EXEC ? STOP_PC : kind == WATCH_READ ? STOP_READ : STOP_WRITE;
+        }
+    }
+    if (reason)
+    {
+        stopCpu(reason, addr);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * フラグのあるページへのアクセス
+ * @param kind WATCH_READ, WATCH_WRITE, WATCH_EXEC のいずれか
+ * @return 停止する場合はtrue
+ */
+static bool slowAccess(int addr, int kind)
+{
+    if (busStat.enabled)
+    {
+        // READ=0, WRITE=1, EXEC=2
+        busStat.count[(kind >> 1) * 0x10000 + addr]++;
+        if (kind != WATCH_EXEC && addr >= 0x2000 && addr < 0x4018)
+        {
+            busStat.io[kind >> 1][addr < 0x4000 ? (addr & 7) : 8 + (addr & 0x1f)]++;
+        }
+    }
+    return (watchPage[addr >> 8] & kind) && checkWatch(addr, kind);
+}
 
 static void notifyApuStep()
 {
@@ -70,22 +448,165 @@ static void notifyApuStep()
     }
 }
 
+/**
+ * スプライトDMA($4014)
+ * 256バイトを読み込んでまとめてPPUへ渡し、513(奇数サイクルなら514)サイクル停止する
+ */
+static void oamDma(int page)
+{
+    int addr = page << 8;
+    if (mapper && addr < 0x2000)
+    {
+        std::memcpy(dmaBuf, ram + (addr & 0x7ff), 256);
+    }
+    else
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            dmaBuf[i] = busRead(addr | i);
+        }
+    }
+    if (dmaCallback)
+    {
+        dmaCallback();
+    }
+    context.cycle += 513 + ((cycle.totalCycle + context.cycle) & 1);
+}
+
 static void writeMem(int addr, int val)
 {
     notifyApuStep();
-    if (memWriteCallback)
+    if (watchPage[(addr >> 8) & 0xff] & (WATCH_WRITE | WATCH_STAT))
     {
-        memWriteCallback(addr, val);
+        slowAccess(addr & 0xffff, WATCH_WRITE);
+    }
+    if (addr == 0x4014)
+    {
+        oamDma(val);
+        return;
     }
+    busWrite(addr, val);
 }
 static int readMem(int addr)
 {
     notifyApuStep();
-    if (memReadCallback)
+    if (watchPage[(addr >> 8) & 0xff] & (WATCH_READ | WATCH_STAT))
     {
-        return memReadCallback(addr);
+        slowAccess(addr & 0xffff, WATCH_READ);
     }
-    return 0;
+    CDL_LOG(addr, cdl.kind);
+    return busRead(addr);
+}
+// 命令のオペランドの読み込み
+static int fetchOperand(int addr)
+{
+    notifyApuStep();
+    if (watchPage[addr >> 8] & (WATCH_READ | WATCH_STAT))
+    {
+        slowAccess(addr, WATCH_READ);
+    }
+    CDL_LOG(addr, CDL_OPERAND);
+    return busRead(addr);
+}
+/**
+ * 命令の読み込み
+ * @return 実行ウォッチで停止する場合は0x100
+ */
+static int fetchOpcode(int addr)
+{
+    notifyApuStep();
+    if ((watchPage[addr >> 8] & (WATCH_EXEC | WATCH_STAT)) && slowAccess(addr, WATCH_EXEC))
+    {
+        return 0x100;
+    }
+    CDL_LOG(addr, CDL_OPCODE | cdl.next);
+    return busRead(addr);
+}
+/**
+ * 逆アセンブル用のPRG-ROMキャッシュ(8KBのウィンドウごと)
+ * ROMの内容は変わらないので、バンクが切り替わるかシンボルが変わるまで作った行を使う
+ */
+struct DisasmBank
+{
+    // PRG-ROM内のオフセット(-1: キャッシュしない)
+    int offset = -1;
+    // 読み込み済みのバイト(1バイト1bit、TS側のマッパーでmakeOperandTextが使う)
+    uint8_t valid[0x2000 / 8];
+    uint8_t data[0x2000];
+    // stampがこの値の行だけ有効(進めるとすべての行が無効になる)
+    uint32_t generation = 1;
+    // 命令の先頭ごとのdisassembleRangeの出力(ラベル行を含む)と命令の長さ、最初に使うときに確保する
+    std::vector<uint32_t> stamp;
+    std::vector<std::string> lines;
+    std::vector<uint8_t> length;
+};
+static DisasmBank disasmCache[4];
+
+static void setDisasmBank(int bank, int offset)
+{
+    DisasmBank &cache = disasmCache[bank];
+    if (cache.offset != offset)
+    {
+        cache.offset = offset;
+        cache.generation++;
+        std::memset(cache.valid, 0, sizeof(cache.valid));
+    }
+}
+
+// 作った行をすべて捨てる(シンボルの変更時)
+static void clearDisasmLines()
+{
+    for (auto &cache : disasmCache)
+    {
+        cache.generation++;
+    }
+}
+
+// デバッグ表示用の読み込み(監視やAPU通知を行わない)
+static int peekMem(int addr)
+{
+    addr &= 0xffff;
+    DisasmBank *cache = nullptr;
+    int pos = addr & 0x1fff;
+    if (!mapper && addr >= 0x8000 && disasmCache[(addr >> 13) & 3].offset >= 0)
+    {
+        cache = &disasmCache[(addr >> 13) & 3];
+        if (cache->valid[pos >> 3] & (1 << (pos & 7)))
+        {
+            return cache->data[pos];
+        }
+    }
+    int val = busRead(addr);
+    if (cache)
+    {
+        cache->data[pos] = val;
+        cache->valid[pos >> 3] |= 1 << (pos & 7);
+    }
+    return val;
+}
+
+// シンボル(アドレスのラベル)
+static std::map<int, std::string> symbolMap;
+// addSymbolで登録する名前を受け渡すバッファ
+static char symbolNameBuf[SYMBOL_NAME_MAX];
+
+/**
+ * オペランドのアドレスを文字列にする(シンボルがあればその名前)
+ * @param digits 2: ゼロページ, 4: 絶対アドレス
+ */
+static const char *addrText(int addr, int digits)
+{
+    // 1つの命令で2回まで使う
+    static char buf[2][8];
+    static int index;
+    auto it = symbolMap.find(addr);
+    if (it != symbolMap.end())
+    {
+        return it->second.c_str();
+    }
+    char *ret = buf[index++ & 1];
+    sprintf(ret, digits == 2 ? "$%02x" : "$%04x", addr);
+    return ret;
 }
 
 static void context_set(uint8_t val)
@@ -196,10 +717,11 @@ static CpuAddressing immediate = {
     {
         context.addr = reg.pc++;
         context.cycle = 2;
+        CDL_KIND(CDL_OPERAND);
     },
     [](uint16_t addr, char *txt)
     {
-        sprintf(txt, " #$%02x", readMem(addr));
+        sprintf(txt, " #$%02x", peekMem(addr));
         return addr + 1;
     }};
 static CpuAddressing accumulator = {
@@ -207,58 +729,58 @@ static CpuAddressing accumulator = {
     {
         context.addr = -1;
     },
-    [](uint16_t addr, char *txt)
+    [](uint16_t addr, char *)
     {
         return addr;
     }};
 static CpuAddressing zeroPage = {
     []()
     {
-        context.addr = readMem(reg.pc++);
+        context.addr = fetchOperand(reg.pc++);
         context.cycle = 3;
     },
     [](uint16_t addr, char *txt)
     {
-        sprintf(txt, " $%02x", readMem(addr));
+        sprintf(txt, " %s", addrText(peekMem(addr), 2));
         return addr + 1;
     }};
 static CpuAddressing zeroPageX = {
     []()
     {
-        context.addr = (readMem(reg.pc++) + reg.x) & 0xff;
+        context.addr = (fetchOperand(reg.pc++) + reg.x) & 0xff;
         context.cycle = 4;
     },
     [](uint16_t addr, char *txt)
     {
-        sprintf(txt, " $%02x,X", readMem(addr));
+        sprintf(txt, " %s,X", addrText(peekMem(addr), 2));
         return addr + 1;
     }};
 static CpuAddressing zeroPageY = {
     []()
     {
-        context.addr = (readMem(reg.pc++) + reg.y) & 0xff;
+        context.addr = (fetchOperand(reg.pc++) + reg.y) & 0xff;
         context.cycle = 4;
     },
     [](uint16_t addr, char *txt)
     {
-        sprintf(txt, " $%02x,Y", readMem(addr));
+        sprintf(txt, " %s,Y", addrText(peekMem(addr), 2));
         return addr + 1;
     }};
 static CpuAddressing absolute = {
     []()
     {
-        context.addr = readMem(reg.pc++) | (readMem(reg.pc++) << 8);
+        context.addr = fetchOperand(reg.pc++) | (fetchOperand(reg.pc++) << 8);
         context.cycle = 4;
     },
     [](uint16_t addr, char *txt)
     {
-        sprintf(txt, " $%04x", readMem(addr) | (readMem(addr + 1) << 8));
+        sprintf(txt, " %s", addrText(peekMem(addr) | (peekMem(addr + 1) << 8), 4));
         return addr + 2;
     }};
 static CpuAddressing absoluteX = {
     []()
     {
-        uint16_t addr = readMem(reg.pc++) | (readMem(reg.pc++) << 8);
+        uint16_t addr = fetchOperand(reg.pc++) | (fetchOperand(reg.pc++) << 8);
         context.addr = (addr + reg.x) & 0xffff;
         context.cycle = 4;
         // STAだけ常に+1
@@ -269,25 +791,25 @@ static CpuAddressing absoluteX = {
     },
     [](uint16_t addr, char *txt)
     {
-        sprintf(txt, " $%04x,X", readMem(addr) | (readMem(addr + 1) << 8));
+        sprintf(txt, " %s,X", addrText(peekMem(addr) | (peekMem(addr + 1) << 8), 4));
         return addr + 2;
     }};
 static CpuAddressing absoluteXsta = {
     []()
     {
-        uint16_t addr = readMem(reg.pc++) | (readMem(reg.pc++) << 8);
+        uint16_t addr = fetchOperand(reg.pc++) | (fetchOperand(reg.pc++) << 8);
         context.addr = (addr + reg.x) & 0xffff;
         context.cycle = 5;
     },
     [](uint16_t addr, char *txt)
     {
-        sprintf(txt, " $%04x,X", readMem(addr) | (readMem(addr + 1) << 8));
+        sprintf(txt, " %s,X", addrText(peekMem(addr) | (peekMem(addr + 1) << 8), 4));
         return addr + 2;
     }};
 static CpuAddressing absoluteY = {
     []()
     {
-        uint16_t addr = readMem(reg.pc++) | (readMem(reg.pc++) << 8);
+        uint16_t addr = fetchOperand(reg.pc++) | (fetchOperand(reg.pc++) << 8);
         context.addr = (addr + reg.y) & 0xffff;
         context.cycle = 4;
         // STAだけ常に+1
@@ -298,37 +820,38 @@ static CpuAddressing absoluteY = {
     },
     [](uint16_t addr, char *txt)
     {
-        sprintf(txt, " $%04x,Y", readMem(addr) | (readMem(addr + 1) << 8));
+        sprintf(txt, " %s,Y", addrText(peekMem(addr) | (peekMem(addr + 1) << 8), 4));
         return addr + 2;
     }};
 static CpuAddressing absoluteYsta = {
     []()
     {
-        uint16_t addr = readMem(reg.pc++) | (readMem(reg.pc++) << 8);
+        uint16_t addr = fetchOperand(reg.pc++) | (fetchOperand(reg.pc++) << 8);
         context.addr = (addr + reg.y) & 0xffff;
         context.cycle = 5;
     },
     [](uint16_t addr, char *txt)
     {
-        sprintf(txt, " $%04x,Y", readMem(addr) | (readMem(addr + 1) << 8));
+        sprintf(txt, " %s,Y", addrText(peekMem(addr) | (peekMem(addr + 1) << 8), 4));
         return addr + 2;
     }};
 static CpuAddressing indirectX = {
     []()
     {
-        uint16_t addr = (readMem(reg.pc++) + reg.x) & 0xff;
+        uint16_t addr = (fetchOperand(reg.pc++) + reg.x) & 0xff;
         context.addr = readMem(addr) | (readMem((addr + 1) & 0xff) << 8);
         context.cycle = 6;
+        CDL_KIND(CDL_DATA | CDL_INDIRECT);
     },
     [](uint16_t addr, char *txt)
     {
-        sprintf(txt, " ($%02x,X)", readMem(addr));
+        sprintf(txt, " (%s,X)", addrText(peekMem(addr), 2));
         return addr + 1;
     }};
 static CpuAddressing indirectY = {
     []()
     {
-        uint16_t addr = readMem(reg.pc++);
+        uint16_t addr = fetchOperand(reg.pc++);
         context.addr = readMem(addr) | (readMem((addr + 1) & 0xff) << 8);
         addr = context.addr;
         context.addr = (context.addr + reg.y) & 0xffff;
@@ -338,36 +861,39 @@ static CpuAddressing indirectY = {
         {
             context.cycle++;
         }
+        CDL_KIND(CDL_DATA | CDL_INDIRECT);
     },
     [](uint16_t addr, char *txt)
     {
-        sprintf(txt, " ($%02x),Y", readMem(addr));
+        sprintf(txt, " (%s),Y", addrText(peekMem(addr), 2));
         return addr + 1;
     }};
 static CpuAddressing indirectYsta = {
     []()
     {
-        uint16_t addr = readMem(reg.pc++);
+        uint16_t addr = fetchOperand(reg.pc++);
         context.addr = readMem(addr) | (readMem((addr + 1) & 0xff) << 8);
         addr = context.addr;
         context.addr = (context.addr + reg.y) & 0xffff;
         context.cycle = 6;
+        CDL_KIND(CDL_DATA | CDL_INDIRECT);
     },
     [](uint16_t addr, char *txt)
     {
-        sprintf(txt, " ($%02x),Y", readMem(addr));
+        sprintf(txt, " (%s),Y", addrText(peekMem(addr), 2));
         return addr + 1;
     }};
 static CpuAddressing indirect = {
     []()
     {
-        uint16_t addr = readMem(reg.pc++) | (readMem(reg.pc++) << 8);
+        uint16_t addr = fetchOperand(reg.pc++) | (fetchOperand(reg.pc++) << 8);
         context.addr = (readMem(addr) | (readMem((addr & 0xff00) | ((addr + 1) & 0xff)) << 8)) & 0xffff;
         context.cycle = 6; // JMPは -1 なので +1 しておく
+        CDL_NEXT(CDL_INDIRECT);
     },
     [](uint16_t addr, char *txt)
     {
-        sprintf(txt, " ($%04x)", readMem(addr) | (readMem(addr + 1) << 8));
+        sprintf(txt, " (%s)", addrText(peekMem(addr) | (peekMem(addr + 1) << 8), 4));
         return addr + 2;
     }};
 static CpuAddressing relative(std::function<int()> condition)
@@ -380,7 +906,7 @@ static CpuAddressing relative(std::function<int()> condition)
             {
                 context.cycle++;
                 uint16_t bak = reg.pc + 1;
-                reg.pc = bak + (int8_t)readMem(reg.pc);
+                reg.pc = bak + (int8_t)fetchOperand(reg.pc);
                 if ((bak & 0xff00) != (reg.pc & 0xff00))
                 {
                     context.cycle++;
@@ -393,8 +919,8 @@ static CpuAddressing relative(std::function<int()> condition)
         },
         [](uint16_t addr, char *txt)
         {
-            uint8_t val = readMem(addr);
-            sprintf(txt, " $%02x(=$%04x)", val, addr + 1 + (int8_t)val);
+            uint8_t val = peekMem(addr);
+            sprintf(txt, " $%02x(=%s)", val, addrText((addr + 1 + (int8_t)val) & 0xffff, 4));
             return addr + 1;
         }};
 }
@@ -410,27 +936,27 @@ static void _accumulator()
 }
 static void _zeroPage()
 {
-    context.addr = readMem(reg.pc++);
+    context.addr = fetchOperand(reg.pc++);
     context.cycle = 3;
 }
 static void _zeroPageX()
 {
-    context.addr = (readMem(reg.pc++) + reg.x) & 0xff;
+    context.addr = (fetchOperand(reg.pc++) + reg.x) & 0xff;
     context.cycle = 4;
 }
 static void _zeroPageY()
 {
-    context.addr = (readMem(reg.pc++) + reg.y) & 0xff;
+    context.addr = (fetchOperand(reg.pc++) + reg.y) & 0xff;
     context.cycle = 4;
 }
 static void _absolute()
 {
-    context.addr = readMem(reg.pc++) | (readMem(reg.pc++) << 8);
+    context.addr = fetchOperand(reg.pc++) | (fetchOperand(reg.pc++) << 8);
     context.cycle = 4;
 }
 static void _absoluteX()
 {
-    uint16_t addr = readMem(reg.pc++) | (readMem(reg.pc++) << 8);
+    uint16_t addr = fetchOperand(reg.pc++) | (fetchOperand(reg.pc++) << 8);
     context.addr = (addr + reg.x) & 0xffff;
     context.cycle = 4;
     // STAだけ常に+1
@@ -441,13 +967,13 @@ static void _absoluteX()
 }
 static void _absoluteXsta()
 {
-    uint16_t addr = readMem(reg.pc++) | (readMem(reg.pc++) << 8);
+    uint16_t addr = fetchOperand(reg.pc++) | (fetchOperand(reg.pc++) << 8);
     context.addr = (addr + reg.x) & 0xffff;
     context.cycle = 5;
 }
 static void _absoluteY()
 {
-    uint16_t addr = readMem(reg.pc++) | (readMem(reg.pc++) << 8);
+    uint16_t addr = fetchOperand(reg.pc++) | (fetchOperand(reg.pc++) << 8);
     context.addr = (addr + reg.y) & 0xffff;
     context.cycle = 4;
     // STAだけ常に+1
@@ -458,19 +984,19 @@ static void _absoluteY()
 }
 static void _absoluteYsta()
 {
-    uint16_t addr = readMem(reg.pc++) | (readMem(reg.pc++) << 8);
+    uint16_t addr = fetchOperand(reg.pc++) | (fetchOperand(reg.pc++) << 8);
     context.addr = (addr + reg.y) & 0xffff;
     context.cycle = 5;
 }
 static void _indirectX()
 {
-    uint16_t addr = (readMem(reg.pc++) + reg.x) & 0xff;
+    uint16_t addr = (fetchOperand(reg.pc++) + reg.x) & 0xff;
     context.addr = readMem(addr) | (readMem((addr + 1) & 0xff) << 8);
     context.cycle = 6;
 }
 static void _indirectY()
 {
-    uint16_t addr = readMem(reg.pc++);
+    uint16_t addr = fetchOperand(reg.pc++);
     context.addr = readMem(addr) | (readMem((addr + 1) & 0xff) << 8);
     addr = context.addr;
     context.addr = (context.addr + reg.y) & 0xffff;
@@ -483,7 +1009,7 @@ static void _indirectY()
 }
 static void _indirectYsta()
 {
-    uint16_t addr = readMem(reg.pc++);
+    uint16_t addr = fetchOperand(reg.pc++);
     context.addr = readMem(addr) | (readMem((addr + 1) & 0xff) << 8);
     addr = context.addr;
     context.addr = (context.addr + reg.y) & 0xffff;
@@ -491,7 +1017,7 @@ static void _indirectYsta()
 }
 static void _indirect()
 {
-    uint16_t addr = readMem(reg.pc++) | (readMem(reg.pc++) << 8);
+    uint16_t addr = fetchOperand(reg.pc++) | (fetchOperand(reg.pc++) << 8);
     context.addr = (readMem(addr) | (readMem((addr & 0xff00) | ((addr + 1) & 0xff)) << 8)) & 0xffff;
     context.cycle = 6; // JMPは -1 なので +1 しておく
 }
@@ -502,7 +1028,7 @@ static void _relative(int condition)
     {
         context.cycle++;
         uint16_t bak = reg.pc + 1;
-        reg.pc = bak + (int8_t)readMem(reg.pc);
+        reg.pc = bak + (int8_t)fetchOperand(reg.pc);
         if ((bak & 0xff00) != (reg.pc & 0xff00))
         {
             context.cycle++;
@@ -528,7 +1054,7 @@ static std::function<void()> operand[256];
 // 命令のテキスト
 static std::function<uint16_t(uint16_t, char *)> operandText[256];
 // 命令文字列を返却するバッファ
-static char operandResultBuf[32];
+static char operandResultBuf[DISASM_LINE_MAX];
 
 using OperandPair = std::pair<int, const CpuAddressing &>;
 
@@ -602,6 +1128,8 @@ void CpuOperand::execute(std::function<void()> ope)
 static int executeCpu()
 {
     context.cycle = 0;
+    context.opcode = -1;
+    CDL_KIND(CDL_DATA);
     // 割り込みのチェック
     if (reg.nmiRequest)
     {
@@ -627,19 +1155,19 @@ static int executeCpu()
         {
             EM_ASM({ console.log("beforeIRQ:" + $0.toString(16) + " , " + $1.toString(16)); }, reg.p, reg.pc);
         }
-        reg.irqRequest = 0;
+        // 要因側で取り消すまでirqRequestは残る
         push(reg.pc >> 8);
         push(reg.pc);
         reg.p &= ~FLAG_BREAK;
         push(reg.p);
-        int bak = reg.pc;
         reg.p |= FLAG_INTERRUPT;
-        reg.pc = readMem(0xfffe) | (readMem(0xffff) << 8);
-        reg.nextIrq = -1;
+        int vector = readMem(0xfffe) | (readMem(0xffff) << 8);
         if (debugFlag)
         {
-            EM_ASM({ console.log("IRQ:" + $0.toString(16) + " -> " + $1.toString(16)); }, bak, reg.pc);
+            EM_ASM({ console.log("IRQ:" + $0.toString(16) + " -> " + $1.toString(16)); }, reg.pc, vector);
         }
+        reg.pc = vector;
+        reg.nextIrq = -1;
         return 7;
     }
     /*
@@ -651,7 +1179,16 @@ static int executeCpu()
         しかし、BRKは割り込みが発生してIフラグをセットするので、CLIのクリアが無効化される
     */
     int nextIrq = reg.nextIrq;
-    int code = readMem(reg.pc);
+    int code = fetchOpcode(reg.pc);
+    if (code > 0xff)
+    {
+        // 命令を実行せずに停止する
+        return 0;
+    }
+    // 再開後の最初の命令を実行したら、同じPCでも止まるようにする
+    stopInfo.resumePc = -1;
+    context.opcode = code;
+    CDL_NEXT(0);
     if (debugCallback)
     {
         debugCallback(reg.a, reg.x, reg.y, reg.s, reg.p, reg.pc, debugCycle);
@@ -700,8 +1237,8 @@ static int executeCpu()
         {
             context.cycle = 2;
             EM_ASM({ console.log("No Operation: #" + $0.toString(16) + " ope=$" + $1.toString(16)); }, reg.pc, code);
+            stopCpu(STOP_FAULT, reg.pc);
             reg.pc++;
-            faultFlag = true;
         }
     }
     if (nextIrq >= 0 && reg.nextIrq >= 0)
@@ -740,7 +1277,7 @@ extern "C" EMSCRIPTEN_KEEPALIVE char *getOperandText()
 }
 extern "C" EMSCRIPTEN_KEEPALIVE int makeOperandText(int addr)
 {
-    auto &ope = operandText[readMem(addr)];
+    auto &ope = operandText[peekMem(addr)];
     if (ope)
     {
         return ope(addr, operandResultBuf);
@@ -749,68 +1286,923 @@ extern "C" EMSCRIPTEN_KEEPALIVE int makeOperandText(int addr)
     return addr + 1;
 }
 
-extern "C" EMSCRIPTEN_KEEPALIVE void reset()
-{
-    reg.s -= 3;
-    reg.p |= (FLAG_INTERRUPT | 0x20);
-    reg.pc = readMem(0xfffc) | (readMem(0xfffd) << 8);
-    reg.irqRequest = 0;
-    reg.nmiRequest = 0;
-    reg.nextIrq = -1;
-    EM_ASM({ console.log("Start: $" + $0.toString(16)); }, reg.pc);
-    debugCycle = 7;
-    // reg.pc = 0xc000;
-}
-extern "C" EMSCRIPTEN_KEEPALIVE void powerOff()
+// disassembleRangeの出力先
+static char disasmBuf[DISASM_LINE_MAX * DISASM_MAX_LINES];
+
+extern "C" EMSCRIPTEN_KEEPALIVE char *getDisasmBuffer()
 {
-    EM_ASM({
-        console.log("powerOff");
-    });
-    powerOn = true;
-    std::memset(&reg, 0, sizeof(reg));
+    return disasmBuf;
 }
 
-// CPU処理を実行する
-extern "C" EMSCRIPTEN_KEEPALIVE int step(int cycles)
+/**
+ * 複数の命令をまとめて逆アセンブルする
+ * 1行は "addr  bytes  命令" の形式で、シンボルのあるアドレスは前に "name:" の行を付ける
+ * $8000以降は、setPrgBankOffsetで通知されたバンクのあいだ作った行を使い回す
+ * @param start 開始アドレス
+ * @param count 命令数
+ * @param outBuf 出力先(count * DISASM_LINE_MAX バイト以上)、nullなら内部バッファ(最大DISASM_MAX_LINES命令)
+ * @return 次の命令のアドレス
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE int disassembleRange(int start, int count, char *outBuf)
 {
-    if (powerOn)
+    if (!outBuf)
     {
-        powerOn = false;
-        reset();
+        outBuf = disasmBuf;
+        count = std::min(count, DISASM_MAX_LINES);
     }
-    cycle.cpuCycle = 0;
-    while (cycle.cpuCycle < cycles)
+    char *out = outBuf;
+    int addr = start & 0xffff;
+    for (int i = 0; i < count; i++)
     {
-        if (faultFlag)
+        int pos = addr & 0x1fff;
+        DisasmBank *cache = addr >= 0x8000 && disasmCache[(addr >> 13) & 3].offset >= 0 ? &disasmCache[(addr >> 13) & 3] : nullptr;
+        if (cache && !cache->stamp.empty() && cache->stamp[pos] == cache->generation)
         {
-            cycle.cpuCycle = cycles;
-            break;
+            const std::string &line = cache->lines[pos];
+            std::memcpy(out, line.data(), line.size());
+            out += line.size();
+            addr = (addr + cache->length[pos]) & 0xffff;
+            continue;
         }
-        int add = executeCpu();
-        debugCycle += add;
-        cycle.cpuCycle += add;
-        cycle.notifyCpuCycle += add;
-        notifyApuStep();
-    }
-    return cycle.cpuCycle;
-}
-
-// CPUサイクルをスキップする
-extern "C" EMSCRIPTEN_KEEPALIVE void skip(int cycles)
-{
-    cycle.cpuCycle += cycles;
-    cycle.notifyCpuCycle += cycles;
-    notifyApuStep();
+        char *head = out;
+        auto sym = symbolMap.find(addr);
+        if (sym != symbolMap.end())
+        {
+            out += sprintf(out, "%s:\n", sym->second.c_str());
+        }
+        char text[DISASM_LINE_MAX];
+        int next;
+        auto &ope = operandText[peekMem(addr)];
+        if (ope)
+        {
+            next = ope(addr, text);
+        }
+        else
+        {
+            strcpy(text, "???");
+            next = addr + 1;
+        }
+        char bytes[12] = "";
+        for (int j = 0; j < next - addr && j < 3; j++)
+        {
+            sprintf(bytes + j * 3, "%02x ", peekMem(addr + j));
+        }
+        out += sprintf(out, "%04x  %-9s %s\n", addr, bytes, text);
+        // 次のウィンドウにかかる命令はバンクの組み合わせで変わるので残さない
+        if (cache && pos + (next - addr) <= 0x2000)
+        {
+            if (cache->stamp.empty())
+            {
+                cache->stamp.assign(0x2000, 0);
+                cache->lines.resize(0x2000);
+                cache->length.resize(0x2000);
+            }
+            cache->stamp[pos] = cache->generation;
+            cache->lines[pos].assign(head, out - head);
+            cache->length[pos] = next - addr;
+        }
+        addr = next & 0xffff;
+    }
+    *out = 0;
+    return addr;
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE char *getSymbolBuffer()
+{
+    return symbolNameBuf;
+}
+
+/**
+ * シンボルを登録する(名前は getSymbolBuffer に書いておく)
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void addSymbol(int addr)
+{
+    symbolNameBuf[SYMBOL_NAME_MAX - 1] = 0;
+    symbolMap[addr & 0xffff] = symbolNameBuf;
+    clearDisasmLines();
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE void removeSymbol(int addr)
+{
+    symbolMap.erase(addr & 0xffff);
+    clearDisasmLines();
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE void clearSymbols()
+{
+    symbolMap.clear();
+    clearDisasmLines();
+}
+
+/**
+ * 逆アセンブル用のキャッシュを捨てる(ROMの入れ替え時)
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void clearDisasmCache()
+{
+    for (int i = 0; i < 4; i++)
+    {
+        setDisasmBank(i, -1);
+    }
+}
+
+/**
+ * PRGバンクの切り替えを通知する
+ * @param bank 0-3($8000,$A000,$C000,$E000)
+ * @param offset PRG-ROM内のオフセット
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void setPrgBankOffset(int bank, int offset)
+{
+    prgBankOffset[bank & 3] = offset;
+    setDisasmBank(bank & 3, offset);
+#ifdef ENABLE_CDL
+    updateCdlPage();
+#endif
+}
+
+/**
+ * CDLを開始する
+ * @param size PRG-ROMのサイズ
+ * @return 記録先、CDLが無効なビルドではnull
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *initCdl(int size)
+{
+#ifdef ENABLE_CDL
+    cdl.size = std::min(size, CDL_PRG_MAX);
+    std::memset(cdl.prg, 0, sizeof(cdl.prg));
+    updateCdlPage();
+    return cdl.prg;
+#else
+    (void)size;
+    return nullptr;
+#endif
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *getCdlData()
+{
+#ifdef ENABLE_CDL
+    return cdl.prg;
+#else
+    return nullptr;
+#endif
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE int getCdlSize()
+{
+#ifdef ENABLE_CDL
+    return cdl.size;
+#else
+    return 0;
+#endif
+}
+
+// CPUを通らない読み込み(DMC)の記録
+extern "C" EMSCRIPTEN_KEEPALIVE void logCdl(int addr, int flag)
+{
+#ifdef ENABLE_CDL
+    CDL_LOG(addr & 0xffff, flag);
+#else
+    (void)addr;
+    (void)flag;
+#endif
+}
+
+/**
+ * 8KB単位でPRGバンクを設定する
+ * @param window 0-3($8000,$A000,$C000,$E000)
+ * @param index 8KB単位のバンク番号
+ */
+static void setPrg8k(int window, int index)
+{
+    int count = std::max(rom.prgSize >> 13, 1);
+    int offset = (((index % count) + count) % count) << 13;
+    rom.prgPage[window] = rom.prg + offset;
+    setPrgBankOffset(window, offset);
+}
+static void setPrg16k(int window, int index)
+{
+    setPrg8k(window * 2, index * 2);
+    setPrg8k(window * 2 + 1, index * 2 + 1);
+}
+/**
+ * 1KB単位でCHRバンクを設定する(CHR-RAMは何もしない)
+ * @param bank 0-7($0000-$1FFF)
+ * @param index 1KB単位のバンク番号
+ */
+static void setChr1k(int bank, int index)
+{
+    if (rom.chrSize < 0x400)
+    {
+        return;
+    }
+    int offset = (index % (rom.chrSize >> 10)) << 10;
+    if (rom.chrBank[bank] != offset)
+    {
+        rom.chrBank[bank] = offset;
+        if (chrBankCallback)
+        {
+            chrBankCallback(bank, offset);
+        }
+    }
+}
+static void setChr4k(int bank, int index)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        setChr1k(bank * 4 + i, index * 4 + i);
+    }
+}
+static void setChr8k(int index)
+{
+    setChr4k(0, index * 2);
+    setChr4k(1, index * 2 + 1);
+}
+static void setMirror(int mode)
+{
+    if (rom.mirrorMode != 4 && mirrorCallback)
+    {
+        mirrorCallback(mode);
+    }
+}
+
+/**
+ * Mapper 0
+ */
+class MapperNROM : public Mapper
+{
+public:
+    void reset() override
+    {
+        setPrg16k(0, 0);
+        setPrg16k(1, 1);
+        setChr8k(0);
+    }
+    void write(int, int) override
+    {
+        // ROMへの書き込みは無視する
+    }
+};
+
+/**
+ * Mapper 1
+ */
+class MapperMMC1 : public Mapper
+{
+    int shift;
+    int count;
+    // 0-1: ミラー, 2-3: PRGモード, 4: CHR 4KB単位
+    int control;
+    int chr0;
+    int chr1;
+    int prg;
+
+    void apply()
+    {
+        setMirror(control & 3);
+        if (control & 0x10)
+        {
+            setChr4k(0, chr0);
+            setChr4k(1, chr1);
+        }
+        else
+        {
+            setChr8k(chr0 >> 1);
+        }
+        // 512KBのROMはCHRレジスタのbit4で256KBを選ぶ
+        int base = rom.prgSize > 0x40000 ? (chr0 & 0x10) : 0;
+        int bank = prg & 0x0f;
+        switch ((control >> 2) & 3)
+        {
+        case 0:
+        case 1:
+            // 32KB
+            setPrg16k(0, base | (bank & 0x0e));
+            setPrg16k(1, base | (bank & 0x0e) | 1);
+            break;
+        case 2:
+            // $8000固定
+            setPrg16k(0, base);
+            setPrg16k(1, base | bank);
+            break;
+        default:
+            // $C000固定
+            setPrg16k(0, base | bank);
+            setPrg16k(1, base | 0x0f);
+            break;
+        }
+    }
+
+public:
+    void reset() override
+    {
+        shift = count = 0;
+        control = 0x0c;
+        chr0 = 0;
+        chr1 = 1;
+        prg = 0;
+        apply();
+    }
+    void write(int addr, int val) override
+    {
+        if (val & 0x80)
+        {
+            shift = count = 0;
+            control |= 0x0c;
+            apply();
+            return;
+        }
+        shift |= (val & 1) << count;
+        if (++count < 5)
+        {
+            return;
+        }
+        switch ((addr >> 13) & 3)
+        {
+        case 0:
+            control = shift;
+            break;
+        case 1:
+            chr0 = shift;
+            break;
+        case 2:
+            chr1 = shift;
+            break;
+        default:
+            prg = shift;
+            break;
+        }
+        shift = count = 0;
+        apply();
+    }
+    void hash(HashState &h) const override
+    {
+        hashValue(h, shift);
+        hashValue(h, count);
+        hashValue(h, control);
+        hashValue(h, chr0);
+        hashValue(h, chr1);
+        hashValue(h, prg);
+    }
+};
+
+/**
+ * Mapper 2
+ */
+class MapperUxROM : public Mapper
+{
+public:
+    void reset() override
+    {
+        setPrg16k(0, 0);
+        setPrg16k(1, (rom.prgSize >> 14) - 1);
+        setChr8k(0);
+    }
+    void write(int, int val) override
+    {
+        setPrg16k(0, val);
+    }
+};
+
+/**
+ * Mapper 4
+ */
+class MapperMMC3 : public Mapper
+{
+    // $8000の値(0-2: レジスタ番号, 6: PRGモード, 7: CHR反転)
+    int select;
+    int bankReg[8];
+
+    void apply()
+    {
+        int last = (rom.prgSize >> 13) - 1;
+        if (select & 0x40)
+        {
+            setPrg8k(0, last - 1);
+            setPrg8k(2, bankReg[6]);
+        }
+        else
+        {
+            setPrg8k(0, bankReg[6]);
+            setPrg8k(2, last - 1);
+        }
+        setPrg8k(1, bankReg[7]);
+        setPrg8k(3, last);
+        // R0, R1 は2KB単位
+        int chr = (select & 0x80) ? 4 : 0;
+        setChr1k(chr, bankReg[0] & 0xfe);
+        setChr1k(chr + 1, bankReg[0] | 1);
+        setChr1k(chr + 2, bankReg[1] & 0xfe);
+        setChr1k(chr + 3, bankReg[1] | 1);
+        for (int i = 0; i < 4; i++)
+        {
+            setChr1k((chr ^ 4) + i, bankReg[2 + i]);
+        }
+    }
+
+public:
+    void reset() override
+    {
+        select = 0;
+        int init[8] = {0, 2, 4, 5, 6, 7, 0, 1};
+        std::memcpy(bankReg, init, sizeof(bankReg));
+        apply();
+    }
+    void write(int addr, int val) override
+    {
+        switch (addr & 0xe001)
+        {
+        case 0x8000:
+            select = val;
+            apply();
+            break;
+        case 0x8001:
+            bankReg[select & 7] = val;
+            apply();
+            break;
+        case 0xa000:
+            setMirror((val & 1) ? 3 : 2);
+            break;
+        case 0xa001:
+            // WRAM保護は未対応
+            break;
+        default:
+            // IRQカウンタはA12を見ているPPU側にある
+            if (mapperWriteCallback)
+            {
+                mapperWriteCallback(addr & 0xe001, val);
+            }
+            break;
+        }
+    }
+    void hash(HashState &h) const override
+    {
+        hashValue(h, select);
+        hashUpdate(h, bankReg, sizeof(bankReg));
+    }
+};
+
+/**
+ * ネイティブのマッパーを選ぶ
+ * @param number iNESのマッパー番号(-1: 使わない)
+ * @param chrSize CHR-ROMのサイズ(0: CHR-RAM)
+ * @param mirrorMode ヘッダのミラーモード(4画面ならミラー変更を無視する)
+ * @return 対応しているマッパーなら1
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE int initMapper(int number, int chrSize, int mirrorMode)
+{
+    switch (number)
+    {
+    case 0:
+        mapper.reset(new MapperNROM());
+        break;
+    case 1:
+        mapper.reset(new MapperMMC1());
+        break;
+    case 2:
+        mapper.reset(new MapperUxROM());
+        break;
+    case 4:
+        mapper.reset(new MapperMMC3());
+        break;
+    default:
+        mapper.reset();
+        return 0;
+    }
+    rom.chrSize = chrSize;
+    rom.mirrorMode = mirrorMode;
+    for (int i = 0; i < 4; i++)
+    {
+        rom.prgPage[i] = rom.prg;
+    }
+    std::memset(ram, 0, sizeof(ram));
+    std::memset(wram, 0, sizeof(wram));
+    wramWritten = false;
+    return 1;
 }
 
-// IRQリクエスト
-extern "C" EMSCRIPTEN_KEEPALIVE void irq(int flag)
+// バンクを初期状態に戻す
+extern "C" EMSCRIPTEN_KEEPALIVE void resetMapper()
+{
+    if (mapper)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            rom.chrBank[i] = -1;
+        }
+        mapper->reset();
+    }
+}
+
+/**
+ * PRG-ROMを読み込む領域を確保する
+ * @return 書き込み先
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *loadPrgRom(int size)
+{
+    rom.prgSize = std::min(size, PRG_ROM_MAX);
+    return rom.prg;
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *getRam()
+{
+    return ram;
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *getWram()
+{
+    return wram;
+}
+
+// 前回の呼び出し以降にWRAMへ書き込んだかどうか
+extern "C" EMSCRIPTEN_KEEPALIVE int checkWramWrite()
+{
+    int ret = wramWritten ? 1 : 0;
+    wramWritten = false;
+    return ret;
+}
+
+// TS側のマッパーのときのRAM/WRAM(hashStateの前に書く)
+static uint8_t hashExtBuf[0x800 + 0x2000];
+
+extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *getHashBuffer()
+{
+    return hashExtBuf;
+}
+
+/**
+ * CPUの状態(レジスタ、サイクル、RAM、WRAM、バンク、マッパー)のハッシュ
+ * @param extSize ネイティブのマッパーでないとき、getHashBufferに書いたバイト数
+ * @return 64bitのハッシュ(uint32 x 2、下位が先)
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *hashState(int extSize)
+{
+    static uint64_t result;
+    HashState h;
+    hashInit(h);
+    uint8_t regs[9] = {(uint8_t)reg.a, (uint8_t)reg.x, (uint8_t)reg.y, (uint8_t)reg.s, (uint8_t)reg.p,
+                       (uint8_t)reg.pc, (uint8_t)(reg.pc >> 8), (uint8_t)(reg.irqRequest | (reg.nmiRequest << 3)), (uint8_t)reg.nextIrq};
+    hashUpdate(h, regs, sizeof(regs));
+    hashValue(h, cycle.cpuCycle);
+    hashValue(h, cycle.frameCycle);
+    hashValue(h, cycle.totalCycle);
+    hashUpdate(h, prgBankOffset, sizeof(prgBankOffset));
+    hashUpdate(h, rom.chrBank, sizeof(rom.chrBank));
+    if (mapper)
+    {
+        hashUpdate(h, ram, sizeof(ram));
+        hashUpdate(h, wram, sizeof(wram));
+        mapper->hash(h);
+    }
+    else
+    {
+        hashUpdate(h, hashExtBuf, std::min(std::max(extSize, 0), (int)sizeof(hashExtBuf)));
+    }
+    result = hashFinal(h);
+    return reinterpret_cast<uint32_t *>(&result);
+}
+
+// 監視やAPU通知を行わないバスの読み込み(DMA, DMC用)
+extern "C" EMSCRIPTEN_KEEPALIVE int readBus(int addr)
+{
+    return busRead(addr & 0xffff);
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE void setChrBankCallback(void (*callback)(int, int))
+{
+    chrBankCallback = callback;
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE void setMirrorCallback(void (*callback)(int))
+{
+    mirrorCallback = callback;
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *getDmaBuffer()
+{
+    return dmaBuf;
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE void setDmaCallback(void (*callback)())
+{
+    dmaCallback = callback;
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE void setMapperWriteCallback(void (*callback)(int, int))
+{
+    mapperWriteCallback = callback;
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE void reset()
+{
+    reg.s -= 3;
+    reg.p |= (FLAG_INTERRUPT | 0x20);
+    reg.pc = readMem(0xfffc) | (readMem(0xfffd) << 8);
+    reg.irqRequest = 0;
+    reg.nmiRequest = 0;
+    reg.nextIrq = -1;
+    EM_ASM({ console.log("Start: $" + $0.toString(16)); }, reg.pc);
+    debugCycle = 7;
+    // reg.pc = 0xc000;
+}
+extern "C" EMSCRIPTEN_KEEPALIVE void powerOff()
+{
+    EM_ASM({
+        console.log("powerOff");
+    });
+    powerOn = true;
+    std::memset(&reg, 0, sizeof(reg));
+    stopInfo.reason = 0;
+}
+
+/**
+ * 停止条件を確認しながらCPU処理を実行する
+ * @return 消費したCPUサイクル
+ */
+static int stepUntil(int cycles)
+{
+    cycle.stepCycle = cycles;
+    cycle.cpuCycle = 0;
+    while (cycle.cpuCycle < cycles)
+    {
+        if (stopInfo.reason)
+        {
+            cycle.cpuCycle = cycles;
+            break;
+        }
+        int pc = reg.pc;
+        int before = cycle.frameCycle * 3;
+        int add = executeCpu();
+        debugCycle += add;
+        cycle.cpuCycle += add;
+        cycle.notifyCpuCycle += add;
+        cycle.frameCycle += add;
+        cycle.totalCycle += add;
+        notifyApuStep();
+        int after = cycle.frameCycle * 3;
+        if ((stopCond.flags & STOP_BRK) && context.opcode == 0x00)
+        {
+            stopCpu(STOP_BRK, pc);
+        }
+        if (stopCond.flags & STOP_CYCLES)
+        {
+            stopCond.cycles -= add;
+            if (stopCond.cycles <= 0)
+            {
+                // 1回だけ
+                stopCond.flags &= ~STOP_CYCLES;
+                stopCpu(STOP_CYCLES, reg.pc);
+            }
+        }
+        if ((stopCond.flags & STOP_SCANLINE) && before < stopCond.ppuCycle && after >= stopCond.ppuCycle)
+        {
+            stopCpu(STOP_SCANLINE, reg.pc);
+        }
+        if ((stopCond.flags & STOP_FRAME) && before < FRAME_PPU_CYCLES && after >= FRAME_PPU_CYCLES)
+        {
+            stopCpu(STOP_FRAME, reg.pc);
+        }
+    }
+    return cycle.cpuCycle;
+}
+
+// CPU処理を実行する
+extern "C" EMSCRIPTEN_KEEPALIVE int step(int cycles)
+{
+    if (powerOn)
+    {
+        powerOn = false;
+        reset();
+    }
+    if (stopCond.flags & STOP_LOOP_MASK)
+    {
+        // 命令ごとの停止条件がある場合のみ遅いループを使う
+        return stepUntil(cycles);
+    }
+    cycle.stepCycle = cycles;
+    cycle.cpuCycle = 0;
+    while (cycle.cpuCycle < cycles)
+    {
+        if (stopInfo.reason)
+        {
+            cycle.cpuCycle = cycles;
+            break;
+        }
+        int add = executeCpu();
+        debugCycle += add;
+        cycle.cpuCycle += add;
+        cycle.notifyCpuCycle += add;
+        cycle.frameCycle += add;
+        cycle.totalCycle += add;
+        notifyApuStep();
+    }
+    return cycle.cpuCycle;
+}
+
+/**
+ * 停止条件のいずれかを満たすか、指定サイクルまで実行する
+ * @param cycles 実行するCPUサイクル
+ * @return 停止理由(STOP_xxx)、0ならサイクルを使い切った
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE int runUntil(int cycles)
+{
+    if (powerOn)
+    {
+        powerOn = false;
+        reset();
+    }
+    stepUntil(cycles);
+    return stopInfo.reason;
+}
+
+/**
+ * 停止条件を設定する
+ * @param flags STOP_xxxの組み合わせ、0で無効
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void setStopCondition(int flags)
+{
+    stopCond.flags = flags & ~STOP_FAULT;
+    updateWatchPage();
+}
+
+// PCブレークポイントの設定
+extern "C" EMSCRIPTEN_KEEPALIVE void setBreakPoint(int addr, int flag)
+{
+    addr &= 0xffff;
+    if (flag)
+    {
+        stopCond.pcMap[addr >> 3] |= 1 << (addr & 7);
+    }
+    else
+    {
+        stopCond.pcMap[addr >> 3] &= ~(1 << (addr & 7));
+    }
+    updateWatchPage();
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE void clearBreakPoints()
+{
+    std::memset(stopCond.pcMap, 0, sizeof(stopCond.pcMap));
+    updateWatchPage();
+}
+
+// 読み書きを監視するアドレス範囲(STOP_READ/STOP_WRITE)
+extern "C" EMSCRIPTEN_KEEPALIVE void setWatchRange(int start, int end)
+{
+    stopCond.watchStart = start & 0xffff;
+    stopCond.watchEnd = end & 0xffff;
+    updateWatchPage();
+}
+
+/**
+ * ウォッチポイントを追加する(停止条件に関係なく常に有効)
+ * @param kind WATCH_READ | WATCH_WRITE | WATCH_EXEC
+ * @return 番号、空きがなければ-1
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE int addWatchPoint(int start, int end, int kind)
+{
+    for (int i = 0; i < WATCH_MAX; i++)
+    {
+        if (!watchList[i].kind)
+        {
+            watchList[i].start = start & 0xffff;
+            watchList[i].end = end & 0xffff;
+            watchList[i].kind = kind & (WATCH_READ | WATCH_WRITE | WATCH_EXEC);
+            updateWatchPage();
+            return i;
+        }
+    }
+    return -1;
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE void removeWatchPoint(int index)
+{
+    if (index >= 0 && index < WATCH_MAX)
+    {
+        watchList[index].kind = 0;
+        updateWatchPage();
+    }
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE void clearWatchPoints()
+{
+    std::memset(watchList, 0, sizeof(watchList));
+    updateWatchPage();
+}
+
+/**
+ * 停止するスキャンライン(STOP_SCANLINE)
+ * @param line 0-239: 表示, 241: VBlank, 261: プリレンダー
+ * @param dot 0-340
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void setStopScanline(int line, int dot)
+{
+    // フレームはプリレンダーライン(261)から始まる
+    stopCond.ppuCycle = ((line + 1) % 262) * 341 + dot;
+}
+
+// 停止までのCPUサイクル(STOP_CYCLES)
+extern "C" EMSCRIPTEN_KEEPALIVE void setStopCycles(int cycles)
+{
+    stopCond.cycles = cycles;
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE int getStopReason()
+{
+    return stopInfo.reason;
+}
+extern "C" EMSCRIPTEN_KEEPALIVE int getStopCycle()
+{
+    return stopInfo.cycle;
+}
+extern "C" EMSCRIPTEN_KEEPALIVE int getStopAddr()
+{
+    return stopInfo.addr;
+}
+
+// 停止を解除する(同じPCのブレークポイントは1回無視する)
+extern "C" EMSCRIPTEN_KEEPALIVE void resume()
+{
+    stopInfo.reason = 0;
+    stopInfo.resumePc = reg.pc;
+}
+
+// フレームの開始を通知する(renderScreenの直前)
+extern "C" EMSCRIPTEN_KEEPALIVE void startFrame()
+{
+    cycle.frameCycle = 0;
+    if (busStat.enabled && busStat.perFrame)
+    {
+        std::fill(busStat.count.begin(), busStat.count.end(), 0);
+        std::memset(busStat.io, 0, sizeof(busStat.io));
+    }
+}
+
+/**
+ * バスのアクセス統計を設定する
+ * @param enable 0: 無効, 1: 有効
+ * @param perFrame 1: フレームごとにリセット, 0: 累積
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void setBusStat(int enable, int perFrame)
+{
+    if (enable && !busStat.enabled)
+    {
+        busStat.count.assign(3 * 0x10000, 0);
+        std::memset(busStat.io, 0, sizeof(busStat.io));
+    }
+    busStat.enabled = enable != 0;
+    busStat.perFrame = perFrame != 0;
+    updateWatchPage();
+}
+
+// 読み込み, 書き込み, 命令実行の順に 0x10000 個ずつ(一度も有効にしていなければnull)
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *getBusStat()
+{
+    return busStat.count.empty() ? nullptr : busStat.count.data();
+}
+
+// 読み込み, 書き込みの順に $2000-$2007, $4000-$4017 の 0x20 個ずつ
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *getIoStat()
+{
+    return &busStat.io[0][0];
+}
+
+/**
+ * 今のバスアクセスからstep終了までのCPUサイクル(命令の最後のサイクルでアクセスしたとみなす)
+ * PPUのsyncCpuに渡す、命令がstepをはみ出すと負になる
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE int getBusCycle()
+{
+    return cycle.stepCycle - cycle.cpuCycle - std::max(0, context.cycle - 1);
+}
+
+// CPUサイクルをスキップする
+extern "C" EMSCRIPTEN_KEEPALIVE void skip(int cycles)
+{
+    cycle.cpuCycle += cycles;
+    cycle.notifyCpuCycle += cycles;
+    cycle.frameCycle += cycles;
+    cycle.totalCycle += cycles;
+    notifyApuStep();
+}
+
+/**
+ * IRQリクエスト(IRQ線は要因ごとのワイヤードOR)
+ * @param source IRQ_SOURCE_xxx
+ * @param flag 1: 要求, 0: 取り消し
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void irq(int source, int flag)
 {
     if (debugFlag)
     {
-        EM_ASM({ console.log("IRQ:" + $0.toString(16)); }, flag);
+        EM_ASM({ console.log("IRQ:" + $0 + "=" + $1); }, source, flag);
+    }
+    if (flag & 1)
+    {
+        reg.irqRequest |= 1 << source;
+    }
+    else
+    {
+        reg.irqRequest &= ~(1 << source);
     }
-    reg.irqRequest = flag & 1;
 }
 
 // NMIリクエスト
@@ -0,0 +1,201 @@
+#pragma once
+/**
+ * 64bitハッシュ(XXH3の長い入力の処理を真似たもの、値はXXH3とは一致しない)
+ * 64バイトごとに8本の64bitレーンへ足し込むので、SIMDでは2レーンずつ処理できる
+ * SIMDの有無、wasmとネイティブで同じ値になる(フレームや状態を別のビルドと比べる)
+ */
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "simd.h"
+
+#define HASH_STRIPE 64
+#define HASH_SECRET_SIZE 192
+// 1ブロックのストライプ数(ブロックごとにレーンをかき混ぜる)
+#define HASH_STRIPES_PER_BLOCK ((HASH_SECRET_SIZE - HASH_STRIPE) / 8)
+#define HASH_PRIME32_1 0x9E3779B1U
+#define HASH_PRIME32_2 0x85EBCA77U
+#define HASH_PRIME32_3 0xC2B2AE3DU
+#define HASH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME64_3 0x165667B19E3779F9ULL
+#define HASH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+/**
+ * 鍵(splitmix64で作る)
+ */
+struct HashSecret
+{
+    uint8_t value[HASH_SECRET_SIZE];
+    constexpr HashSecret() : value()
+    {
+        uint64_t x = HASH_PRIME64_5;
+        for (int i = 0; i < HASH_SECRET_SIZE; i += 8)
+        {
+            x += 0x9E3779B97F4A7C15ULL;
+            uint64_t z = x;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            z ^= z >> 31;
+            for (int b = 0; b < 8; b++)
+            {
+                value[i + b] = (uint8_t)(z >> (b * 8));
+            }
+        }
+    }
+};
+static constexpr HashSecret hashSecret;
+
+struct HashState
+{
+    uint64_t acc[8];
+    uint64_t length;
+    // ブロック内で処理したストライプ数
+    int stripes;
+    int bufSize;
+    uint8_t buf[HASH_STRIPE];
+};
+
+static inline uint64_t hashRead64(const uint8_t *p)
+{
+    uint64_t value;
+    std::memcpy(&value, p, 8);
+    return value;
+}
+
+// 1ストライプ(64バイト)を足し込む
+static inline void hashStripe(uint64_t *acc, const uint8_t *data, const uint8_t *secret)
+{
+#ifdef SIMD_ENABLED
+    for (int i = 0; i < 8; i += 2)
+    {
+        simd128 d = simd_load(data + i * 8);
+        simd128 k = simd_xor(d, simd_load(secret + i * 8));
+        simd128 a = simd_add_u64(simd_load(acc + i), simd_swap_u64(d));
+        simd_store(acc + i, simd_add_u64(a, simd_mul_u32_u64(k, simd_shr_u64(k, 32))));
+    }
+#else
+    for (int i = 0; i < 8; i++)
+    {
+        uint64_t d = hashRead64(data + i * 8);
+        uint64_t k = d ^ hashRead64(secret + i * 8);
+        acc[i ^ 1] += d;
+        acc[i] += (k & 0xffffffff) * (k >> 32);
+    }
+#endif
+}
+
+// ブロックの終わりでレーンをかき混ぜる
+static inline void hashScramble(uint64_t *acc, const uint8_t *secret)
+{
+#ifdef SIMD_ENABLED
+    simd128 prime = simd_splat_u32(HASH_PRIME32_1);
+    for (int i = 0; i < 8; i += 2)
+    {
+        simd128 a = simd_load(acc + i);
+        a = simd_xor(simd_xor(a, simd_shr_u64(a, 47)), simd_load(secret + i * 8));
+        simd128 low = simd_mul_u32_u64(a, prime);
+        simd128 high = simd_mul_u32_u64(simd_shr_u64(a, 32), prime);
+        simd_store(acc + i, simd_add_u64(low, simd_shl_u64(high, 32)));
+    }
+#else
+    for (int i = 0; i < 8; i++)
+    {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= hashRead64(secret + i * 8);
+        acc[i] = a * HASH_PRIME32_1;
+    }
+#endif
+}
+
+static inline void hashConsume(HashState &h, const uint8_t *data)
+{
+    hashStripe(h.acc, data, hashSecret.value + h.stripes * 8);
+    if (++h.stripes == HASH_STRIPES_PER_BLOCK)
+    {
+        hashScramble(h.acc, hashSecret.value + HASH_SECRET_SIZE - HASH_STRIPE);
+        h.stripes = 0;
+    }
+}
+
+static inline void hashInit(HashState &h)
+{
+    static const uint64_t init[8] = {HASH_PRIME32_3, HASH_PRIME64_1, HASH_PRIME64_2, HASH_PRIME64_3,
+                                     HASH_PRIME64_4, HASH_PRIME32_2, HASH_PRIME64_5, HASH_PRIME32_1};
+    std::memcpy(h.acc, init, sizeof(init));
+    h.length = 0;
+    h.stripes = 0;
+    h.bufSize = 0;
+}
+
+static inline void hashUpdate(HashState &h, const void *data, size_t size)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    h.length += size;
+    if (h.bufSize)
+    {
+        size_t fill = std::min(size, (size_t)(HASH_STRIPE - h.bufSize));
+        std::memcpy(h.buf + h.bufSize, p, fill);
+        h.bufSize += fill;
+        p += fill;
+        size -= fill;
+        if (h.bufSize < HASH_STRIPE)
+        {
+            return;
+        }
+        hashConsume(h, h.buf);
+        h.bufSize = 0;
+    }
+    for (; size >= HASH_STRIPE; p += HASH_STRIPE, size -= HASH_STRIPE)
+    {
+        hashConsume(h, p);
+    }
+    std::memcpy(h.buf, p, size);
+    h.bufSize = size;
+}
+
+// 整数などをそのまま足す(パディングのない型だけ)
+template <typename T>
+static inline void hashValue(HashState &h, T value)
+{
+    hashUpdate(h, &value, sizeof(value));
+}
+
+static inline uint64_t hashMix128(uint64_t a, uint64_t b)
+{
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t hashFinal(const HashState &h)
+{
+    uint64_t acc[8];
+    std::memcpy(acc, h.acc, sizeof(acc));
+    if (h.bufSize)
+    {
+        // 残りは0で埋めて、長さで区別する
+        uint8_t last[HASH_STRIPE] = {};
+        std::memcpy(last, h.buf, h.bufSize);
+        hashStripe(acc, last, hashSecret.value + h.stripes * 8);
+    }
+    uint64_t result = h.length * HASH_PRIME64_1;
+    for (int i = 0; i < 4; i++)
+    {
+        const uint8_t *secret = hashSecret.value + 11 + i * 16;
+        result += hashMix128(acc[i * 2] ^ hashRead64(secret), acc[i * 2 + 1] ^ hashRead64(secret + 8));
+    }
+    result ^= result >> 37;
+    result *= 0x165667919E3779F9ULL;
+    return result ^ (result >> 32);
+}
+
+static inline uint64_t hash64(const void *data, size_t size)
+{
+    HashState h;
+    hashInit(h);
+    hashUpdate(h, data, size);
+    return hashFinal(h);
+}
@@ -1,6 +1,12 @@
 #include <emscripten.h>
+#include <atomic>
+#include <cmath>
 #include <cstring>
 #include <functional>
+#include <vector>
+#include "simd.h"
+#include "capture.h"
+#include "hash.h"
 
 // 1 scan = 341 PPU cycle,(3ppu = 1cpu)
 // 262 line
@@ -48,6 +54,19 @@
 
 #define PPU_CYCLES 341
 
+// setNameTableSourceの参照先
+#define NT_SOURCE_FILL 4
+#define NT_SOURCE_CHR 0x100
+
+// Code/Data Logger のフラグ(CHR-ROM 1バイトごと)
+#define CDL_CHR_RENDER 0x01
+#define CDL_CHR_READ 0x02
+// CHR-ROMの最大サイズ
+#define CDL_CHR_MAX 0x40000
+
+// CHR-ROMの最大サイズ
+#define CHR_ROM_MAX 0x40000
+
 struct _reg
 {
     //
@@ -117,7 +136,7 @@ static uint32_t emphasisColor[] = {
     0xFFFFFFBE, 0xFFFFFFFF, 0xFF141414, 0xFF141414};
 
 /**
- * NameTableへのインデックス参照
+ * NameTableへのインデックス参照(ミラーモードで選ぶ内部VRAM)
  */
 static int nameIndex[4] = {0, 0, 1, 1};
 
@@ -130,12 +149,268 @@ struct _state
 static _state state;
 
 static uint16_t lineBuf[256]; // 0x100: 色あり, 0x200: スプライト前, 0x400: Sprite0
-static uint32_t screen[256 * 240];
+// スプライトのあるピクセル(8ピクセルごと、bit7が左端)
+static uint8_t spriteMask[32];
+
+/**
+ * 8bitのパターンを1ピクセル1バイトに広げる表(bit7が先頭のバイト)
+ */
+struct BgSpreadTable
+{
+    uint64_t value[256];
+    constexpr BgSpreadTable() : value()
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            for (int dx = 0; dx < 8; dx++)
+            {
+                if (i & (0x80 >> dx))
+                {
+                    value[i] |= 1ULL << (dx * 8);
+                }
+            }
+        }
+    }
+};
+static constexpr BgSpreadTable bgSpread;
+
+// パターンの1行を8ピクセル(1ピクセル1バイト、0-3、左端が下位バイト)にする
+static inline uint64_t decodeTileRow(const uint8_t *chr, int row)
+{
+    return bgSpread.value[chr[row]] | (bgSpread.value[chr[row + 8]] << 1);
+}
+static uint32_t screenBuffer[256 * 240];
+// 描画先と最新の画面(トリプルバッファのときはframeBuffersのどれか)
+static uint32_t *screen = screenBuffer;
+// 今の強調/グレースケールで変換したパレット
+static uint32_t rgbaPalette[64];
+// SIMD用にR,G,Bを分けたもの
+static uint8_t rgbaPlane[3][64];
+static int rgbaMode = -1;
+// フレームスキップ中(lineBufとscreenを書かない)
+static bool skipRender = false;
+// renderScreenのskip指定(skipRenderはバンド外のラインでも立つ)
+static bool frameSkip = false;
+// 画素を合成するライン(setRenderBand)
+static int bandStart = 0;
+static int bandEnd = 240;
+// 再生でバンドより上のライン(絵に影響しないので、vの更新だけ行う)
+static bool fastForward = false;
 
 static uint8_t pattern[0x2000];
 static uint8_t nameTable[4][0x400];
 static uint8_t palette[0x20];
 
+/**
+ * 1KBごとのVRAMの参照先($0000-$3FFF)
+ * 0-7: パターン, 8-11: ネームテーブル, 12-15: 8-11のミラー($3F00-$3FFFはパレット)
+ * バンク切り替えやミラーはポインタの差し替えで行う
+ */
+static uint8_t *vramPage[16] = {
+    pattern, pattern + 0x400, pattern + 0x800, pattern + 0xc00,
+    pattern + 0x1000, pattern + 0x1400, pattern + 0x1800, pattern + 0x1c00,
+    nameTable[0], nameTable[0], nameTable[1], nameTable[1],
+    nameTable[0], nameTable[0], nameTable[1], nameTable[1]};
+// 書き込みを無視するページ(CHR-ROM、1ページ1bit)
+static uint16_t vramReadOnly;
+// フィルモードのネームテーブル
+static uint8_t fillPage[0x400];
+// readVramRange/writeVramRange の受け渡し
+static uint8_t vramTransfer[0x4000];
+
+/**
+ * 静止画面の判定用
+ * 内容(パターン、ネームテーブル、パレット、スプライト)が実際に変わったら世代を進め、
+ * ラインごとにレジスタとバンクの状態を前のフレームと比べる
+ */
+struct LineInput
+{
+    // 変換直前の内容の世代
+    uint32_t generation;
+    // 描画中のレジスタアクセスとバンク切り替え(ピクセル位置つき)
+    uint32_t writeHash;
+    // ライン開始時のバンク
+    uint32_t pageHash;
+    // スプライト評価時のバンク
+    uint32_t spritePageHash;
+    uint16_t v;
+    uint16_t bgPattern[2];
+    uint8_t x;
+    uint8_t attr;
+    uint8_t ctrl2000;
+    uint8_t ctrl2001;
+    // スプライト評価時
+    uint8_t spriteCtrl2000;
+    uint8_t spriteCtrl2001;
+    // 変換時(強調/グレースケール)
+    uint8_t outCtrl2001;
+    // memcmpで比べるので詰め物を作らない(常に0)
+    uint8_t reserved[3];
+};
+static_assert(sizeof(LineInput) == 32, "LineInput must not have padding");
+static LineInput lineInput[240];
+static bool lineInputValid = false;
+static uint32_t contentGeneration = 0;
+static uint32_t pageHash = 0;
+static uint32_t lineWriteHash = 0;
+// 描画済みのピクセル位置(表示ラインのBG描画中以外は-1)
+static int renderPx = -1;
+static LineInput spriteInput;
+// 前のフレームから画面が変わったか
+static bool screenChanged = true;
+// ラインごとのハッシュと、前のフレームから変わったライン(1ライン1bit)
+static uint64_t lineHash[240];
+static uint32_t dirtyLines[(240 + 31) / 32];
+
+/**
+ * 表示用の3枚の画面(トリプルバッファ)
+ * PPUはbackに書いてreadyと交換し、受け取り側はreadyとfrontを交換する
+ * 交換はreadyFrameのexchangeだけなので、受け取り側は別スレッドでもよい
+ */
+static uint32_t frameBuffers[3][256 * 240];
+static bool tripleBuffer = false;
+// PPU側だけが触る
+static int backBuffer = 0;
+static uint32_t publishCount = 0;
+// 最後にpublishしてから、それぞれの画面で古くなっているライン
+static uint32_t staleLines[3][(240 + 31) / 32];
+// 描画中のフレームで変換したライン(変換しなかったラインは前の画面から写す)
+static uint32_t convertedLines[(240 + 31) / 32];
+// 前にpublishした画面
+static uint32_t *publishedScreen = nullptr;
+// 受け取り側だけが触る
+static int frontBuffer = 1;
+static uint32_t frontFrame = 0;
+// bit0-1: 最新の画面, bit2: 未読, bit8-: フレーム番号
+#define READY_INDEX 3
+#define READY_FRESH 4
+#define READY_FRAME_SHIFT 8
+static std::atomic<uint32_t> readyFrame{2};
+
+/**
+ * backに直接描き終わった画面を、最新の画面として出す
+ * 入力が同じで変換しなかったラインのうち、このbackでは古いものだけ前の画面から写す
+ */
+static void publishFrame()
+{
+    uint32_t *stale = staleLines[backBuffer];
+    for (int y = 0; y < 240; y++)
+    {
+        uint32_t bit = 1u << (y & 31);
+        if ((stale[y >> 5] & bit) && !(convertedLines[y >> 5] & bit))
+        {
+            std::memcpy(screen + y * 256, publishedScreen + y * 256, 256 * 4);
+        }
+    }
+    for (int b = 0; b < 3; b++)
+    {
+        for (int i = 0; i < (240 + 31) / 32; i++)
+        {
+            staleLines[b][i] |= dirtyLines[i];
+        }
+    }
+    std::memset(stale, 0, sizeof(staleLines[0]));
+    publishCount++;
+    uint32_t old = readyFrame.exchange(backBuffer | READY_FRESH | (publishCount << READY_FRAME_SHIFT), std::memory_order_acq_rel);
+    backBuffer = old & READY_INDEX;
+}
+
+static inline uint32_t mixHash(uint32_t hash, uint32_t value)
+{
+    return (hash ^ value) * 0x01000193;
+}
+
+// 描画中のレジスタアクセスを記録する
+static inline void logRenderWrite(uint32_t value)
+{
+    if (renderPx >= 0)
+    {
+        lineWriteHash = mixHash(lineWriteHash, (renderPx << 20) ^ value);
+    }
+}
+
+// ページの差し替え後に呼ぶ
+static void updatePageHash()
+{
+    uint32_t hash = 0x811c9dc5;
+    for (int i = 0; i < 12; i++)
+    {
+        uintptr_t ptr = (uintptr_t)vramPage[i];
+        hash = mixHash(hash, (uint32_t)ptr);
+        hash = mixHash(hash, (uint32_t)((uint64_t)ptr >> 32));
+    }
+    pageHash = hash;
+    logRenderWrite(0x1000000 ^ hash);
+}
+
+// ネームテーブル($2000,$2400,$2800,$2C00)の参照先を差し替える
+static void setNameTablePage(int index, uint8_t *page, bool readOnly)
+{
+    vramPage[8 + index] = vramPage[12 + index] = page;
+    uint16_t bit = (1 << (8 + index)) | (1 << (12 + index));
+    vramReadOnly = readOnly ? (vramReadOnly | bit) : (vramReadOnly & ~bit);
+    updatePageHash();
+}
+
+/**
+ * 背景のキャッシュ
+ * 4つの論理ネームテーブルを並べた512x480の画像(1ピクセル1バイト、属性 << 2 | パターン)
+ * 8x8のセル単位で、ネームテーブル/属性/パターンへの書き込みで無効にする
+ * ページやbgAddrが変わったら、そのネームテーブルは全部作り直す
+ */
+struct BgCacheKey
+{
+    const uint8_t *page;
+    const uint8_t *chr[4];
+    uint32_t generation;
+};
+static uint8_t bgCache[480][512];
+static bool bgCellValid[4][30][32];
+static BgCacheKey bgCacheKey[4];
+// 書き込みで直接変えない内容(CHR-ROM、スナップショット)が変わったら進める
+static uint32_t bgCacheGeneration = 0;
+// 書き換えられたパターン(内部VRAMのタイル単位、1タイル1bit)
+static uint32_t bgPatternDirty[0x2000 / 16 / 32];
+static bool bgPatternDirtyAny = false;
+static bool bgCacheEnabled = true;
+
+// ネームテーブルの1バイトが変わったセルを無効にする
+static void invalidateBgCell(const uint8_t *page, int offset)
+{
+    for (int n = 0; n < 4; n++)
+    {
+        if (bgCacheKey[n].page != page)
+        {
+            continue;
+        }
+        if (offset < 0x3c0)
+        {
+            bgCellValid[n][offset >> 5][offset & 31] = false;
+        }
+        else
+        {
+            // 属性は4x4セル
+            int ax = (offset & 7) << 2;
+            int ay = ((offset >> 3) & 7) << 2;
+            for (int cy = ay; cy < std::min(30, ay + 4); cy++)
+            {
+                std::memset(&bgCellValid[n][cy][ax], 0, 4);
+            }
+        }
+    }
+}
+
+// パターンの1バイトが変わったタイルを記録する(使っているセルはvalidateBgCacheで無効にする)
+static void markBgPattern(const uint8_t *ptr)
+{
+    if (ptr >= pattern && ptr < pattern + sizeof(pattern))
+    {
+        int tile = (ptr - pattern) >> 4;
+        bgPatternDirty[tile >> 5] |= 1u << (tile & 31);
+        bgPatternDirtyAny = true;
+    }
+}
+
 struct _sprite
 {
     uint8_t mem[256];
@@ -150,16 +425,380 @@ struct _cycle
 };
 static _cycle cycle;
 
+// notifyCpuCycleで進めている区間(PPUサイクル)
+static int batchStart = 0;
+static int batchEnd = 0;
+// 今のレジスタアクセスのPPUサイクル(syncCpuが無ければ区間の先頭)
+static int busDot = 0;
+// 表示ラインのピクセル0のPPUサイクル
+static int lineDot = 0;
+// CPUをまとめて進めるタイル数(1-32)
+static int cpuInterleave = 1;
+
+/**
+ * フレーム内のレジスタ書き込みの記録
+ * 1件2ワード: PPUサイクル(0がpre renderライン、ラインnのドットdは(n + 1) * 341 + d), (アドレス下位3bit << 8) | 値
+ */
+#define WRITE_LOG_MAX 4096
+static uint32_t writeLog[WRITE_LOG_MAX * 2];
+static int writeLogCount = 0;
+
+// $0000-$1FFFの1KBごとのCHR-ROM内のオフセット(-1: CHR-RAM)
+static int chrBankOffset[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+
+/**
+ * CHR-ROM(CPU側のマッパーがバンクを選ぶ)
+ */
+struct _chrRom
+{
+    int size;
+    uint8_t data[CHR_ROM_MAX];
+};
+static _chrRom chrRom;
+
+#ifdef ENABLE_CDL
+struct _cdl
+{
+    int size;
+    // 1KBごとの記録先(CHR-RAMは捨てる)
+    uint8_t *page[8];
+    uint8_t sink[0x400];
+    uint8_t chr[CDL_CHR_MAX];
+};
+static _cdl cdl;
+// 1アクセスにつきORを1回だけ行う
+#define CDL_LOG(addr, flag) (cdl.page[((addr) >> 10) & 7][(addr) & 0x3ff] |= (flag))
+
+static void updateCdlPage()
+{
+    for (int i = 0; i < 8; i++)
+    {
+        int offset = chrBankOffset[i];
+        if (offset >= 0 && offset + 0x400 <= cdl.size)
+        {
+            cdl.page[i] = cdl.chr + offset;
+        }
+        else
+        {
+            cdl.page[i] = cdl.sink;
+        }
+    }
+}
+#else
+#define CDL_LOG(addr, flag)
+#endif
+
 static std::function<void(int)> hBlankCallback;
 static std::function<void()> vBlankCallback;
 static std::function<void(int)> cpuCallback;
+static std::function<void(int)> irqCallback;
+
+// hBlankCallbackを呼ぶライン(0-261、1ライン1bit)、初期値は表示ライン
+static uint32_t hBlankMask[(262 + 31) / 32] = {
+    0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+    0xffffffff, 0xffffffff, 0xffffffff, 0x0000ffff, 0};
+
+static void notifyHblank(int line)
+{
+    if (hBlankCallback && (hBlankMask[line >> 5] & (1u << (line & 31))))
+    {
+        hBlankCallback(line);
+    }
+}
+
+/**
+ * MMC3のスキャンラインIRQカウンタ
+ * PPUアドレスのA12の立ち上がり(1ラインに1回)で数える
+ */
+struct _scanlineIrq
+{
+    // MMC3のレジスタが書き込まれたら有効にする
+    bool active;
+    bool enabled;
+    bool reload;
+    uint8_t latch;
+    uint8_t counter;
+};
+static _scanlineIrq scanlineIrq;
+// 次のラインのスプライト(8スロット)のタイル番号のbit0(bit0がスロット0)
+// 8x16ではこれがパターンテーブルになる、空きスロットはタイル$FF
+static uint8_t spriteA12 = 0xff;
+
+/**
+ * 描画を別スレッド(別インスタンス)で行うためのフレーム記録
+ * フレーム先頭の状態(RenderSnapshot)と、フレーム中に外から来た操作(イベント)を順に記録する
+ * 同じ状態から同じ操作を同じnotifyCpuCycleの中で再生すれば、同じ画面になる
+ */
+struct RenderSnapshot
+{
+    _reg reg;
+    _state state;
+    _sprite sprite;
+    _cycle cycle;
+    _scanlineIrq scanlineIrq;
+    uint8_t pattern[0x2000];
+    uint8_t nameTable[4][0x400];
+    uint8_t palette[0x20];
+    uint8_t fillPage[0x400];
+    // ページの参照先(上位8bit: 種類, 下位24bit: オフセット)
+    uint32_t pageSource[16];
+    uint32_t hBlankMask[(262 + 31) / 32];
+    int nameIndex[4];
+    int cpuInterleave;
+    uint16_t vramReadOnly;
+};
+
+// イベントの種類(1ワード目の上位8bit、下位24bitはnotifyCpuCycleの回数)
+#define EV_WRITE_MEM 1
+#define EV_READ_MEM 2
+#define EV_WRITE_VRAM 3
+#define EV_WRITE_SPRITE 4
+#define EV_SPRITE_DMA 5
+#define EV_CHR_BANK 6
+#define EV_NAME_TABLE 7
+#define EV_FILL_TILE 8
+#define EV_MIRROR 9
+#define EV_WRITE_MAPPER 10
+#define EV_RESET_MAPPER 11
+#define EV_SYNC_CPU 12
+
+#define PAGE_PATTERN 1
+#define PAGE_NAME_TABLE 2
+#define PAGE_FILL 3
+#define PAGE_CHR_ROM 4
+
+// 1フレーム分の記録の最大(ワード)、超えたらそのフレームは再生できない
+#define FRAME_LOG_MAX 0x10000
+
+struct _frameLog
+{
+    bool enabled;
+    // renderScreenの中だけ記録する
+    bool active;
+    // 書き込み中のバッファ(0/1)
+    int index;
+    int size[2];
+    bool overflow[2];
+    // 外から呼ばれた関数の深さ(中から呼んだ分は記録しない)
+    int depth;
+    // renderScreenの中でcpuCallbackを呼んだ回数
+    int notifyCount;
+    // FRAME_LOG_MAXワードずつ、記録を始めるか再生に使うまでは確保しない
+    std::vector<uint32_t> data[2];
+};
+static _frameLog frameLog;
+
+// 再生中のイベント
+static const uint32_t *replayPos = nullptr;
+static const uint32_t *replayEnd = nullptr;
+
+static void logWords(const uint32_t *words, int count)
+{
+    int index = frameLog.index;
+    if (frameLog.size[index] + count > FRAME_LOG_MAX)
+    {
+        frameLog.overflow[index] = true;
+        return;
+    }
+    std::memcpy(frameLog.data[index].data() + frameLog.size[index], words, count * sizeof(uint32_t));
+    frameLog.size[index] += count;
+}
+
+/**
+ * 外から呼ばれた操作を1件記録する(スコープを抜けるまで中の呼び出しは記録しない)
+ */
+struct EventScope
+{
+    EventScope(int type, int a, int b, const uint8_t *payload = nullptr, int payloadSize = 0)
+    {
+        if (frameLog.active && !frameLog.depth)
+        {
+            uint32_t head[3] = {(uint32_t)(type << 24) | (frameLog.notifyCount & 0xffffff), (uint32_t)a, (uint32_t)b};
+            logWords(head, 3);
+            if (payload)
+            {
+                logWords((const uint32_t *)payload, payloadSize / 4);
+            }
+        }
+        frameLog.depth++;
+    }
+    ~EventScope()
+    {
+        frameLog.depth--;
+    }
+};
+
+static uint32_t pageToSource(const uint8_t *page)
+{
+    if (page >= pattern && page < pattern + sizeof(pattern))
+    {
+        return (PAGE_PATTERN << 24) | (page - pattern);
+    }
+    if (page >= nameTable[0] && page < nameTable[0] + sizeof(nameTable))
+    {
+        return (PAGE_NAME_TABLE << 24) | (page - nameTable[0]);
+    }
+    if (page == fillPage)
+    {
+        return PAGE_FILL << 24;
+    }
+    return (PAGE_CHR_ROM << 24) | (page - chrRom.data);
+}
+
+static uint8_t *sourceToPage(uint32_t source)
+{
+    uint32_t offset = source & 0xffffff;
+    switch (source >> 24)
+    {
+    case PAGE_PATTERN:
+        return pattern + (offset & 0x1c00);
+    case PAGE_NAME_TABLE:
+        return nameTable[0] + (offset & 0xc00);
+    case PAGE_FILL:
+        return fillPage;
+    default:
+        return chrRom.data + std::min(offset, (uint32_t)CHR_ROM_MAX - 0x400);
+    }
+}
+
+static void saveRenderSnapshot(RenderSnapshot &snap)
+{
+    snap.reg = reg;
+    snap.state = state;
+    snap.sprite = sprite;
+    snap.cycle = cycle;
+    snap.scanlineIrq = scanlineIrq;
+    std::memcpy(snap.pattern, pattern, sizeof(pattern));
+    std::memcpy(snap.nameTable, nameTable, sizeof(nameTable));
+    std::memcpy(snap.palette, palette, sizeof(palette));
+    std::memcpy(snap.fillPage, fillPage, sizeof(fillPage));
+    for (int i = 0; i < 16; i++)
+    {
+        snap.pageSource[i] = pageToSource(vramPage[i]);
+    }
+    std::memcpy(snap.hBlankMask, hBlankMask, sizeof(hBlankMask));
+    std::memcpy(snap.nameIndex, nameIndex, sizeof(nameIndex));
+    snap.cpuInterleave = cpuInterleave;
+    snap.vramReadOnly = vramReadOnly;
+}
+
+// フレーム先頭の状態を記録する
+static void logRenderSnapshot()
+{
+    static RenderSnapshot snap;
+    saveRenderSnapshot(snap);
+    logWords((const uint32_t *)&snap, sizeof(snap) / 4);
+}
+
+// 記録した状態に戻す(再生側)
+static void loadRenderSnapshot(const RenderSnapshot *snap)
+{
+    if (std::memcmp(pattern, snap->pattern, sizeof(pattern)) || std::memcmp(nameTable, snap->nameTable, sizeof(nameTable)) ||
+        std::memcmp(palette, snap->palette, sizeof(palette)) || std::memcmp(fillPage, snap->fillPage, sizeof(fillPage)) ||
+        std::memcmp(sprite.mem, snap->sprite.mem, sizeof(sprite.mem)))
+    {
+        contentGeneration++;
+    }
+    // 変わったところだけ背景のキャッシュを無効にする
+    for (int i = 0; i < (int)sizeof(pattern); i += 16)
+    {
+        if (std::memcmp(pattern + i, snap->pattern + i, 16))
+        {
+            markBgPattern(pattern + i);
+        }
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        if (std::memcmp(nameTable[i], snap->nameTable[i], 0x400))
+        {
+            for (int offset = 0; offset < 0x400; offset++)
+            {
+                if (nameTable[i][offset] != snap->nameTable[i][offset])
+                {
+                    invalidateBgCell(nameTable[i], offset);
+                }
+            }
+        }
+    }
+    if (std::memcmp(fillPage, snap->fillPage, sizeof(fillPage)))
+    {
+        bgCacheGeneration++;
+    }
+    reg = snap->reg;
+    state = snap->state;
+    sprite = snap->sprite;
+    cycle = snap->cycle;
+    scanlineIrq = snap->scanlineIrq;
+    std::memcpy(pattern, snap->pattern, sizeof(pattern));
+    std::memcpy(nameTable, snap->nameTable, sizeof(nameTable));
+    std::memcpy(palette, snap->palette, sizeof(palette));
+    std::memcpy(fillPage, snap->fillPage, sizeof(fillPage));
+    for (int i = 0; i < 16; i++)
+    {
+        vramPage[i] = sourceToPage(snap->pageSource[i]);
+    }
+    std::memcpy(hBlankMask, snap->hBlankMask, sizeof(hBlankMask));
+    std::memcpy(nameIndex, snap->nameIndex, sizeof(nameIndex));
+    cpuInterleave = snap->cpuInterleave;
+    vramReadOnly = snap->vramReadOnly;
+    updatePageHash();
+}
+
+/**
+ * A12が立ち上がるドット
+ * 背景とスプライトのスロットごとのパターンテーブルで決まる
+ * MMC3は短いA12の変化を無視するので、$0000のフェッチが1スロット以上続いた後の$1000だけ数える
+ * @return 立ち上がらない場合は-1
+ */
+static int getA12Dot()
+{
+    if (!scanlineIrq.active || !(state.ctrl2001 & DISPLAY_ENABLE))
+    {
+        return -1;
+    }
+    uint8_t slots = reg.spSize == 16 ? spriteA12 : reg.spAddr ? 0xff : 0;
+    // ドット256までの背景のフェッチ
+    bool low = !reg.bgAddr;
+    for (int i = 0; i < 8; i++)
+    {
+        bool high = slots & (1 << i);
+        if (low && high)
+        {
+            // スプライトのフェッチ(スロットiのパターン)
+            return 260 + i * 8;
+        }
+        low = !high;
+    }
+    // 次のラインの背景のフェッチ($1000)
+    return low && reg.bgAddr ? 324 : -1;
+}
+
+static void clockScanlineIrq()
+{
+    if (!scanlineIrq.counter || scanlineIrq.reload)
+    {
+        scanlineIrq.counter = scanlineIrq.latch;
+        scanlineIrq.reload = false;
+    }
+    else
+    {
+        scanlineIrq.counter--;
+    }
+    if (!scanlineIrq.counter && scanlineIrq.enabled && irqCallback)
+    {
+        irqCallback(1);
+    }
+}
 
 static void notifyCpuCycle()
 {
     if (cycle.ppuCycle > cycle.notifyPpuCycle)
     {
         int cpuCycle = (cycle.ppuCycle - cycle.notifyPpuCycle + 2) / 3;
+        busDot = batchStart = cycle.notifyPpuCycle;
         cycle.notifyPpuCycle += cpuCycle * 3;
+        batchEnd = cycle.notifyPpuCycle;
+        frameLog.notifyCount++;
         if (cpuCallback)
         {
             cpuCallback(cpuCycle);
@@ -169,47 +808,120 @@ static void notifyCpuCycle()
 
 extern "C" EMSCRIPTEN_KEEPALIVE void writeSprite(int addr, int value)
 {
-    sprite.mem[addr & 255] = value;
+    EventScope scope(EV_WRITE_SPRITE, addr, value);
+    if (sprite.mem[addr & 255] != (uint8_t)value)
+    {
+        sprite.mem[addr & 255] = value;
+        contentGeneration++;
+    }
 }
 
-extern "C" EMSCRIPTEN_KEEPALIVE void writeVram(int addr, int value)
+// スプライトDMAの転送元(CPU側から256バイトをコピーしておく)
+static uint8_t dmaBuf[256];
+
+extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *getDmaBuffer()
+{
+    return dmaBuf;
+}
+
+// スプライトDMA(OAMADDRから256バイト)
+extern "C" EMSCRIPTEN_KEEPALIVE void writeSpriteDma()
 {
-    if (addr < 0x2000)
+    EventScope scope(EV_SPRITE_DMA, 0, 0, dmaBuf, sizeof(dmaBuf));
+    int addr = sprite.addr;
+    if (std::memcmp(sprite.mem + addr, dmaBuf, 256 - addr) || std::memcmp(sprite.mem, dmaBuf + 256 - addr, addr))
     {
-        pattern[addr & 0x1fff] = value;
+        std::memcpy(sprite.mem + addr, dmaBuf, 256 - addr);
+        std::memcpy(sprite.mem, dmaBuf + 256 - addr, addr);
+        contentGeneration++;
     }
-    else if (addr < 0x3f00)
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE void writeVram(int addr, int value)
+{
+    EventScope scope(EV_WRITE_VRAM, addr, value);
+    addr &= 0x3fff;
+    if (addr < 0x3f00)
     {
-        nameTable[nameIndex[(addr >> 10) & 3]][addr & 0x3ff] = value;
+        uint8_t *dst = vramPage[addr >> 10] + (addr & 0x3ff);
+        if (!(vramReadOnly & (1 << (addr >> 10))) && *dst != (uint8_t)value)
+        {
+            *dst = value;
+            contentGeneration++;
+            if (addr < 0x2000)
+            {
+                markBgPattern(dst);
+            }
+            else
+            {
+                invalidateBgCell(vramPage[addr >> 10], addr & 0x3ff);
+            }
+        }
     }
     else if (addr & 3)
     {
-        palette[addr & 0x1f] = value & 0x3f;
+        if (palette[addr & 0x1f] != (value & 0x3f))
+        {
+            palette[addr & 0x1f] = value & 0x3f;
+            contentGeneration++;
+        }
     }
-    else
+    else if (palette[addr & 0x0f] != (value & 0x3f))
     {
         palette[addr & 0x0f] = value & 0x3f;
         palette[0x10 | (addr & 0x0f)] = value & 0x3f;
+        contentGeneration++;
     }
 }
 
 extern "C" EMSCRIPTEN_KEEPALIVE int readVram(int addr)
 {
-    if (addr < 0x2000)
+    addr &= 0x3fff;
+    if (addr < 0x3f00)
     {
-        return pattern[addr];
+        return vramPage[addr >> 10][addr & 0x3ff];
     }
-    else if (addr < 0x3f00)
+    return palette[addr & 0x1f];
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *getVramTransferBuffer()
+{
+    return vramTransfer;
+}
+
+/**
+ * VRAMをまとめて読み込む(デバッグツール用)
+ * @return 読み込んだデータ(getVramTransferBufferと同じ)
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *readVramRange(int addr, int length)
+{
+    length = std::min(length, (int)sizeof(vramTransfer));
+    for (int i = 0; i < length; i++)
     {
-        return nameTable[nameIndex[(addr >> 10) & 3]][addr & 0x3ff];
+        vramTransfer[i] = readVram(addr + i);
     }
-    else
+    return vramTransfer;
+}
+
+// getVramTransferBufferに置いたデータをまとめて書き込む
+extern "C" EMSCRIPTEN_KEEPALIVE void writeVramRange(int addr, int length)
+{
+    length = std::min(length, (int)sizeof(vramTransfer));
+    for (int i = 0; i < length; i++)
     {
-        return palette[addr & 0x1f];
+        writeVram(addr + i, vramTransfer[i]);
     }
 }
 extern "C" EMSCRIPTEN_KEEPALIVE void writeMem(int addr, int val)
 {
+    EventScope scope(EV_WRITE_MEM, addr, val);
+    logRenderWrite(((addr & 7) << 8) | (val & 0xff));
+    if (writeLogCount < WRITE_LOG_MAX)
+    {
+        writeLog[writeLogCount * 2] = busDot;
+        writeLog[writeLogCount * 2 + 1] = ((addr & 7) << 8) | (val & 0xff);
+        writeLogCount++;
+    }
     switch (addr & 7)
     {
     case 0:
@@ -254,7 +966,7 @@ extern "C" EMSCRIPTEN_KEEPALIVE void writeMem(int addr, int val)
         sprite.addr = val;
         break;
     case 4:
-        sprite.mem[sprite.addr++] = val;
+        writeSprite(sprite.addr++, val);
         break;
     case 5:
         if (reg.w)
@@ -302,14 +1014,17 @@ static void fetchTile()
         return;
     }
     // name table
-    uint16_t addr = 0x2000 | (reg.v & 0x0fff);
-    int tile = readVram(addr);
+    const uint8_t *name = vramPage[8 + ((reg.v >> 10) & 3)];
+    int tile = name[reg.v & 0x3ff];
     // パターン
-    addr = reg.bgAddr | (tile << 4) | (reg.v >> 12);
-    reg.bgPattern[0] |= pattern[addr];
-    reg.bgPattern[1] |= pattern[addr | 8];
+    uint16_t addr = reg.bgAddr | (tile << 4) | (reg.v >> 12);
+    const uint8_t *chr = vramPage[addr >> 10] + (addr & 0x3ff);
+    reg.bgPattern[0] |= chr[0];
+    reg.bgPattern[1] |= chr[8];
+    CDL_LOG(addr, CDL_CHR_RENDER);
+    CDL_LOG(addr | 8, CDL_CHR_RENDER);
     // 属性
-    int at = readVram(0x23c0 | (reg.v & 0x0c00) | ((reg.v >> 4) & 0x38) | ((reg.v >> 2) & 7));
+    int at = name[0x3c0 | ((reg.v >> 4) & 0x38) | ((reg.v >> 2) & 7)];
     // EM_ASM({ console.log("Tile:" + $0.toString(16) + " addr=" + $1.toString(16)); }, reg.v, 0x23c0 | (reg.v & 0x0c00) | ((reg.v >> 4) & 0x38) | ((reg.v >> 2) & 7));
     if (reg.v & 2)
     {
@@ -333,12 +1048,743 @@ static void fetchTile()
     }
 }
 
-static void fetchSprite(int y)
+// fetchTileのうち、読み込みを省いてvだけ進める(バンドの手前のラインはラインの最後の2タイルで上書きされる)
+static void skipTile()
 {
-    for (int x = 0; x < 256; x++)
-    {
-        lineBuf[x] = palette[0];
+    reg.bgPattern[0] <<= 8;
+    reg.bgPattern[1] <<= 8;
+    reg.attr <<= 2;
+    if (!(state.ctrl2001 & BG_ENABLE))
+    {
+        return;
+    }
+    if ((reg.v & 0x1f) == 31)
+    {
+        reg.v &= ~0x1f;
+        reg.v ^= 0x400;
+    }
+    else
+    {
+        reg.v++;
+    }
+}
+
+/**
+ * 背景の8ピクセル分を描画する
+ * @param dst lineBufの描画位置
+ * @param pattern0 2タイル分のパターン(下位ビット面、上位8bitが今のタイル)
+ * @param pattern1 2タイル分のパターン(上位ビット面)
+ * @param attr 2タイル分の属性(bit2-3: 今のタイル, bit0-1: 次のタイル)
+ * @param fineX 水平スクロールの端数(0-7)
+ * @param sprites スプライトのあるピクセル(bit7が左端)
+ * @param pixels 描画するピクセル(bit7が左端、行の途中で分割するとき)
+ * @return Sprite0ヒットならtrue
+ */
+static bool renderBgSpan(uint16_t *dst, uint16_t pattern0, uint16_t pattern1, int attr, int fineX, uint8_t sprites, uint8_t pixels)
+{
+    uint8_t plane0 = ((pattern0 << fineX) >> 8) & pixels;
+    uint8_t plane1 = ((pattern1 << fineX) >> 8) & pixels;
+    uint8_t opaque = plane0 | plane1;
+    if (!opaque)
+    {
+        return false;
+    }
+    // 8ピクセルのパレット番号を1バイトずつまとめて作る
+    uint64_t pix = bgSpread.value[plane0] | (bgSpread.value[plane1] << 1);
+    // 今のタイルは先頭(8 - fineX)ピクセル
+    uint64_t current = ~0ULL >> (fineX * 8);
+    uint64_t at = ((attr & 0x0c) * 0x0101010101010101ULL & current) | (((attr & 3) << 2) * 0x0101010101010101ULL & ~current);
+    pix |= at;
+#ifdef SIMD_ENABLED
+    // 8ピクセルを1レーンずつ、パレットはswizzleで引く
+    simd128 index = simd_from_u64(pix);
+    simd128 color = simd_or(simd_extend_low_u8(simd_lookup16(simd_load(palette), index)), simd_splat_u16(0x100));
+    simd128 zero = simd_splat_u16(0);
+    simd128 transparent = simd_eq_u16(simd_and(simd_extend_low_u8(index), simd_splat_u16(3)), zero);
+    simd128 cur = simd_load(dst);
+    // 不透明で、前面スプライトがないピクセルだけ書く
+    simd128 write = simd_andnot(simd_eq_u16(simd_and(cur, simd_splat_u16(0x200)), zero), transparent);
+    simd_store(dst, simd_select(write, color, cur));
+    return (opaque & sprites) && simd_any(simd_andnot(simd_and(cur, simd_splat_u16(0x400)), transparent));
+#else
+    if (!(opaque & sprites))
+    {
+        // スプライトと重ならない
+        for (int dx = 0; dx < 8; dx++, pix >>= 8)
+        {
+            if (opaque & (0x80 >> dx))
+            {
+                dst[dx] = palette[pix & 0x0f] | 0x100;
+            }
+        }
+        return false;
+    }
+    bool hit = false;
+    for (int dx = 0; dx < 8; dx++, pix >>= 8)
+    {
+        if (opaque & (0x80 >> dx))
+        {
+            if (dst[dx] & 0x400)
+            {
+                // Sprite0 hit
+                hit = true;
+            }
+            if (!(dst[dx] & 0x200))
+            {
+                dst[dx] = palette[pix & 0x0f] | 0x100;
+            }
+        }
+    }
+    return hit;
+#endif
+}
+
+/**
+ * 強調/グレースケールの状態に合わせてRGBAパレットを作り直す
+ */
+static void updateRgbaPalette()
+{
+    int mode = state.ctrl2001 & (GRAY_SCALE | 0xe0);
+    if (mode == rgbaMode)
+    {
+        return;
+    }
+    rgbaMode = mode;
+    uint32_t emphasisFlag = 0;
+    if (mode & 0x80)
+    {
+        // 赤強調
+        emphasisFlag = 0x0000ff;
+    }
+    if (mode & 0x40)
+    {
+        // 緑強調
+        emphasisFlag |= 0x00ff00;
+    }
+    if (mode & 0x20)
+    {
+        // 青強調
+        emphasisFlag |= 0xff0000;
+    }
+    for (int col = 0; col < 64; col++)
+    {
+        if (mode & GRAY_SCALE)
+        {
+            rgbaPalette[col] = grayPalette[col];
+        }
+        else
+        {
+            rgbaPalette[col] = (colorPalette[col] & ~emphasisFlag) | (emphasisColor[col] & emphasisFlag);
+        }
+        for (int c = 0; c < 3; c++)
+        {
+            rgbaPlane[c][col] = rgbaPalette[col] >> (c * 8);
+        }
+    }
+}
+
+// 1ライン分のRGBAのハッシュ
+static uint64_t hashLine(const uint32_t *line)
+{
+    return hash64(line, 256 * 4);
+}
+
+/**
+ * lineBufのパレット番号をRGBAに変換する
+ */
+static void convertLine(uint32_t *dst)
+{
+#ifdef SIMD_ENABLED
+    // 64色を16色ずつ4つの表に分けて、R,G,Bそれぞれswizzleで引く
+    simd128 table[3][4];
+    for (int c = 0; c < 3; c++)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            table[c][i] = simd_load(rgbaPlane[c] + i * 16);
+        }
+    }
+    simd128 mask = simd_splat_u16(0x3f);
+    simd128 bank = simd_splat_u8(16);
+    simd128 alpha = simd_splat_u8(0xff);
+    for (int x = 0; x < 256; x += 16)
+    {
+        simd128 index = simd_narrow_u16(simd_and(simd_load(lineBuf + x), mask), simd_and(simd_load(lineBuf + x + 8), mask));
+        simd128 rgb[3];
+        for (int c = 0; c < 3; c++)
+        {
+            // 範囲外は0になるので、16ずつずらしてORする
+            simd128 idx = index;
+            rgb[c] = simd_lookup16(table[c][0], idx);
+            for (int i = 1; i < 4; i++)
+            {
+                idx = simd_sub_u8(idx, bank);
+                rgb[c] = simd_or(rgb[c], simd_lookup16(table[c][i], idx));
+            }
+        }
+        simd128 rgLow = simd_zip_low_u8(rgb[0], rgb[1]);
+        simd128 rgHigh = simd_zip_high_u8(rgb[0], rgb[1]);
+        simd128 baLow = simd_zip_low_u8(rgb[2], alpha);
+        simd128 baHigh = simd_zip_high_u8(rgb[2], alpha);
+        simd_store(dst + x, simd_zip_low_u16(rgLow, baLow));
+        simd_store(dst + x + 4, simd_zip_high_u16(rgLow, baLow));
+        simd_store(dst + x + 8, simd_zip_low_u16(rgHigh, baHigh));
+        simd_store(dst + x + 12, simd_zip_high_u16(rgHigh, baHigh));
+    }
+#else
+    for (int x = 0; x < 256; x++)
+    {
+        dst[x] = rgbaPalette[lineBuf[x] & 0x3f];
+    }
+#endif
+}
+
+/**
+ * NTSCのコンポジット信号のフィルター
+ * パレット番号と強調から1ピクセル8サンプル(色副搬送波は12サンプルで1周)の信号を作り、YIQに戻してRGBにする
+ * 入力3ピクセル(24サンプル)が出力7ピクセルになるので、256ピクセルは602ピクセルになる
+ * 信号も復調も線形なので、1ピクセルが周りの出力に足す値を(ラインの位相, 3ピクセル内の位置, 色)ごとに表にしておく
+ */
+#define NTSC_WIDTH 602
+// 1ピクセルが影響する出力の数
+#define NTSC_KERNEL_WIDTH 8
+// 表の値は出力の16倍
+#define NTSC_KERNEL_SHIFT 4
+
+// パレット番号 | 強調 << 6 (setNtscFilterが有効なときだけ書く)
+static uint16_t indexScreen[240][256];
+static uint32_t ntscScreen[240 * NTSC_WIDTH];
+// [ラインの位相][3ピクセル内の位置][色][出力 * 4 + RGBA]
+static int16_t ntscKernel[3][3][512][NTSC_KERNEL_WIDTH * 4];
+// 3ピクセル内の位置ごとの、最初の出力の位置(7出力のグループの先頭から)
+static int ntscKernelStart[3];
+static bool ntscKernelReady = false;
+static bool ntscEnabled = false;
+// フレーム先頭の位相(サンプル単位、0,4,8)
+static int ntscFramePhase = 0;
+
+static void initNtscKernel()
+{
+    // 輝度ごとの低いレベルと高いレベル(1.0 = 黒, 白を1にする)
+    static const float levels[8] = {0.350f, 0.518f, 0.962f, 1.550f, 1.094f, 1.506f, 1.962f, 1.962f};
+    const float black = 0.518f;
+    const float white = 1.962f;
+    const float pi = 3.14159265f;
+    // 色相の合わせ込み(サンプル単位)
+    const float hue = 4.0f;
+    for (int a = 0; a < 3; a++)
+    {
+        // このピクセルのサンプルに窓(12サンプル)が重なる最初の出力
+        int first = 0;
+        while ((first + 0.5f) * 24 / 7 - 0.5f + 6 >= 8 * a)
+        {
+            first--;
+        }
+        ntscKernelStart[a] = first + 1;
+    }
+    for (int lp = 0; lp < 3; lp++)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            for (int c = 0; c < 512; c++)
+            {
+                int color = c & 0x0f;
+                int level = (c >> 4) & 3;
+                int emphasis = c >> 6;
+                if (color > 13)
+                {
+                    level = 1;
+                }
+                float low = levels[level];
+                float high = levels[4 + level];
+                if (color == 0)
+                {
+                    low = high;
+                }
+                else if (color > 12)
+                {
+                    high = low;
+                }
+                float signal[8];
+                for (int s = 0; s < 8; s++)
+                {
+                    int phase = (8 * a + s + lp * 4) % 12;
+                    auto inPhase = [phase](int col)
+                    {
+                        return (col + phase) % 12 < 6;
+                    };
+                    float v = inPhase(color) ? high : low;
+                    if (color < 14 && (((emphasis & 1) && inPhase(0)) || ((emphasis & 2) && inPhase(4)) || ((emphasis & 4) && inPhase(8))))
+                    {
+                        v *= 0.746f;
+                    }
+                    signal[s] = (v - black) / (white - black);
+                }
+                int16_t *kernel = ntscKernel[lp][a][c];
+                for (int o = 0; o < NTSC_KERNEL_WIDTH; o++)
+                {
+                    float center = (ntscKernelStart[a] + o + 0.5f) * 24 / 7 - 0.5f;
+                    float y = 0, i = 0, q = 0;
+                    for (int s = 0; s < 8; s++)
+                    {
+                        float d = 8 * a + s - center;
+                        if (d > -6 && d <= 6)
+                        {
+                            float angle = pi * ((8 * a + s + lp * 4) % 12 + hue) / 6;
+                            y += signal[s] / 12;
+                            i += signal[s] * std::cos(angle) / 6;
+                            q += signal[s] * std::sin(angle) / 6;
+                        }
+                    }
+                    float rgb[3] = {y + 0.946882f * i + 0.623557f * q, y - 0.274788f * i - 0.635691f * q, y - 1.108545f * i + 1.709007f * q};
+                    for (int ch = 0; ch < 3; ch++)
+                    {
+                        kernel[o * 4 + ch] = (int16_t)std::lround(rgb[ch] * (255 << NTSC_KERNEL_SHIFT));
+                    }
+                    kernel[o * 4 + 3] = 0;
+                }
+            }
+        }
+    }
+    ntscKernelReady = true;
+}
+
+// lineBufを強調つきのパレット番号にする
+static void storeIndexLine(int y)
+{
+    uint16_t mask = (state.ctrl2001 & GRAY_SCALE) ? 0x30 : 0x3f;
+    uint16_t emphasis = (state.ctrl2001 & 0xe0) << 1;
+    for (int x = 0; x < 256; x++)
+    {
+        indexScreen[y][x] = (lineBuf[x] & mask) | emphasis;
+    }
+}
+
+static void filterNtscLine(int y, int lp)
+{
+    // 左右に1グループ分の余白
+    static int16_t acc[(NTSC_WIDTH + 16) * 4];
+    std::memset(acc, 0, sizeof(acc));
+    for (int g = 0; g < NTSC_WIDTH / 7; g++)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            int x = g * 3 + a;
+            // 右端の2ピクセルは黒
+            int c = x < 256 ? indexScreen[y][x] : 0x0f;
+            const int16_t *kernel = ntscKernel[lp][a][c];
+            int16_t *dst = acc + (8 + g * 7 + ntscKernelStart[a]) * 4;
+#ifdef SIMD_ENABLED
+            for (int i = 0; i < NTSC_KERNEL_WIDTH * 4; i += 8)
+            {
+                simd_store(dst + i, simd_add_u16(simd_load(dst + i), simd_load(kernel + i)));
+            }
+#else
+            for (int i = 0; i < NTSC_KERNEL_WIDTH * 4; i++)
+            {
+                dst[i] += kernel[i];
+            }
+#endif
+        }
+    }
+    const int16_t *src = acc + 8 * 4;
+    uint32_t *out = ntscScreen + y * NTSC_WIDTH;
+    int x = 0;
+#ifdef SIMD_ENABLED
+    static const uint32_t alphaMask[4] = {0xff000000, 0xff000000, 0xff000000, 0xff000000};
+    simd128 alpha = simd_load(alphaMask);
+    for (; x + 4 <= NTSC_WIDTH; x += 4)
+    {
+        simd128 low = simd_shr_i16(simd_load(src + x * 4), NTSC_KERNEL_SHIFT);
+        simd128 high = simd_shr_i16(simd_load(src + x * 4 + 8), NTSC_KERNEL_SHIFT);
+        simd_store(out + x, simd_or(simd_narrow_u16(low, high), alpha));
+    }
+#endif
+    for (; x < NTSC_WIDTH; x++)
+    {
+        uint32_t pixel = 0xff000000;
+        for (int ch = 0; ch < 3; ch++)
+        {
+            int v = src[x * 4 + ch] >> NTSC_KERNEL_SHIFT;
+            pixel |= (uint32_t)std::min(255, std::max(0, v)) << (ch * 8);
+        }
+        out[x] = pixel;
+    }
+}
+
+// 画面キャプチャ(startCapture、形式はcapture.h)
+static bool captureEnabled = false;
+static int captureKeyInterval = 0;
+// 最後のキーフレームからのフレーム数(-1は次をキーフレームにする)
+static int captureSinceKey = -1;
+static int captureFrames = 0;
+// 今のフレームと、前に記録したフレームのプレーン
+static uint8_t capturePlane[CAPTURE_PLANE_SIZE];
+static uint8_t capturePrev[CAPTURE_PLANE_SIZE];
+static uint8_t captureXor[CAPTURE_PLANE_SIZE];
+static uint8_t captureOut[CAPTURE_ENCODE_MAX];
+// 記録先(ヘッダ + フレーム)
+static std::vector<uint8_t> captureArena;
+
+// lineBufをパレット番号のままプレーンに書く
+static void storeCaptureLine(int y)
+{
+    capturePlane[y] = state.ctrl2001 & (GRAY_SCALE | 0xe0);
+    uint8_t *dst = capturePlane + CAPTURE_LINES + y * 256;
+#ifdef SIMD_ENABLED
+    simd128 mask = simd_splat_u16(0x3f);
+    for (int x = 0; x < 256; x += 16)
+    {
+        simd_store(dst + x, simd_narrow_u16(simd_and(simd_load(lineBuf + x), mask), simd_and(simd_load(lineBuf + x + 8), mask)));
+    }
+#else
+    for (int x = 0; x < 256; x++)
+    {
+        dst[x] = lineBuf[x] & 0x3f;
+    }
+#endif
+}
+
+/**
+ * 1フレームを記録する
+ * @param repeat 前のフレームと同じ(フレームスキップ)
+ */
+static void captureFrame(bool repeat)
+{
+    CaptureRecord record = {CAPTURE_DELTA, 0};
+    if (!repeat)
+    {
+        if (captureSinceKey < 0 || (captureKeyInterval > 0 && captureSinceKey >= captureKeyInterval))
+        {
+            record.type = CAPTURE_KEY;
+            record.size = captureEncode(capturePlane, CAPTURE_PLANE_SIZE, captureOut);
+            captureSinceKey = 0;
+        }
+        else
+        {
+            uint64_t diff = 0;
+            for (int i = 0; i < CAPTURE_PLANE_SIZE; i += 8)
+            {
+                uint64_t a, b;
+                std::memcpy(&a, capturePlane + i, 8);
+                std::memcpy(&b, capturePrev + i, 8);
+                a ^= b;
+                std::memcpy(captureXor + i, &a, 8);
+                diff |= a;
+            }
+            if (diff)
+            {
+                record.size = captureEncode(captureXor, CAPTURE_PLANE_SIZE, captureOut);
+            }
+        }
+        std::memcpy(capturePrev, capturePlane, CAPTURE_PLANE_SIZE);
+    }
+    const uint8_t *head = reinterpret_cast<const uint8_t *>(&record);
+    captureArena.insert(captureArena.end(), head, head + sizeof(record));
+    captureArena.insert(captureArena.end(), captureOut, captureOut + record.size);
+    captureSinceKey++;
+    captureFrames++;
+}
+
+/**
+ * ドット絵向けの拡大(Scale2x, Scale3x, Scale4x, xBR-lite)
+ * 出力の行は入力の上下1行(Scale4xは2行)で決まるので、その範囲のlineHashが変わった行だけ作り直す
+ */
+#define SCALE_2X 1
+#define SCALE_3X 2
+#define SCALE_4X 3
+#define SCALE_XBR 4
+
+// 拡大を最初に使うときに確保する(4倍で約3.9MB)
+static std::vector<uint32_t> scaleScreen;
+// Scale4xの途中(Scale2xを2回かける、Scale4xを最初に使うときに確保する)
+static std::vector<uint32_t> scaleTemp;
+// 行ごとの、作ったときの入力のハッシュ
+static uint64_t scaleRowKey[240];
+static uint64_t scaleTempKey[240];
+static int scaleMode = 0;
+// 直前のrenderScaledで作り直した入力の行(1ライン1bit)
+static uint32_t scaleDirtyLines[(240 + 31) / 32];
+// 上下左右に1ピクセルずつ端の色を足した3行
+static uint32_t scaleRows[3][512 + 2];
+
+static void loadScaleRows(const uint32_t *src, int width, int height, int y)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        const uint32_t *row = src + std::min(height - 1, std::max(0, y - 1 + i)) * width;
+        scaleRows[i][0] = row[0];
+        std::memcpy(scaleRows[i] + 1, row, width * 4);
+        scaleRows[i][width + 1] = row[width - 1];
+    }
+}
+
+// 1行をScale2xで2行にする
+static void scale2xLine(const uint32_t *src, int width, int height, int y, uint32_t *dst)
+{
+    loadScaleRows(src, width, height, y);
+    uint32_t *out0 = dst;
+    uint32_t *out1 = dst + width * 2;
+    int x = 0;
+#ifdef SIMD_ENABLED
+    for (; x + 4 <= width; x += 4)
+    {
+        simd128 b = simd_load(scaleRows[0] + x + 1);
+        simd128 d = simd_load(scaleRows[1] + x);
+        simd128 e = simd_load(scaleRows[1] + x + 1);
+        simd128 f = simd_load(scaleRows[1] + x + 2);
+        simd128 h = simd_load(scaleRows[2] + x + 1);
+        simd128 db = simd_eq_u32(d, b);
+        simd128 bf = simd_eq_u32(b, f);
+        simd128 dh = simd_eq_u32(d, h);
+        simd128 hf = simd_eq_u32(h, f);
+        simd128 e0 = simd_select(simd_andnot(simd_andnot(db, bf), dh), d, e);
+        simd128 e1 = simd_select(simd_andnot(simd_andnot(bf, db), hf), f, e);
+        simd128 e2 = simd_select(simd_andnot(simd_andnot(dh, db), hf), d, e);
+        simd128 e3 = simd_select(simd_andnot(simd_andnot(hf, dh), bf), f, e);
+        simd_store(out0 + x * 2, simd_zip_low_u32(e0, e1));
+        simd_store(out0 + x * 2 + 4, simd_zip_high_u32(e0, e1));
+        simd_store(out1 + x * 2, simd_zip_low_u32(e2, e3));
+        simd_store(out1 + x * 2 + 4, simd_zip_high_u32(e2, e3));
+    }
+#endif
+    // 残りの幅だけ回す(SIMDの後の端数)
+    for (int rest = width - x; rest > 0; rest--, x++)
+    {
+        uint32_t b = scaleRows[0][x + 1];
+        uint32_t d = scaleRows[1][x];
+        uint32_t e = scaleRows[1][x + 1];
+        uint32_t f = scaleRows[1][x + 2];
+        uint32_t h = scaleRows[2][x + 1];
+        out0[x * 2] = (d == b && b != f && d != h) ? d : e;
+        out0[x * 2 + 1] = (b == f && b != d && f != h) ? f : e;
+        out1[x * 2] = (d == h && d != b && h != f) ? d : e;
+        out1[x * 2 + 1] = (h == f && d != h && b != f) ? f : e;
+    }
+}
+
+// Scale3xの1ピクセル(a-iは3x3の近傍、outは3x3の出力)
+static inline void scale3xPixel(const uint32_t *n, uint32_t *out)
+{
+    uint32_t a = n[0], b = n[1], c = n[2], d = n[3], e = n[4], f = n[5], g = n[6], h = n[7], i = n[8];
+    bool db = d == b && b != f && d != h;
+    bool bf = b == f && b != d && f != h;
+    bool dh = d == h && d != b && h != f;
+    bool hf = h == f && d != h && b != f;
+    out[0] = db ? d : e;
+    out[1] = ((db && e != c) || (bf && e != a)) ? b : e;
+    out[2] = bf ? f : e;
+    out[3] = ((db && e != g) || (dh && e != a)) ? d : e;
+    out[4] = e;
+    out[5] = ((bf && e != i) || (hf && e != c)) ? f : e;
+    out[6] = dh ? d : e;
+    out[7] = ((dh && e != i) || (hf && e != g)) ? h : e;
+    out[8] = hf ? f : e;
+}
+
+// 1行をScale3xで3行にする
+static void scale3xLine(const uint32_t *src, int y, uint32_t *dst)
+{
+    loadScaleRows(src, 256, 240, y);
+    int x = 0;
+#ifdef SIMD_ENABLED
+    for (; x + 4 <= 256; x += 4)
+    {
+        simd128 a = simd_load(scaleRows[0] + x);
+        simd128 b = simd_load(scaleRows[0] + x + 1);
+        simd128 c = simd_load(scaleRows[0] + x + 2);
+        simd128 d = simd_load(scaleRows[1] + x);
+        simd128 e = simd_load(scaleRows[1] + x + 1);
+        simd128 f = simd_load(scaleRows[1] + x + 2);
+        simd128 g = simd_load(scaleRows[2] + x);
+        simd128 h = simd_load(scaleRows[2] + x + 1);
+        simd128 i = simd_load(scaleRows[2] + x + 2);
+        simd128 eqDB = simd_eq_u32(d, b);
+        simd128 eqBF = simd_eq_u32(b, f);
+        simd128 eqDH = simd_eq_u32(d, h);
+        simd128 eqHF = simd_eq_u32(h, f);
+        simd128 db = simd_andnot(simd_andnot(eqDB, eqBF), eqDH);
+        simd128 bf = simd_andnot(simd_andnot(eqBF, eqDB), eqHF);
+        simd128 dh = simd_andnot(simd_andnot(eqDH, eqDB), eqHF);
+        simd128 hf = simd_andnot(simd_andnot(eqHF, eqDH), eqBF);
+        simd128 eqEA = simd_eq_u32(e, a);
+        simd128 eqEC = simd_eq_u32(e, c);
+        simd128 eqEG = simd_eq_u32(e, g);
+        simd128 eqEI = simd_eq_u32(e, i);
+        uint32_t out[9][4];
+        simd_store(out[0], simd_select(db, d, e));
+        simd_store(out[1], simd_select(simd_or(simd_andnot(db, eqEC), simd_andnot(bf, eqEA)), b, e));
+        simd_store(out[2], simd_select(bf, f, e));
+        simd_store(out[3], simd_select(simd_or(simd_andnot(db, eqEG), simd_andnot(dh, eqEA)), d, e));
+        simd_store(out[4], e);
+        simd_store(out[5], simd_select(simd_or(simd_andnot(bf, eqEI), simd_andnot(hf, eqEC)), f, e));
+        simd_store(out[6], simd_select(dh, d, e));
+        simd_store(out[7], simd_select(simd_or(simd_andnot(dh, eqEI), simd_andnot(hf, eqEG)), h, e));
+        simd_store(out[8], simd_select(hf, f, e));
+        for (int k = 0; k < 4; k++)
+        {
+            for (int row = 0; row < 3; row++)
+            {
+                uint32_t *p = dst + row * 768 + (x + k) * 3;
+                p[0] = out[row * 3][k];
+                p[1] = out[row * 3 + 1][k];
+                p[2] = out[row * 3 + 2][k];
+            }
+        }
+    }
+#endif
+    // 残りの幅だけ回す(SIMDの後の端数)
+    for (int rest = 256 - x; rest > 0; rest--, x++)
+    {
+        uint32_t n[9], out[9];
+        for (int k = 0; k < 9; k++)
+        {
+            n[k] = scaleRows[k / 3][x + k % 3];
+        }
+        scale3xPixel(n, out);
+        for (int row = 0; row < 3; row++)
+        {
+            std::memcpy(dst + row * 768 + x * 3, out + row * 3, 12);
+        }
+    }
+}
+
+// RGBの差の合計
+static inline int colorDistance(uint32_t a, uint32_t b)
+{
+    int sum = 0;
+    for (int ch = 0; ch < 24; ch += 8)
+    {
+        sum += std::abs((int)((a >> ch) & 255) - (int)((b >> ch) & 255));
+    }
+    return sum;
+}
+
+#ifdef SIMD_ENABLED
+static inline simd128 simd_color_distance(simd128 a, simd128 b)
+{
+    simd128 diff = simd_or(simd_subs_u8(a, b), simd_subs_u8(b, a));
+    simd128 mask = simd_splat_u32(0xff);
+    return simd_add_u32(simd_add_u32(simd_and(diff, mask), simd_and(simd_shr_u32(diff, 8), mask)), simd_and(simd_shr_u32(diff, 16), mask));
+}
+#endif
+
+/**
+ * xBR-liteの1つの角(3x3の近傍だけで見る簡易版)
+ * 角の向こうの2ピクセル(x, y)が似ていて、中心と角の対角より境界らしければ、中心と近い方を半分混ぜる
+ * @param e 中心
+ * @param p 角の対角
+ * @param x, y 角に接する上下左右
+ * @param px, py x, yの反対側
+ * @param qx, qy 角以外の対角(xの隣, yの隣)
+ */
+static inline uint32_t xbrCorner(uint32_t e, uint32_t p, uint32_t x, uint32_t y, uint32_t px, uint32_t py, uint32_t qx, uint32_t qy)
+{
+    int edgeEP = 4 * colorDistance(e, p) + colorDistance(x, py) + colorDistance(y, px);
+    int edgeXY = 4 * colorDistance(x, y) + colorDistance(e, qx) + colorDistance(e, qy);
+    if (edgeXY >= edgeEP)
+    {
+        return e;
+    }
+    uint32_t near = colorDistance(e, x) <= colorDistance(e, y) ? x : y;
+    // 1バイトずつ(a + b + 1) / 2
+    return (e | near) - (((e ^ near) >> 1) & 0x7f7f7f7f);
+}
+
+// 1行をxBR-liteで2行にする
+static void xbrLine(const uint32_t *src, int y, uint32_t *dst)
+{
+    loadScaleRows(src, 256, 240, y);
+    uint32_t *out0 = dst;
+    uint32_t *out1 = dst + 512;
+    int x = 0;
+#ifdef SIMD_ENABLED
+    for (; x + 4 <= 256; x += 4)
+    {
+        simd128 a = simd_load(scaleRows[0] + x);
+        simd128 b = simd_load(scaleRows[0] + x + 1);
+        simd128 c = simd_load(scaleRows[0] + x + 2);
+        simd128 d = simd_load(scaleRows[1] + x);
+        simd128 e = simd_load(scaleRows[1] + x + 1);
+        simd128 f = simd_load(scaleRows[1] + x + 2);
+        simd128 g = simd_load(scaleRows[2] + x);
+        simd128 h = simd_load(scaleRows[2] + x + 1);
+        simd128 i = simd_load(scaleRows[2] + x + 2);
+        simd128 dEA = simd_color_distance(e, a);
+        simd128 dEC = simd_color_distance(e, c);
+        simd128 dEG = simd_color_distance(e, g);
+        simd128 dEI = simd_color_distance(e, i);
+        simd128 dEB = simd_color_distance(e, b);
+        simd128 dED = simd_color_distance(e, d);
+        simd128 dEF = simd_color_distance(e, f);
+        simd128 dEH = simd_color_distance(e, h);
+        simd128 dBD = simd_color_distance(b, d);
+        simd128 dBF = simd_color_distance(b, f);
+        simd128 dDH = simd_color_distance(d, h);
+        simd128 dFH = simd_color_distance(f, h);
+        auto times4 = [](simd128 v)
+        {
+            v = simd_add_u32(v, v);
+            return simd_add_u32(v, v);
+        };
+        // edgeEP = 4 * |e - p| + |x - py| + |y - px|, edgeXY = 4 * |x - y| + |e - qx| + |e - qy|
+        auto corner = [&](simd128 dEP, simd128 dXY, simd128 dXPy, simd128 dYPx, simd128 dEQx, simd128 dEQy, simd128 vx, simd128 vy, simd128 dEX, simd128 dEY)
+        {
+            simd128 edgeEP = simd_add_u32(times4(dEP), simd_add_u32(dXPy, dYPx));
+            simd128 edgeXY = simd_add_u32(times4(dXY), simd_add_u32(dEQx, dEQy));
+            // dEY < dEX ならy
+            simd128 near = simd_select(simd_lt_i32(dEY, dEX), vy, vx);
+            return simd_select(simd_lt_i32(edgeXY, edgeEP), simd_avg_u8(e, near), e);
+        };
+        // 左上(x=d, y=b), 右上(x=b, y=f), 左下(x=d, y=h), 右下(x=f, y=h)
+        simd128 e0 = corner(dEA, dBD, dDH, dBF, dEG, dEC, d, b, dED, dEB);
+        simd128 e1 = corner(dEC, dBF, dBD, dFH, dEA, dEI, b, f, dEB, dEF);
+        simd128 e2 = corner(dEG, dDH, dBD, dFH, dEA, dEI, d, h, dED, dEH);
+        simd128 e3 = corner(dEI, dFH, dBF, dDH, dEC, dEG, f, h, dEF, dEH);
+        simd_store(out0 + x * 2, simd_zip_low_u32(e0, e1));
+        simd_store(out0 + x * 2 + 4, simd_zip_high_u32(e0, e1));
+        simd_store(out1 + x * 2, simd_zip_low_u32(e2, e3));
+        simd_store(out1 + x * 2 + 4, simd_zip_high_u32(e2, e3));
+    }
+#endif
+    // 残りの幅だけ回す(SIMDの後の端数)
+    for (int rest = 256 - x; rest > 0; rest--, x++)
+    {
+        uint32_t a = scaleRows[0][x], b = scaleRows[0][x + 1], c = scaleRows[0][x + 2];
+        uint32_t d = scaleRows[1][x], e = scaleRows[1][x + 1], f = scaleRows[1][x + 2];
+        uint32_t g = scaleRows[2][x], h = scaleRows[2][x + 1], i = scaleRows[2][x + 2];
+        out0[x * 2] = xbrCorner(e, a, d, b, f, h, g, c);
+        out0[x * 2 + 1] = xbrCorner(e, c, b, f, h, d, a, i);
+        out1[x * 2] = xbrCorner(e, g, d, h, f, b, a, i);
+        out1[x * 2 + 1] = xbrCorner(e, i, f, h, d, b, c, g);
+    }
+}
+
+// 入力のy - radius ... y + radius行のハッシュ
+static uint64_t scaleKey(int y, int radius)
+{
+    uint64_t key = scaleMode;
+    for (int i = y - radius; i <= y + radius; i++)
+    {
+        key = (key ^ lineHash[std::min(239, std::max(0, i))]) * 0x100000001b3ULL;
+    }
+    return key | 1;
+}
+
+static void fetchSprite(int y)
+{
+    if (!skipRender)
+    {
+        for (int x = 0; x < 256; x++)
+        {
+            lineBuf[x] = palette[0];
+        }
     }
+    std::memset(spriteMask, 0, sizeof(spriteMask));
+    spriteA12 = 0xff;
+    spriteInput.spritePageHash = pageHash;
+    spriteInput.spriteCtrl2000 = state.ctrl2000;
+    spriteInput.spriteCtrl2001 = state.ctrl2001;
     if (!(state.ctrl2001 & SPRITE_ENABLE))
     {
         return;
@@ -362,6 +1808,10 @@ static void fetchSprite(int y)
         int sx = sprite.mem[i * 4 + 3];
         int tile = sprite.mem[i * 4 + 1];
         int attr = sprite.mem[i * 4 + 2];
+        if (!(tile & 1))
+        {
+            spriteA12 &= ~(1 << (count - 1));
+        }
         if (attr & 0x80)
         {
             // Y座標反転
@@ -386,8 +1836,29 @@ static void fetchSprite(int y)
             addr = reg.spAddr;
         }
         addr |= (tile << 4) | dy;
-        uint8_t pattern0 = pattern[addr];
-        uint8_t pattern1 = pattern[addr | 8];
+        const uint8_t *chr = vramPage[addr >> 10] + (addr & 0x3ff);
+        uint8_t pattern0 = chr[0];
+        uint8_t pattern1 = chr[8];
+        CDL_LOG(addr, CDL_CHR_RENDER);
+        CDL_LOG(addr | 8, CDL_CHR_RENDER);
+        if (skipRender)
+        {
+            if (i == 0)
+            {
+                // スキップ中はSprite0の不透明ピクセルだけspriteMaskに入れる
+                uint8_t opaque = pattern0 | pattern1;
+                for (int dx = 0; dx < 8; dx++)
+                {
+                    int px = (sx + dx) & 255;
+                    int bit = (attr & 0x40) ? (0x01 << dx) : (0x80 >> dx);
+                    if ((opaque & bit) && (px >= 8 || (state.ctrl2001 & SPRITE_CLIP)))
+                    {
+                        spriteMask[px >> 3] |= 0x80 >> (px & 7);
+                    }
+                }
+            }
+            continue;
+        }
         for (int dx = 0; dx < 8; dx++)
         {
             int px = (sx + dx) & 255;
@@ -409,6 +1880,7 @@ static void fetchSprite(int y)
             if (pix > 0)
             {
                 lineBuf[px] = palette[((attr & 3) << 2) | pix | 0x10] | ((attr & 0x20) ? 0x100 : 0x300);
+                spriteMask[px >> 3] |= 0x80 >> (px & 7);
                 if (i == 0)
                 {
                     // Sprite0
@@ -419,166 +1891,1125 @@ static void fetchSprite(int y)
     }
 }
 
-extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *renderScreen()
+/**
+ * 表示ラインのBGを指定ピクセルの手前まで描画する(タイル境界でフェッチする)
+ * @param px 0-256
+ */
+static void renderUntil(int px)
+{
+    if (fastForward)
+    {
+        while (renderPx < px)
+        {
+            int end = std::min(px, ((renderPx >> 3) + 1) << 3);
+            renderPx = end;
+            if (!(end & 7) && end < 256)
+            {
+                skipTile();
+            }
+        }
+        return;
+    }
+    while (renderPx < px)
+    {
+        int tile = renderPx >> 3;
+        int end = std::min(px, (tile + 1) << 3);
+        if ((state.ctrl2001 & BG_ENABLE) && (tile > 0 || (state.ctrl2001 & BG_CLIP)))
+        {
+            uint8_t pixels = (0xff >> (renderPx & 7)) & (0xff << (8 - (end - (tile << 3))));
+            if (skipRender)
+            {
+                // 描画せずSprite0とBGの不透明ピクセルが重なるかだけを見る
+                if (((((reg.bgPattern[0] | reg.bgPattern[1]) << reg.x) >> 8) & spriteMask[tile] & pixels))
+                {
+                    state.state |= 0x40;
+                }
+            }
+            else if (renderBgSpan(lineBuf + (tile << 3), reg.bgPattern[0], reg.bgPattern[1], reg.attr, reg.x, spriteMask[tile], pixels))
+            {
+                state.state |= 0x40;
+            }
+        }
+        renderPx = end;
+        if (!(end & 7) && tile < 31)
+        {
+            fetchTile();
+        }
+    }
+}
+
+// ページの差し替えと書き換えられたパターンをキャッシュに反映する
+static void validateBgCache()
+{
+    int chrPage = reg.bgAddr >> 10;
+    for (int n = 0; n < 4; n++)
+    {
+        BgCacheKey key = {vramPage[8 + n], {vramPage[chrPage], vramPage[chrPage + 1], vramPage[chrPage + 2], vramPage[chrPage + 3]}, bgCacheGeneration};
+        // 64bit環境では末尾にパディングがあるので、フィールドごとに比べる
+        if (key.page != bgCacheKey[n].page || std::memcmp(key.chr, bgCacheKey[n].chr, sizeof(key.chr)) ||
+            key.generation != bgCacheKey[n].generation)
+        {
+            bgCacheKey[n] = key;
+            std::memset(bgCellValid[n], 0, sizeof(bgCellValid[n]));
+            continue;
+        }
+        if (!bgPatternDirtyAny)
+        {
+            continue;
+        }
+        for (int cell = 0; cell < 960; cell++)
+        {
+            bool &valid = bgCellValid[n][cell >> 5][cell & 31];
+            if (valid)
+            {
+                int tile = key.page[cell];
+                const uint8_t *chr = key.chr[tile >> 6] + ((tile & 63) << 4);
+                if (chr >= pattern && chr < pattern + sizeof(pattern))
+                {
+                    int index = (chr - pattern) >> 4;
+                    valid = !(bgPatternDirty[index >> 5] & (1u << (index & 31)));
+                }
+            }
+        }
+    }
+    std::memset(bgPatternDirty, 0, sizeof(bgPatternDirty));
+    bgPatternDirtyAny = false;
+}
+
+// 1セル(8x8)をキャッシュに描く
+static void fillBgCell(int n, int cy, int cx)
+{
+    const uint8_t *page = bgCacheKey[n].page;
+    int tile = page[(cy << 5) | cx];
+    int at = page[0x3c0 | ((cy >> 2) << 3) | (cx >> 2)];
+    at = (at >> (((cy & 2) << 1) | (cx & 2))) & 3;
+    uint64_t attr = (uint64_t)(at << 2) * 0x0101010101010101ULL;
+    const uint8_t *chr = bgCacheKey[n].chr[tile >> 6] + ((tile & 63) << 4);
+    uint8_t *dst = &bgCache[(n >> 1) * 240 + (cy << 3)][((n & 1) << 8) | (cx << 3)];
+    for (int row = 0; row < 8; row++, dst += 512)
+    {
+        uint64_t pix = decodeTileRow(chr, row) | attr;
+        std::memcpy(dst, &pix, 8);
+    }
+    bgCellValid[n][cy][cx] = true;
+}
+
+/**
+ * キャッシュのパレット番号をlineBufに重ねる(renderBgSpanと同じ合成)
+ * @return Sprite0ヒットならtrue
+ */
+static bool composeBgCache(uint16_t *dst, const uint8_t *index, int count)
+{
+    bool hit = false;
+    int x = 0;
+#ifdef SIMD_ENABLED
+    simd128 pal = simd_load(palette);
+    simd128 zero = simd_splat_u16(0);
+    simd128 hitMask = zero;
+    for (; x + 16 <= count; x += 16)
+    {
+        simd128 idx = simd_load(index + x);
+        simd128 color = simd_lookup16(pal, idx);
+        simd128 opaque = simd_and(idx, simd_splat_u8(3));
+        for (int half = 0; half < 2; half++)
+        {
+            simd128 col = simd_or(half ? simd_zip_high_u8(color, zero) : simd_zip_low_u8(color, zero), simd_splat_u16(0x100));
+            simd128 transparent = simd_eq_u16(half ? simd_zip_high_u8(opaque, zero) : simd_zip_low_u8(opaque, zero), zero);
+            simd128 cur = simd_load(dst + x + half * 8);
+            simd128 write = simd_andnot(simd_eq_u16(simd_and(cur, simd_splat_u16(0x200)), zero), transparent);
+            simd_store(dst + x + half * 8, simd_select(write, col, cur));
+            hitMask = simd_or(hitMask, simd_andnot(simd_and(cur, simd_splat_u16(0x400)), transparent));
+        }
+    }
+    hit = simd_any(hitMask);
+#endif
+    for (; x < count; x++)
+    {
+        if (index[x] & 3)
+        {
+            if (dst[x] & 0x400)
+            {
+                hit = true;
+            }
+            if (!(dst[x] & 0x200))
+            {
+                dst[x] = palette[index[x] & 0x0f] | 0x100;
+            }
+        }
+    }
+    return hit;
+}
+
+/**
+ * 行の途中で分割しないラインの背景をキャッシュから描く
+ * 先頭の2タイル(前のラインの最後に読んだ分)は通常どおり描き、残りをキャッシュから重ねる
+ * @return 描いたらtrue(falseなら通常の描画)
+ */
+static bool renderBgLineCached()
+{
+    if (!bgCacheEnabled || skipRender || renderPx != 0 || !(state.ctrl2001 & BG_ENABLE) || ((reg.v >> 5) & 31) >= 30)
+    {
+        return false;
+    }
+    int fineX = reg.x;
+    int fineY = reg.v >> 12;
+    int cy = (reg.v >> 5) & 31;
+    int ntY = (reg.v >> 11) & 1;
+    // 3タイル目の左端(512ドット幅の中の位置)
+    int wx0 = (((reg.v >> 10) & 1) << 8) | ((reg.v & 31) << 3);
+    int start = 16 - fineX;
+    int count = 256 - start;
+    renderUntil(start);
+    validateBgCache();
+    for (int col = wx0 >> 3, last = (wx0 + count - 1) >> 3; col <= last; col++)
+    {
+        int n = (ntY << 1) | ((col >> 5) & 1);
+        int cx = col & 31;
+        if (!bgCellValid[n][cy][cx])
+        {
+            fillBgCell(n, cy, cx);
+        }
+    }
+    const uint8_t *row = bgCache[ntY * 240 + (cy << 3) + fineY];
+    uint8_t index[256];
+    int first = std::min(count, 512 - wx0);
+    std::memcpy(index, row + wx0, first);
+    std::memcpy(index + first, row, count - first);
+    if (composeBgCache(lineBuf + start, index, count))
+    {
+        state.state |= 0x40;
+    }
+    // 残りのタイルの読み込み(vの更新)は通常どおり
+    while (renderPx < 256)
+    {
+        int end = std::min(256, ((renderPx >> 3) + 1) << 3);
+        renderPx = end;
+        if (end < 256)
+        {
+            fetchTile();
+        }
+    }
+    return true;
+}
+
+// renderScreenの後始末
+static void finishFrame()
+{
+    skipRender = frameSkip;
+    if (!frameSkip)
+    {
+        lineInputValid = true;
+    }
+    frameLog.active = false;
+    if (tripleBuffer && !frameSkip)
+    {
+        publishFrame();
+    }
+    if (captureEnabled)
+    {
+        captureFrame(frameSkip);
+    }
+}
+
+/**
+ * 1フレーム分を実行する
+ * @param skip 0以外なら画素の合成を省略する(タイミング、Sprite0、オーバーフローは同じ)
+ * @return 画面(スキップ時は前のフレームのまま)
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *renderScreen(int skip)
+{
+    frameLog.notifyCount = 0;
+    if (frameLog.enabled)
+    {
+        // 書き込み先を入れ替える(前のフレームの記録はgetFrameLogで読める)
+        frameLog.index ^= 1;
+        frameLog.size[frameLog.index] = 0;
+        frameLog.overflow[frameLog.index] = false;
+        frameLog.active = true;
+        logRenderSnapshot();
+    }
+    frameSkip = skip != 0;
+    skipRender = frameSkip;
+    // 0ラインにはスプライトが出ない(前のフレームの残りを使わない)
+    for (int x = 0; x < 256; x++)
+    {
+        lineBuf[x] = palette[0];
+    }
+    std::memset(spriteMask, 0, sizeof(spriteMask));
+    std::memset(&spriteInput, 0, sizeof(spriteInput));
+    screenChanged = false;
+    writeLogCount = 0;
+    if (!frameSkip)
+    {
+        std::memset(dirtyLines, 0, sizeof(dirtyLines));
+        if (tripleBuffer)
+        {
+            // backに直接描く
+            std::memset(convertedLines, 0, sizeof(convertedLines));
+            publishedScreen = screen;
+            screen = frameBuffers[backBuffer];
+        }
+    }
+    // EM_ASM({ console.log("RenderStart", $0.toString(16), $1.toString(16)); }, reg.t, reg.v);
+    reg.odd = !reg.odd;
+    // 1フレーム(262ライン)で色副搬送波の位相は4サンプル進む
+    ntscFramePhase = (ntscFramePhase + 4) % 12;
+    if (reg.odd && (state.ctrl2001 & BG_ENABLE))
+    {
+        // サイクルスキップ
+        cycle.notifyPpuCycle++;
+        // 1ドット(8サンプル)短い
+        ntscFramePhase = (ntscFramePhase + 4) % 12;
+    }
+    // pre render line(261)から始める
+    if (hBlankMask[261 >> 5] & (1u << (261 & 31)))
+    {
+        cycle.ppuCycle = 256;
+        notifyCpuCycle();
+        notifyHblank(261);
+    }
+    int a12Dot = getA12Dot();
+    if (a12Dot >= 0 && a12Dot < 320)
+    {
+        cycle.ppuCycle = a12Dot;
+        notifyCpuCycle();
+        clockScanlineIrq();
+    }
+    cycle.ppuCycle = 279;
+    // clear vblank,sprite0,overflow
+    state.state = 0;
+    notifyCpuCycle();
+    // vert(v)=vert(t)
+    if (state.ctrl2001 & DISPLAY_ENABLE)
+    {
+        reg.v = (reg.t & ~0xc00) | ((state.ctrl2000 & 3) << 10);
+        // EM_ASM({ console.log("$2000=" + $0.toString(16) + " $2001=" + $1.toString(16) + " t=" + $2.toString(16) + " v=" + $3.toString(16) + " sp0.y=" + $4); }, state.ctrl2000, state.ctrl2001, reg.t, reg.v, sprite.mem[0]);
+    }
+    cycle.ppuCycle = 320;
+    notifyCpuCycle();
+    fetchTile();
+    if (a12Dot == 324)
+    {
+        cycle.ppuCycle = 324;
+        notifyCpuCycle();
+        clockScanlineIrq();
+    }
+    cycle.ppuCycle = 328;
+    notifyCpuCycle();
+    fetchTile();
+    cycle.ppuCycle = 341;
+    // ここから
+    for (int y = 1; y <= 240; y++)
+    {
+        // 再生ではバンドより下のラインを進めない(次のフレームは記録した状態から始める)
+        if (replayPos && y - 1 >= bandEnd)
+        {
+            finishFrame();
+            return screen;
+        }
+        // BG部分
+        skipRender = frameSkip || y - 1 < bandStart || y - 1 >= bandEnd;
+        fastForward = replayPos && y - 1 < bandStart;
+        LineInput input = spriteInput;
+        input.pageHash = pageHash;
+        input.v = reg.v;
+        input.bgPattern[0] = reg.bgPattern[0];
+        input.bgPattern[1] = reg.bgPattern[1];
+        input.x = reg.x;
+        input.attr = reg.attr;
+        input.ctrl2000 = state.ctrl2000;
+        input.ctrl2001 = state.ctrl2001;
+        lineWriteHash = 0;
+        // CPUはcpuInterleaveタイルごとにまとめて進め、途中のレジスタアクセスはsyncCpuで追いつく
+        lineDot = y * PPU_CYCLES + 1;
+        renderPx = 0;
+        for (int x = 0; x < 32; x += cpuInterleave)
+        {
+            int end = std::min(32, x + cpuInterleave) << 3;
+            cycle.ppuCycle = lineDot + end;
+            notifyCpuCycle();
+            if (end == 256 && renderBgLineCached())
+            {
+                continue;
+            }
+            renderUntil(end);
+        }
+        renderPx = -1;
+        cycle.ppuCycle = y * PPU_CYCLES + 255;
+        notifyCpuCycle();
+        if (state.ctrl2001 & DISPLAY_ENABLE)
+        {
+            // vwcroll, horizontal reset
+            if ((reg.v & 0x7000) != 0x7000)
+            {
+                // １ドット移動
+                reg.v += 0x1000;
+            }
+            else if ((reg.v & 0x3e0) == 0x3a0)
+            {
+                // ページ切り替え
+                reg.v &= ~0x73e0;
+                reg.v ^= 0x800;
+            }
+            else
+            {
+                // 次の行
+                reg.v &= ~0x7000;
+                reg.v += 0x20;
+            }
+            reg.v = (reg.v & ~0x41f) | ((state.ctrl2000 & 1) << 10) | (reg.t & 0x1f);
+        }
+        // ピクセル反映(前のフレームと入力が同じラインはscreenをそのまま使う)
+        if (!skipRender)
+        {
+            input.writeHash = lineWriteHash;
+            input.generation = contentGeneration;
+            input.outCtrl2001 = state.ctrl2001;
+            if (!lineInputValid || std::memcmp(&input, &lineInput[y - 1], sizeof(input)))
+            {
+                lineInput[y - 1] = input;
+                updateRgbaPalette();
+                convertLine(screen + ((y - 1) << 8));
+                convertedLines[(y - 1) >> 5] |= 1u << ((y - 1) & 31);
+                if (ntscEnabled)
+                {
+                    storeIndexLine(y - 1);
+                }
+                if (captureEnabled)
+                {
+                    storeCaptureLine(y - 1);
+                }
+                // 入力が変わっても同じ絵になることは多いので、結果でも比べる
+                uint64_t hash = hashLine(screen + ((y - 1) << 8));
+                if (!lineInputValid || hash != lineHash[y - 1])
+                {
+                    lineHash[y - 1] = hash;
+                    dirtyLines[(y - 1) >> 5] |= 1u << ((y - 1) & 31);
+                    screenChanged = true;
+                }
+            }
+        }
+        fastForward = false;
+        // sprite(次のラインの分なので、次のラインがバンド外なら合成しない)
+        skipRender = frameSkip || y < bandStart || y >= bandEnd;
+        fetchSprite(y - 1);
+        // hBlank
+        notifyHblank(y - 1);
+        a12Dot = getA12Dot();
+        if (a12Dot >= 0 && a12Dot < 320)
+        {
+            cycle.ppuCycle = y * PPU_CYCLES + a12Dot;
+            notifyCpuCycle();
+            clockScanlineIrq();
+        }
+        cycle.ppuCycle = y * PPU_CYCLES + 320;
+        notifyCpuCycle();
+        fetchTile();
+        if (a12Dot == 324)
+        {
+            cycle.ppuCycle = y * PPU_CYCLES + 324;
+            notifyCpuCycle();
+            clockScanlineIrq();
+        }
+        cycle.ppuCycle = y * PPU_CYCLES + 328;
+        fetchTile();
+    }
+    // post render line(240)
+    if (hBlankMask[240 >> 5] & (1u << (240 & 31)))
+    {
+        cycle.ppuCycle = 241 * PPU_CYCLES + 256;
+        notifyCpuCycle();
+        notifyHblank(240);
+    }
+    cycle.ppuCycle = 242 * PPU_CYCLES + 1;
+    notifyCpuCycle();
+    // VBlank
+    state.state |= 0x80;
+    // ここで、CPU命令を1つ実行したい
+    cycle.ppuCycle += 3;
+    notifyCpuCycle();
+    // 2002を先に読み込まれると、NMIがキャンセルされるらしい
+    if (vBlankCallback && (state.state & 0x80) && (state.ctrl2000 & NMI_ENABLED))
+    {
+        vBlankCallback();
+    }
+    for (int line = 241; line < 261; line++)
+    {
+        if (hBlankMask[line >> 5] & (1u << (line & 31)))
+        {
+            cycle.ppuCycle = (line + 1) * PPU_CYCLES + 256;
+            notifyCpuCycle();
+            notifyHblank(line);
+        }
+    }
+    cycle.ppuCycle = 262 * PPU_CYCLES;
+    notifyCpuCycle();
+    // 戻す
+    cycle.notifyPpuCycle -= 262 * PPU_CYCLES;
+    cycle.ppuCycle = 0;
+    finishFrame();
+    return screen;
+}
+
+/**
+ * トリプルバッファを使うか
+ * 有効にした直後は全ラインを写す
+ * @param enable 0で使わない
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void setTripleBuffer(int enable)
+{
+    tripleBuffer = enable != 0;
+    std::memset(staleLines, 0xff, sizeof(staleLines));
+    if (!tripleBuffer && screen != screenBuffer)
+    {
+        // 最新の画面を引き継ぐ
+        std::memcpy(screenBuffer, screen, sizeof(screenBuffer));
+        screen = screenBuffer;
+    }
+}
+
+/**
+ * 最新の画面を受け取る
+ * 次に呼ぶまで、返した画面はPPUに書き換えられない
+ * @return 256x240のRGBA(新しい画面がなければ前回と同じもの)
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *acquireFrame()
+{
+    if (readyFrame.load(std::memory_order_acquire) & READY_FRESH)
+    {
+        uint32_t old = readyFrame.exchange(frontBuffer, std::memory_order_acq_rel);
+        frontBuffer = old & READY_INDEX;
+        frontFrame = old >> READY_FRAME_SHIFT;
+    }
+    return frameBuffers[frontBuffer];
+}
+
+/**
+ * acquireFrameで受け取った画面のフレーム番号
+ * 前回から1つだけ進んでいれば、getDirtyLinesのラインだけ変わっている
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE int getAcquiredFrame()
+{
+    return frontFrame;
+}
+
+/**
+ * 別スレッドから受け取るときの交換用の値(SharedArrayBufferでAtomics.exchangeする)
+ * bit0-1: 最新の画面, bit2: 未読, bit8-: フレーム番号
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *getReadyFrameAddress()
+{
+    return reinterpret_cast<uint32_t *>(&readyFrame);
+}
+
+/**
+ * 3枚の画面の先頭(1枚256x240)
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *getFrameBuffers()
+{
+    return frameBuffers[0];
+}
+
+/**
+ * 背景のキャッシュを使うか(行の途中で分割しないラインだけ使う)
+ * @param enable 0で使わない
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void setBgCache(int enable)
+{
+    bgCacheEnabled = enable != 0;
+}
+
+/**
+ * NTSCフィルターを使うか(renderNtscの前に有効にしておく)
+ * @param enable 0で使わない
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void setNtscFilter(int enable)
+{
+    ntscEnabled = enable != 0;
+    if (ntscEnabled && !ntscKernelReady)
+    {
+        initNtscKernel();
+    }
+    // 次のフレームは全ラインを描き直す(有効ならパレット番号を書き、無効なら画面を全部送り直させる)
+    lineInputValid = false;
+    std::memset(scaleRowKey, 0, sizeof(scaleRowKey));
+}
+
+/**
+ * 直前のrenderScreenの画面をNTSCフィルターで変換する
+ * 色副搬送波の位相はフレームごとに進むので、毎回全ラインを変換する
+ * @return 602x240の画面
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *renderNtsc()
+{
+    if (!ntscEnabled)
+    {
+        return ntscScreen;
+    }
+    for (int y = 0; y < 240; y++)
+    {
+        // 1ライン(341ドット)で位相は4サンプル進む
+        int phase = (ntscFramePhase + y * 4) % 12;
+        filterNtscLine(y, phase / 4);
+    }
+    return ntscScreen;
+}
+
+/**
+ * 画面キャプチャを始める(パレット番号を前のフレームとの差分で圧縮して記録する)
+ * 前の記録は消える
+ * @param keyInterval キーフレームの間隔(フレーム数、0は最初だけ)
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void startCapture(int keyInterval)
+{
+    CaptureHeader header = {CAPTURE_MAGIC, CAPTURE_VERSION, (uint32_t)std::max(keyInterval, 0), 0, {}};
+    std::memcpy(header.palette[0], colorPalette, sizeof(header.palette[0]));
+    std::memcpy(header.palette[1], grayPalette, sizeof(header.palette[1]));
+    std::memcpy(header.palette[2], emphasisColor, sizeof(header.palette[2]));
+    captureArena.clear();
+    captureArena.reserve(0x100000);
+    const uint8_t *head = reinterpret_cast<const uint8_t *>(&header);
+    captureArena.insert(captureArena.end(), head, head + sizeof(header));
+    captureKeyInterval = std::max(keyInterval, 0);
+    captureSinceKey = -1;
+    captureFrames = 0;
+    captureEnabled = true;
+    // 次のフレームで全ラインのパレット番号を書く
+    lineInputValid = false;
+}
+
+// 記録を止める(データはclearCaptureまで残る)
+extern "C" EMSCRIPTEN_KEEPALIVE void stopCapture()
+{
+    captureEnabled = false;
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *getCaptureData()
+{
+    return captureArena.data();
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE int getCaptureSize()
+{
+    return captureArena.size();
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE int getCaptureFrames()
+{
+    return captureFrames;
+}
+
+// 記録を捨てて、メモリを返す
+extern "C" EMSCRIPTEN_KEEPALIVE void clearCapture()
+{
+    captureEnabled = false;
+    std::vector<uint8_t>().swap(captureArena);
+    captureFrames = 0;
+}
+
+/**
+ * 直前のrenderScreenの画面を拡大する
+ * @param mode SCALE_2X: Scale2x, SCALE_3X: Scale3x, SCALE_4X: Scale4x, SCALE_XBR: xBR-lite(2倍)
+ * @return 拡大した画面(幅は256 x 倍率、最初の呼び出しで確保するので、HEAPのビューは呼んだ後に作る)
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *renderScaled(int mode)
+{
+    if (mode < SCALE_2X || mode > SCALE_XBR)
+    {
+        return scaleScreen.data();
+    }
+    if (mode != scaleMode)
+    {
+        scaleMode = mode;
+        scaleScreen.resize(256 * 4 * 240 * 4);
+        if (mode == SCALE_4X)
+        {
+            scaleTemp.resize(512 * 480);
+        }
+        std::memset(scaleRowKey, 0, sizeof(scaleRowKey));
+        std::memset(scaleTempKey, 0, sizeof(scaleTempKey));
+    }
+    std::memset(scaleDirtyLines, 0, sizeof(scaleDirtyLines));
+    if (mode == SCALE_4X)
+    {
+        // Scale2xの結果を作ってから、もう一度Scale2xをかける
+        for (int y = 0; y < 240; y++)
+        {
+            uint64_t key = scaleKey(y, 1);
+            if (scaleTempKey[y] != key)
+            {
+                scaleTempKey[y] = key;
+                scale2xLine(screen, 256, 240, y, scaleTemp.data() + y * 2 * 512);
+            }
+        }
+    }
+    for (int y = 0; y < 240; y++)
+    {
+        uint64_t key = scaleKey(y, mode == SCALE_4X ? 2 : 1);
+        if (scaleRowKey[y] == key)
+        {
+            continue;
+        }
+        scaleRowKey[y] = key;
+        scaleDirtyLines[y >> 5] |= 1u << (y & 31);
+        switch (mode)
+        {
+        case SCALE_2X:
+            scale2xLine(screen, 256, 240, y, scaleScreen.data() + y * 2 * 512);
+            break;
+        case SCALE_3X:
+            scale3xLine(screen, y, scaleScreen.data() + y * 3 * 768);
+            break;
+        case SCALE_4X:
+            scale2xLine(scaleTemp.data(), 512, 480, y * 2, scaleScreen.data() + y * 4 * 1024);
+            scale2xLine(scaleTemp.data(), 512, 480, y * 2 + 1, scaleScreen.data() + (y * 4 + 2) * 1024);
+            break;
+        case SCALE_XBR:
+            xbrLine(screen, y, scaleScreen.data() + y * 2 * 512);
+            break;
+        }
+    }
+    return scaleScreen.data();
+}
+
+/**
+ * 直前のrenderScaledで作り直した行
+ * @return 入力の240bitのビットマップ(uint32 x 8、bit0がライン0)
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *getScaledDirtyLines()
+{
+    return scaleDirtyLines;
+}
+
+/**
+ * 画素を合成するラインの範囲(複数のインスタンスで分担して描画する)
+ * 範囲外のラインもタイミングとSprite0ヒットはスキップ時と同じく処理するので、範囲内の結果は全体を描画した場合と同じ
+ * replayFrameでは範囲より下のラインを処理せず、上のラインはvの更新と記録した操作だけを行う
+ * @param start 最初のライン(0-239)
+ * @param count ライン数
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void setRenderBand(int start, int count)
+{
+    bandStart = std::min(240, std::max(0, start));
+    bandEnd = std::min(240, std::max(bandStart, start + count));
+    // 範囲外だったラインの入力は更新していない
+    lineInputValid = false;
+}
+
+/**
+ * 描画の記録(別のインスタンスでreplayFrameして描画するため)
+ * 記録はrenderScreenの中で呼ばれた操作とフレーム先頭の状態
+ * @param enable 0以外で記録する
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void setFrameRecord(int enable)
+{
+    frameLog.enabled = enable != 0;
+    frameLog.size[0] = frameLog.size[1] = 0;
+    frameLog.overflow[0] = frameLog.overflow[1] = false;
+    for (auto &data : frameLog.data)
+    {
+        if (frameLog.enabled)
+        {
+            data.resize(FRAME_LOG_MAX);
+        }
+        else
+        {
+            std::vector<uint32_t>().swap(data);
+        }
+    }
+}
+
+// 直前のrenderScreenの記録
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *getFrameLog()
+{
+    return frameLog.data[frameLog.index].data();
+}
+
+// 記録のワード数、溢れていたら-1
+extern "C" EMSCRIPTEN_KEEPALIVE int getFrameLogSize()
+{
+    int index = frameLog.index;
+    return frameLog.overflow[index] ? -1 : frameLog.size[index];
+}
+
+// replayFrameの入力を書き込む場所(記録していないインスタンスで使う)
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *getReplayBuffer()
+{
+    frameLog.data[0].resize(FRAME_LOG_MAX);
+    return frameLog.data[0].data();
+}
+
+
+/**
+ * CPUのバスアクセスの位置まで描画を進める(PPUレジスタやバンクに触る直前に呼ぶ)
+ * @param remain アクセスからCPUのstep終了までのサイクル数(CPUのgetBusCycle)
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void syncCpu(int remain)
+{
+    EventScope scope(EV_SYNC_CPU, remain, 0);
+    busDot = std::min(batchEnd, std::max(batchStart, batchEnd - remain * 3));
+    if (renderPx >= 0)
+    {
+        renderUntil(std::min(256, std::max(0, busDot - lineDot)));
+    }
+}
+
+/**
+ * CPUをまとめて進めるタイル数
+ * @param tiles 1: タイルごと(syncCpuを使わないとき), 32: ラインごと
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void setCpuInterleave(int tiles)
+{
+    cpuInterleave = std::min(32, std::max(1, tiles));
+}
+
+// フレーム内のレジスタ書き込みの記録
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *getWriteLog()
+{
+    return writeLog;
+}
+
+// 記録の件数(WRITE_LOG_MAXで打ち切り)
+extern "C" EMSCRIPTEN_KEEPALIVE int getWriteLogCount()
+{
+    return writeLogCount;
+}
+
+/**
+ * 直前のrenderScreenで画面が変わったか
+ * @return 0なら前のフレームと同じ(スキップ時も0)
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE int isScreenChanged()
+{
+    return screenChanged;
+}
+
+/**
+ * 直前のrenderScreenで変わったライン
+ * @return 240bitのビットマップ(uint32 x 8、bit0がライン0)
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *getDirtyLines()
+{
+    return dirtyLines;
+}
+
+/**
+ * デバッグ表示(パターンテーブル、ネームテーブル、スプライト、パレット)
+ * 呼んだ時点のVRAMとレジスタで描く
+ */
+#define VIEW_PATTERN_WIDTH 128
+#define VIEW_PATTERN_HEIGHT 128
+#define VIEW_NAME_WIDTH 512
+#define VIEW_NAME_HEIGHT 480
+// 8x8個のスプライトを8x16のセルに並べる
+#define VIEW_OAM_WIDTH 64
+#define VIEW_OAM_HEIGHT 128
+// 32色を8x8のマスで並べる
+#define VIEW_PALETTE_WIDTH 128
+#define VIEW_PALETTE_HEIGHT 16
+
+static uint32_t patternView[2][VIEW_PATTERN_WIDTH * VIEW_PATTERN_HEIGHT];
+static uint32_t nameView[VIEW_NAME_WIDTH * VIEW_NAME_HEIGHT];
+static uint32_t oamView[VIEW_OAM_WIDTH * VIEW_OAM_HEIGHT];
+static uint32_t paletteView[VIEW_PALETTE_WIDTH * VIEW_PALETTE_HEIGHT];
+
+// 表示ごとの、前回描いたときの入力
+struct ViewState
+{
+    bool valid;
+    uint32_t generation;
+    uint32_t pageHash;
+    uint32_t cacheGeneration;
+    uint64_t param;
+    uint64_t hash;
+};
+static ViewState patternViewState[2];
+static ViewState nameViewState;
+static ViewState oamViewState;
+static ViewState paletteViewState;
+
+/**
+ * 表示の入力が変わったか
+ * 世代とページが同じなら内容は見ない、違っても内容のハッシュが同じなら変わっていない
+ * @param param レジスタなど、内容以外の入力
+ * @param hashInput 内容のハッシュ
+ */
+template <typename F>
+static bool viewChanged(ViewState &view, uint64_t param, F hashInput)
+{
+    if (view.valid && view.generation == contentGeneration && view.pageHash == pageHash && view.cacheGeneration == bgCacheGeneration && view.param == param)
+    {
+        return false;
+    }
+    uint64_t hash = hashInput();
+    bool changed = !view.valid || view.param != param || view.hash != hash;
+    view = {true, contentGeneration, pageHash, bgCacheGeneration, param, hash};
+    return changed;
+}
+
+// パターンテーブル(0x1000)の内容をハッシュに足す
+static void hashPatternTable(HashState &h, int table)
 {
-    // EM_ASM({ console.log("RenderStart", $0.toString(16), $1.toString(16)); }, reg.t, reg.v);
-    reg.odd = !reg.odd;
-    if (reg.odd && (state.ctrl2001 & BG_ENABLE))
+    for (int i = 0; i < 4; i++)
     {
-        // サイクルスキップ
-        cycle.notifyPpuCycle++;
+        hashUpdate(h, vramPage[table * 4 + i], 0x400);
     }
-    // pre render line(261)から始める
-    cycle.ppuCycle = 279;
-    // clear vblank,sprite0,overflow
-    state.state = 0;
-    notifyCpuCycle();
-    // vert(v)=vert(t)
-    if (state.ctrl2001 & DISPLAY_ENABLE)
+}
+
+static inline uint32_t viewColor(int index)
+{
+    return rgbaPalette[palette[index] & 0x3f];
+}
+
+/**
+ * パターンテーブルを描く(16x16タイル)
+ * @param table 0: $0000, 1: $1000
+ * @param pal パレット(0-3: BG, 4-7: スプライト)
+ * @param onlyIfChanged 0以外なら、前回から変わっていないときnullを返す
+ * @return 128x128のRGBA
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *renderPatternView(int table, int pal, int onlyIfChanged)
+{
+    table &= 1;
+    pal &= 7;
+    uint64_t param = pal | (state.ctrl2001 << 8);
+    if (!viewChanged(patternViewState[table], param, [&]
+                     {
+                         HashState h;
+                         hashInit(h);
+                         hashPatternTable(h, table);
+                         hashUpdate(h, palette, sizeof(palette));
+                         return hashFinal(h); }) &&
+        onlyIfChanged)
     {
-        reg.v = (reg.t & ~0xc00) | ((state.ctrl2000 & 3) << 10);
-        // EM_ASM({ console.log("$2000=" + $0.toString(16) + " $2001=" + $1.toString(16) + " t=" + $2.toString(16) + " v=" + $3.toString(16) + " sp0.y=" + $4); }, state.ctrl2000, state.ctrl2001, reg.t, reg.v, sprite.mem[0]);
+        return nullptr;
     }
-    cycle.ppuCycle = 320;
-    notifyCpuCycle();
-    fetchTile();
-    cycle.ppuCycle = 328;
-    notifyCpuCycle();
-    fetchTile();
-    cycle.ppuCycle = 341;
-    // ここから
-    for (int y = 1; y <= 240; y++)
+    updateRgbaPalette();
+    uint32_t colors[4] = {viewColor(0), viewColor(pal * 4 + 1), viewColor(pal * 4 + 2), viewColor(pal * 4 + 3)};
+    uint32_t *view = patternView[table];
+    for (int tile = 0; tile < 256; tile++)
     {
-        // BG部分
-        cycle.ppuCycle = y * PPU_CYCLES + 1;
-        for (int x = 0; x < 32; x++)
+        const uint8_t *chr = vramPage[table * 4 + (tile >> 6)] + ((tile & 63) << 4);
+        uint32_t *dst = view + (tile >> 4) * 8 * VIEW_PATTERN_WIDTH + (tile & 15) * 8;
+        for (int row = 0; row < 8; row++, dst += VIEW_PATTERN_WIDTH)
         {
-            notifyCpuCycle();
-            // ピクセル描画とタイルフェッチ
-            if (state.ctrl2001 & BG_ENABLE)
-            {
-                if (x > 0 || (state.ctrl2001 & BG_CLIP))
-                {
-                    int bit = 0x8000 >> reg.x;
-                    for (int dx = 0; dx < 8; dx++)
-                    {
-                        int px = (x << 3) | dx;
-                        int pix = ((reg.bgPattern[0] & bit) ? 1 : 0) | ((reg.bgPattern[1] & bit) ? 2 : 0);
-                        if (pix > 0)
-                        {
-                            if (lineBuf[px] & 0x400)
-                            {
-                                // Sprite0 hit
-                                state.state |= 0x40;
-                            }
-                            if (!(lineBuf[px] & 0x200))
-                            {
-                                lineBuf[px] = palette[((reg.attr << ((bit & 0xff) ? 2 : 0)) & 0xc) | pix] | 0x100;
-                            }
-                        }
-                        bit >>= 1;
-                    }
-                }
-            }
-            if (x < 31)
+            uint64_t pix = decodeTileRow(chr, row);
+            for (int x = 0; x < 8; x++)
             {
-                fetchTile();
+                dst[x] = colors[(pix >> (x * 8)) & 3];
             }
-            cycle.ppuCycle += 8;
         }
-        cycle.ppuCycle = y * PPU_CYCLES + 255;
-        notifyCpuCycle();
-        if (state.ctrl2001 & DISPLAY_ENABLE)
+    }
+    return view;
+}
+
+/**
+ * 4つのネームテーブルを描いて、次のフレームのスクロール位置(256x240)の枠を重ねる
+ * 背景のキャッシュと同じセルを使う
+ * @param onlyIfChanged 0以外なら、前回から変わっていないときnullを返す
+ * @return 512x480のRGBA
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *renderNameTableView(int onlyIfChanged)
+{
+    int scrollX = ((reg.t & 0x1f) << 3 | reg.x) + ((reg.t >> 10) & 1) * 256;
+    int scrollY = ((reg.t >> 5) & 0x1f) * 8 + ((reg.t >> 12) & 7) + ((reg.t >> 11) & 1) * 240;
+    // 縦の粗い位置が30, 31(属性テーブル)だと480を超えるので折り返す
+    scrollY %= VIEW_NAME_HEIGHT;
+    uint64_t param = scrollX | (scrollY << 10) | ((uint64_t)reg.bgAddr << 20) | ((uint64_t)state.ctrl2001 << 40);
+    if (!viewChanged(nameViewState, param, [&]
+                     {
+                         HashState h;
+                         hashInit(h);
+                         hashPatternTable(h, reg.bgAddr >> 12);
+                         for (int n = 0; n < 4; n++)
+                         {
+                             hashUpdate(h, vramPage[8 + n], 0x400);
+                         }
+                         hashUpdate(h, palette, 16);
+                         return hashFinal(h); }) &&
+        onlyIfChanged)
+    {
+        return nullptr;
+    }
+    validateBgCache();
+    for (int n = 0; n < 4; n++)
+    {
+        for (int cy = 0; cy < 30; cy++)
         {
-            // vwcroll, horizontal reset
-            if ((reg.v & 0x7000) != 0x7000)
-            {
-                // １ドット移動
-                reg.v += 0x1000;
-            }
-            else if ((reg.v & 0x3e0) == 0x3a0)
-            {
-                // ページ切り替え
-                reg.v &= ~0x73e0;
-                reg.v ^= 0x800;
-            }
-            else
+            for (int cx = 0; cx < 32; cx++)
             {
-                // 次の行
-                reg.v &= ~0x7000;
-                reg.v += 0x20;
+                if (!bgCellValid[n][cy][cx])
+                {
+                    fillBgCell(n, cy, cx);
+                }
             }
-            reg.v = (reg.v & ~0x41f) | ((state.ctrl2000 & 1) << 10) | (reg.t & 0x1f);
-        }
-        // ピクセル反映
-        int py = (y - 1) << 8;
-        uint32_t emphasisFlag = 0;
-        if (state.ctrl2001 & 0x80)
-        {
-            // 赤強調
-            emphasisFlag = 0x0000ff;
-        }
-        if (state.ctrl2001 & 0x40)
-        {
-            // 緑強調
-            emphasisFlag |= 0x00ff00;
         }
-        if (state.ctrl2001 & 0x20)
+    }
+    updateRgbaPalette();
+    uint32_t colors[16];
+    for (int i = 0; i < 16; i++)
+    {
+        colors[i] = viewColor((i & 3) ? i : 0);
+    }
+    for (int y = 0; y < VIEW_NAME_HEIGHT; y++)
+    {
+        for (int x = 0; x < VIEW_NAME_WIDTH; x++)
         {
-            // 青強調
-            emphasisFlag |= 0xff0000;
+            nameView[y * VIEW_NAME_WIDTH + x] = colors[bgCache[y][x] & 15];
         }
-        for (int x = 0; x < 256; x++)
+    }
+    // 枠は色を反転する(端で折り返す)
+    for (int i = 0; i < 256; i++)
+    {
+        int x = (scrollX + i) % VIEW_NAME_WIDTH;
+        nameView[scrollY * VIEW_NAME_WIDTH + x] ^= 0x00ffffff;
+        nameView[((scrollY + 239) % VIEW_NAME_HEIGHT) * VIEW_NAME_WIDTH + x] ^= 0x00ffffff;
+    }
+    for (int i = 1; i < 239; i++)
+    {
+        int y = (scrollY + i) % VIEW_NAME_HEIGHT;
+        nameView[y * VIEW_NAME_WIDTH + scrollX] ^= 0x00ffffff;
+        nameView[y * VIEW_NAME_WIDTH + (scrollX + 255) % VIEW_NAME_WIDTH] ^= 0x00ffffff;
+    }
+    return nameView;
+}
+
+/**
+ * OAMの64個のスプライトを並べて描く(反転は反映、透明はパレット0の色)
+ * @param onlyIfChanged 0以外なら、前回から変わっていないときnullを返す
+ * @return 64x128のRGBA(8x8モードでは各セルの上半分だけ)
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *renderOamView(int onlyIfChanged)
+{
+    bool tall = state.ctrl2000 & SPRITE16;
+    uint64_t param = (state.ctrl2000 & (SPRITE16 | SPRITE_PATTERN)) | (state.ctrl2001 << 8);
+    if (!viewChanged(oamViewState, param, [&]
+                     {
+                         HashState h;
+                         hashInit(h);
+                         hashUpdate(h, sprite.mem, sizeof(sprite.mem));
+                         if (tall || !(state.ctrl2000 & SPRITE_PATTERN))
+                         {
+                             hashPatternTable(h, 0);
+                         }
+                         if (tall || (state.ctrl2000 & SPRITE_PATTERN))
+                         {
+                             hashPatternTable(h, 1);
+                         }
+                         hashUpdate(h, palette, sizeof(palette));
+                         return hashFinal(h); }) &&
+        onlyIfChanged)
+    {
+        return nullptr;
+    }
+    updateRgbaPalette();
+    uint32_t background = viewColor(0);
+    int height = tall ? 16 : 8;
+    for (int i = 0; i < 64; i++)
+    {
+        const uint8_t *oam = sprite.mem + i * 4;
+        int tile = oam[1];
+        int attr = oam[2];
+        int base = tall ? ((tile & 1) << 12) | ((tile & 0xfe) << 4) : ((state.ctrl2000 & SPRITE_PATTERN) << 9) | (tile << 4);
+        uint32_t colors[4] = {background, viewColor(0x10 | ((attr & 3) << 2) | 1), viewColor(0x10 | ((attr & 3) << 2) | 2), viewColor(0x10 | ((attr & 3) << 2) | 3)};
+        uint32_t *cell = oamView + (i >> 3) * 16 * VIEW_OAM_WIDTH + (i & 7) * 8;
+        for (int row = 0; row < 16; row++)
         {
-            int col = lineBuf[x] & 0x3f;
-            if (state.ctrl2001 & GRAY_SCALE)
-            {
-                screen[py | x] = grayPalette[col];
-            }
-            else if (emphasisFlag)
+            uint32_t *dst = cell + row * VIEW_OAM_WIDTH;
+            if (row >= height)
             {
-                screen[py | x] = (colorPalette[col] & ~emphasisFlag) | (emphasisColor[col] & emphasisFlag);
+                std::fill(dst, dst + 8, background);
+                continue;
             }
-            else
+            int src = (attr & 0x80) ? height - 1 - row : row;
+            int addr = base + ((src & 8) << 1);
+            uint64_t pix = decodeTileRow(vramPage[addr >> 10] + (addr & 0x3ff), src & 7);
+            for (int x = 0; x < 8; x++)
             {
-                screen[py | x] = colorPalette[col];
+                dst[(attr & 0x40) ? 7 - x : x] = colors[(pix >> (x * 8)) & 3];
             }
         }
-        // sprite
-        fetchSprite(y - 1);
-        // hBlank
-        if (hBlankCallback)
-        {
-            hBlankCallback(y - 1);
-        }
-        cycle.ppuCycle = y * PPU_CYCLES + 320;
-        notifyCpuCycle();
-        fetchTile();
-        cycle.ppuCycle = y * PPU_CYCLES + 328;
-        fetchTile();
     }
-    cycle.ppuCycle = 242 * PPU_CYCLES + 1;
-    notifyCpuCycle();
-    // VBlank
-    state.state |= 0x80;
-    // ここで、CPU命令を1つ実行したい
-    cycle.ppuCycle += 3;
-    notifyCpuCycle();
-    // 2002を先に読み込まれると、NMIがキャンセルされるらしい
-    if (vBlankCallback && (state.state & 0x80) && (state.ctrl2000 & NMI_ENABLED))
+    return oamView;
+}
+
+/**
+ * パレット($3F00-$3F1F)を描く(上の段がBG、下の段がスプライト)
+ * @param onlyIfChanged 0以外なら、前回から変わっていないときnullを返す
+ * @return 128x16のRGBA
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *renderPaletteView(int onlyIfChanged)
+{
+    if (!viewChanged(paletteViewState, state.ctrl2001, []
+                     { return hash64(palette, sizeof(palette)); }) &&
+        onlyIfChanged)
     {
-        vBlankCallback();
+        return nullptr;
     }
-    cycle.ppuCycle = 262 * PPU_CYCLES;
-    notifyCpuCycle();
-    // 戻す
-    cycle.notifyPpuCycle -= 262 * PPU_CYCLES;
-    cycle.ppuCycle = 0;
-    return screen;
+    updateRgbaPalette();
+    for (int y = 0; y < VIEW_PALETTE_HEIGHT; y++)
+    {
+        for (int x = 0; x < VIEW_PALETTE_WIDTH; x++)
+        {
+            paletteView[y * VIEW_PALETTE_WIDTH + x] = viewColor((y >> 3) * 16 + (x >> 3));
+        }
+    }
+    return paletteView;
+}
+
+// hashScreen/hashStateの結果(uint32 x 2、下位が先)
+static uint64_t hashResult;
+
+/**
+ * 画面(screen)のハッシュ(tools/capture_decode --hashと同じ値)
+ * @return 64bitのハッシュ
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *hashScreen()
+{
+    hashResult = hash64(screen, sizeof(screenBuffer));
+    return reinterpret_cast<uint32_t *>(&hashResult);
+}
+
+/**
+ * PPUの状態(レジスタ、VRAM、OAM、パレット、ページの割り当て)のハッシュ
+ * フレーム記録のスナップショットと同じ内容を使う
+ * @return 64bitのハッシュ
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *hashState()
+{
+    static RenderSnapshot snap;
+    saveRenderSnapshot(snap);
+    // 構造体の詰め物を含めないように、フィールドごとに足す
+    HashState h;
+    hashInit(h);
+    uint16_t regs[8] = {(uint16_t)snap.reg.v, (uint16_t)snap.reg.t, (uint16_t)(snap.reg.x | (snap.reg.w << 3) | (snap.reg.odd << 4)),
+                        (uint16_t)(snap.reg.inc | (snap.reg.spSize << 8)), snap.reg.bgAddr, snap.reg.spAddr,
+                        snap.reg.bgPattern[0], snap.reg.bgPattern[1]};
+    hashUpdate(h, regs, sizeof(regs));
+    uint8_t bytes[10] = {snap.reg.attr, snap.reg.readBuf, snap.state.ctrl2000, snap.state.ctrl2001, snap.state.state,
+                         (uint8_t)snap.scanlineIrq.active, (uint8_t)snap.scanlineIrq.enabled, (uint8_t)snap.scanlineIrq.reload,
+                         snap.scanlineIrq.latch, snap.scanlineIrq.counter};
+    hashUpdate(h, bytes, sizeof(bytes));
+    hashUpdate(h, snap.sprite.mem, sizeof(snap.sprite.mem));
+    hashValue(h, snap.sprite.addr);
+    hashValue(h, snap.cycle.ppuCycle);
+    hashValue(h, snap.cycle.notifyPpuCycle);
+    hashUpdate(h, snap.pattern, sizeof(snap.pattern));
+    hashUpdate(h, snap.nameTable, sizeof(snap.nameTable));
+    hashUpdate(h, snap.palette, sizeof(snap.palette));
+    hashUpdate(h, snap.fillPage, sizeof(snap.fillPage));
+    hashUpdate(h, snap.pageSource, sizeof(snap.pageSource));
+    hashUpdate(h, snap.hBlankMask, sizeof(snap.hBlankMask));
+    hashUpdate(h, snap.nameIndex, sizeof(snap.nameIndex));
+    hashValue(h, snap.cpuInterleave);
+    hashValue(h, snap.vramReadOnly);
+    hashResult = hashFinal(h);
+    return reinterpret_cast<uint32_t *>(&hashResult);
 }
 
 extern "C" EMSCRIPTEN_KEEPALIVE int readMem(int addr)
 {
+    EventScope scope(EV_READ_MEM, addr, 0);
     switch (addr & 7)
     {
     case 2:
@@ -590,8 +3021,15 @@ extern "C" EMSCRIPTEN_KEEPALIVE int readMem(int addr)
     }
     case 7:
     {
+        logRenderWrite(0x800);
         // バッファ遅延
         int ret = reg.readBuf;
+#ifdef ENABLE_CDL
+        if (reg.v < 0x2000)
+        {
+            CDL_LOG(reg.v, CDL_CHR_READ);
+        }
+#endif
         reg.readBuf = readVram(reg.v);
         if (addr >= 0x3f00)
         {
@@ -607,11 +3045,145 @@ extern "C" EMSCRIPTEN_KEEPALIVE int readMem(int addr)
     return 0;
 }
 
+/**
+ * CHRバンクの切り替えを通知する
+ * @param bank 0-7(1KB単位)
+ * @param offset CHR-ROM内のオフセット、-1はCHR-RAM
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void setChrBankOffset(int bank, int offset)
+{
+    chrBankOffset[bank & 7] = offset;
+#ifdef ENABLE_CDL
+    updateCdlPage();
+#endif
+}
+
+/**
+ * CHR-ROMを読み込む領域を確保する
+ * @param size CHR-ROMのサイズ(0ならCHR-RAM)
+ * @return 書き込み先
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *loadChrRom(int size)
+{
+    chrRom.size = std::min(size, CHR_ROM_MAX);
+    // この後JS側から書き込まれる
+    contentGeneration++;
+    bgCacheGeneration++;
+    return chrRom.data;
+}
+
+/**
+ * CHRバンクを切り替える(1KB単位でCHR-ROMを直接参照する)
+ * @param bank 0-7
+ * @param offset CHR-ROM内のオフセット
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void setChrBank(int bank, int offset)
+{
+    EventScope scope(EV_CHR_BANK, bank, offset);
+    if (offset >= 0 && offset + 0x400 <= chrRom.size)
+    {
+        bank &= 7;
+        vramPage[bank] = chrRom.data + offset;
+        vramReadOnly |= 1 << bank;
+        updatePageHash();
+        setChrBankOffset(bank, offset);
+    }
+}
+
+/**
+ * ネームテーブルの参照先を設定する(マッパー制御)
+ * @param index 0-3($2000,$2400,$2800,$2C00)
+ * @param source 0-3: 内部VRAM(2,3は4画面用), NT_SOURCE_FILL: フィルモード, NT_SOURCE_CHR | n: CHR-ROMの1KBページn
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void setNameTableSource(int index, int source)
+{
+    EventScope scope(EV_NAME_TABLE, index, source);
+    index &= 3;
+    if (source & NT_SOURCE_CHR)
+    {
+        int offset = (source & 0xff) * 0x400;
+        if (offset + 0x400 <= chrRom.size)
+        {
+            setNameTablePage(index, chrRom.data + offset, true);
+        }
+    }
+    else if (source == NT_SOURCE_FILL)
+    {
+        setNameTablePage(index, fillPage, true);
+    }
+    else
+    {
+        setNameTablePage(index, nameTable[source & 3], false);
+    }
+}
+
+/**
+ * フィルモードのタイルと属性
+ * @param tile タイル番号
+ * @param attr パレット(0-3)
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void setFillTile(int tile, int attr)
+{
+    EventScope scope(EV_FILL_TILE, tile, attr);
+    if (fillPage[0] != (uint8_t)tile || fillPage[0x3c0] != (attr & 3) * 0x55)
+    {
+        std::memset(fillPage, tile, 0x3c0);
+        std::memset(fillPage + 0x3c0, (attr & 3) * 0x55, 0x40);
+        contentGeneration++;
+        bgCacheGeneration++;
+    }
+}
+
+/**
+ * CDLを開始する
+ * @param size CHR-ROMのサイズ
+ * @return 記録先、CDLが無効なビルドではnull
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *initCdl(int size)
+{
+#ifdef ENABLE_CDL
+    cdl.size = std::min(size, CDL_CHR_MAX);
+    std::memset(cdl.chr, 0, sizeof(cdl.chr));
+    updateCdlPage();
+    return cdl.chr;
+#else
+    (void)size;
+    return nullptr;
+#endif
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE uint8_t *getCdlData()
+{
+#ifdef ENABLE_CDL
+    return cdl.chr;
+#else
+    return nullptr;
+#endif
+}
+
+extern "C" EMSCRIPTEN_KEEPALIVE int getCdlSize()
+{
+#ifdef ENABLE_CDL
+    return cdl.size;
+#else
+    return 0;
+#endif
+}
+
 extern "C" EMSCRIPTEN_KEEPALIVE void setHblankCallback(void (*callback)(int))
 {
     hBlankCallback = callback;
 }
 
+/**
+ * hBlankCallbackを呼ぶラインのマスク(9 x 32bit)
+ * bit n がライン n(0-261)に対応する
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *getHblankMask()
+{
+    return hBlankMask;
+}
+
 extern "C" EMSCRIPTEN_KEEPALIVE void setVblankCallback(void (*callback)())
 {
     vBlankCallback = callback;
@@ -620,10 +3192,59 @@ extern "C" EMSCRIPTEN_KEEPALIVE void setCpuCallback(void (*callback)(int))
 {
     cpuCallback = callback;
 }
+extern "C" EMSCRIPTEN_KEEPALIVE void setIrqCallback(void (*callback)(int))
+{
+    irqCallback = callback;
+}
+
+/**
+ * MMC3のIRQレジスタへの書き込み
+ * @param addr $C000, $C001, $E000, $E001
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE void writeMapper(int addr, int val)
+{
+    EventScope scope(EV_WRITE_MAPPER, addr, val);
+    scanlineIrq.active = true;
+    switch (addr & 0xe001)
+    {
+    case 0xc000:
+        scanlineIrq.latch = val;
+        break;
+    case 0xc001:
+        scanlineIrq.counter = 0;
+        scanlineIrq.reload = true;
+        break;
+    case 0xe000:
+        // 無効にして、発生中のIRQを取り消す
+        scanlineIrq.enabled = false;
+        if (irqCallback)
+        {
+            irqCallback(0);
+        }
+        break;
+    case 0xe001:
+        scanlineIrq.enabled = true;
+        break;
+    }
+}
+
+// スキャンラインIRQを止めて、パターンテーブルを内部VRAMに戻す(マッパーの切り替え時)
+extern "C" EMSCRIPTEN_KEEPALIVE void resetMapper()
+{
+    EventScope scope(EV_RESET_MAPPER, 0, 0);
+    std::memset(&scanlineIrq, 0, sizeof(scanlineIrq));
+    for (int i = 0; i < 8; i++)
+    {
+        vramPage[i] = pattern + i * 0x400;
+    }
+    vramReadOnly &= 0xff00;
+    updatePageHash();
+}
 extern "C" EMSCRIPTEN_KEEPALIVE void reset()
 {
     std::memset(&reg, 0, sizeof(reg));
     std::memset(&state, 0, sizeof(state));
+    lineInputValid = false;
     writeMem(0x2000, 0);
     writeMem(0x2001, 0);
 }
@@ -633,6 +3254,8 @@ extern "C" EMSCRIPTEN_KEEPALIVE void powerOff()
     std::memset(nameTable, 0, sizeof(nameTable));
     std::memset(palette, 0, sizeof(palette));
     std::memset(&sprite, 0, sizeof(sprite));
+    std::memset(&scanlineIrq, 0, sizeof(scanlineIrq));
+    bgCacheGeneration++;
     reset();
 }
 /**
@@ -645,6 +3268,7 @@ extern "C" EMSCRIPTEN_KEEPALIVE void powerOff()
  */
 extern "C" EMSCRIPTEN_KEEPALIVE void setMirrorMode(int mode)
 {
+    EventScope scope(EV_MIRROR, mode, 0);
     if (mode == 2)
     {
         // 垂直ミラー
@@ -676,4 +3300,101 @@ extern "C" EMSCRIPTEN_KEEPALIVE void setMirrorMode(int mode)
         nameIndex[2] = num;
         nameIndex[3] = num;
     }
-}
\ No newline at end of file
+    for (int i = 0; i < 4; i++)
+    {
+        setNameTablePage(i, nameTable[nameIndex[i]], false);
+    }
+}
+
+// 現在のnotifyCpuCycleまでに記録された操作を適用する
+static void replayEvents()
+{
+    while (replayPos + 3 <= replayEnd && (int)(replayPos[0] & 0xffffff) <= frameLog.notifyCount)
+    {
+        int type = replayPos[0] >> 24;
+        int a = replayPos[1];
+        int b = replayPos[2];
+        replayPos += 3;
+        switch (type)
+        {
+        case EV_WRITE_MEM:
+            writeMem(a, b);
+            break;
+        case EV_READ_MEM:
+            readMem(a);
+            break;
+        case EV_WRITE_VRAM:
+            writeVram(a, b);
+            break;
+        case EV_WRITE_SPRITE:
+            writeSprite(a, b);
+            break;
+        case EV_SPRITE_DMA:
+            if (replayPos + sizeof(dmaBuf) / 4 > replayEnd)
+            {
+                replayPos = replayEnd;
+                return;
+            }
+            std::memcpy(dmaBuf, replayPos, sizeof(dmaBuf));
+            replayPos += sizeof(dmaBuf) / 4;
+            writeSpriteDma();
+            break;
+        case EV_CHR_BANK:
+            setChrBank(a, b);
+            break;
+        case EV_NAME_TABLE:
+            setNameTableSource(a, b);
+            break;
+        case EV_FILL_TILE:
+            setFillTile(a, b);
+            break;
+        case EV_MIRROR:
+            setMirrorMode(a);
+            break;
+        case EV_WRITE_MAPPER:
+            writeMapper(a, b);
+            break;
+        case EV_RESET_MAPPER:
+            resetMapper();
+            break;
+        case EV_SYNC_CPU:
+            syncCpu(a);
+            break;
+        }
+    }
+}
+
+/**
+ * 記録した1フレームを描画する
+ * CHR-ROMはloadChrRomで同じものを読み込んでおくこと
+ * @param size getReplayBufferに書き込んだワード数(getFrameLogSize)
+ * @return 画面
+ */
+extern "C" EMSCRIPTEN_KEEPALIVE uint32_t *replayFrame(int size)
+{
+    const int snapWords = sizeof(RenderSnapshot) / 4;
+    if (frameLog.enabled || size < snapWords || size > (int)frameLog.data[0].size())
+    {
+        return screen;
+    }
+    const uint32_t *log = frameLog.data[0].data();
+    loadRenderSnapshot((const RenderSnapshot *)log);
+    replayPos = log + snapWords;
+    replayEnd = log + size;
+    // CPU、APUの代わりに記録を流す
+    auto savedCpu = cpuCallback;
+    auto savedHblank = hBlankCallback;
+    auto savedVblank = vBlankCallback;
+    auto savedIrq = irqCallback;
+    cpuCallback = [](int) { replayEvents(); };
+    hBlankCallback = nullptr;
+    vBlankCallback = nullptr;
+    irqCallback = nullptr;
+    renderScreen(0);
+    cpuCallback = savedCpu;
+    hBlankCallback = savedHblank;
+    vBlankCallback = savedVblank;
+    irqCallback = savedIrq;
+    replayPos = replayEnd = nullptr;
+    return screen;
+}
@@ -0,0 +1,395 @@
+#pragma once
+/**
+ * 128bit SIMDの薄いラッパー
+ * wasm(-msimd128)とSSE4.1(ネイティブでの確認用)で同じ書き方ができるようにする
+ * どちらも無ければSIMD_ENABLEDは定義されないので、呼び出し側でスカラー版を使う
+ */
+#include <cstdint>
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#define SIMD_ENABLED 1
+typedef v128_t simd128;
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define SIMD_ENABLED 1
+typedef __m128i simd128;
+#endif
+
+#ifdef SIMD_ENABLED
+
+static inline simd128 simd_load(const void *p)
+{
+#if defined(__wasm_simd128__)
+    return wasm_v128_load(p);
+#else
+    return _mm_loadu_si128((const __m128i *)p);
+#endif
+}
+
+static inline void simd_store(void *p, simd128 v)
+{
+#if defined(__wasm_simd128__)
+    wasm_v128_store(p, v);
+#else
+    _mm_storeu_si128((__m128i *)p, v);
+#endif
+}
+
+// 8バイトを読んでu16x8に広げる
+static inline simd128 simd_load_u8x8(const void *p)
+{
+#if defined(__wasm_simd128__)
+    return wasm_u16x8_load8x8(p);
+#else
+    return _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)p));
+#endif
+}
+
+// 64bit値を下位に置く(上位は0)
+static inline simd128 simd_from_u64(uint64_t v)
+{
+#if defined(__wasm_simd128__)
+    return wasm_u64x2_make(v, 0);
+#else
+    return _mm_set_epi64x(0, (long long)v);
+#endif
+}
+
+static inline simd128 simd_splat_u8(uint8_t v)
+{
+#if defined(__wasm_simd128__)
+    return wasm_u8x16_splat(v);
+#else
+    return _mm_set1_epi8((char)v);
+#endif
+}
+
+static inline simd128 simd_splat_u16(uint16_t v)
+{
+#if defined(__wasm_simd128__)
+    return wasm_u16x8_splat(v);
+#else
+    return _mm_set1_epi16((short)v);
+#endif
+}
+
+static inline simd128 simd_and(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_v128_and(a, b);
+#else
+    return _mm_and_si128(a, b);
+#endif
+}
+
+static inline simd128 simd_or(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_v128_or(a, b);
+#else
+    return _mm_or_si128(a, b);
+#endif
+}
+
+// a & ~b (wasmの引数順に合わせる)
+static inline simd128 simd_andnot(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_v128_andnot(a, b);
+#else
+    return _mm_andnot_si128(b, a);
+#endif
+}
+
+// mask ? a : b (maskは各レーン全ビット0か1)
+static inline simd128 simd_select(simd128 mask, simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_v128_bitselect(a, b, mask);
+#else
+    return _mm_blendv_epi8(b, a, mask);
+#endif
+}
+
+static inline bool simd_any(simd128 v)
+{
+#if defined(__wasm_simd128__)
+    return wasm_v128_any_true(v);
+#else
+    return !_mm_testz_si128(v, v);
+#endif
+}
+
+static inline simd128 simd_add_u8(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i8x16_add(a, b);
+#else
+    return _mm_add_epi8(a, b);
+#endif
+}
+
+static inline simd128 simd_sub_u8(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i8x16_sub(a, b);
+#else
+    return _mm_sub_epi8(a, b);
+#endif
+}
+
+static inline simd128 simd_add_u16(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i16x8_add(a, b);
+#else
+    return _mm_add_epi16(a, b);
+#endif
+}
+
+// 符号付き16bitの算術右シフト
+static inline simd128 simd_shr_i16(simd128 v, int n)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i16x8_shr(v, n);
+#else
+    return _mm_srai_epi16(v, n);
+#endif
+}
+
+static inline simd128 simd_min_u16(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_u16x8_min(a, b);
+#else
+    return _mm_min_epu16(a, b);
+#endif
+}
+
+static inline simd128 simd_eq_u16(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i16x8_eq(a, b);
+#else
+    return _mm_cmpeq_epi16(a, b);
+#endif
+}
+
+static inline simd128 simd_splat_u32(uint32_t v)
+{
+#if defined(__wasm_simd128__)
+    return wasm_u32x4_splat(v);
+#else
+    return _mm_set1_epi32((int)v);
+#endif
+}
+
+static inline simd128 simd_eq_u32(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i32x4_eq(a, b);
+#else
+    return _mm_cmpeq_epi32(a, b);
+#endif
+}
+
+static inline simd128 simd_lt_i32(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i32x4_lt(a, b);
+#else
+    return _mm_cmplt_epi32(a, b);
+#endif
+}
+
+static inline simd128 simd_add_u32(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i32x4_add(a, b);
+#else
+    return _mm_add_epi32(a, b);
+#endif
+}
+
+static inline simd128 simd_shr_u32(simd128 v, int n)
+{
+#if defined(__wasm_simd128__)
+    return wasm_u32x4_shr(v, n);
+#else
+    return _mm_srli_epi32(v, n);
+#endif
+}
+
+// 飽和減算(0未満は0)
+static inline simd128 simd_subs_u8(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_u8x16_sub_sat(a, b);
+#else
+    return _mm_subs_epu8(a, b);
+#endif
+}
+
+// (a + b + 1) / 2
+static inline simd128 simd_avg_u8(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_u8x16_avgr(a, b);
+#else
+    return _mm_avg_epu8(a, b);
+#endif
+}
+
+// 下位8バイトをu16x8に広げる
+static inline simd128 simd_extend_low_u8(simd128 v)
+{
+#if defined(__wasm_simd128__)
+    return wasm_u16x8_extend_low_u8x16(v);
+#else
+    return _mm_cvtepu8_epi16(v);
+#endif
+}
+
+// u16x8を2つ飽和させてu8x16にまとめる(aが下位)
+static inline simd128 simd_narrow_u16(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_u8x16_narrow_i16x8(a, b);
+#else
+    return _mm_packus_epi16(a, b);
+#endif
+}
+
+/**
+ * 16バイトの表引き
+ * 範囲外(16以上)のインデックスは0になる(wasmのswizzleと同じ動作)
+ */
+static inline simd128 simd_lookup16(simd128 table, simd128 index)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i8x16_swizzle(table, index);
+#else
+    // pshufbは最上位ビットが立っているときだけ0になるので、16-127も0にする
+    return _mm_shuffle_epi8(table, _mm_or_si128(index, _mm_cmpgt_epi8(index, _mm_set1_epi8(15))));
+#endif
+}
+
+// バイト単位で交互に並べる(下位8バイト)
+static inline simd128 simd_zip_low_u8(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i8x16_shuffle(a, b, 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+#else
+    return _mm_unpacklo_epi8(a, b);
+#endif
+}
+
+// バイト単位で交互に並べる(上位8バイト)
+static inline simd128 simd_zip_high_u8(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i8x16_shuffle(a, b, 8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+#else
+    return _mm_unpackhi_epi8(a, b);
+#endif
+}
+
+// 16bit単位で交互に並べる(下位4つ)
+static inline simd128 simd_zip_low_u16(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i16x8_shuffle(a, b, 0, 8, 1, 9, 2, 10, 3, 11);
+#else
+    return _mm_unpacklo_epi16(a, b);
+#endif
+}
+
+// 16bit単位で交互に並べる(上位4つ)
+static inline simd128 simd_zip_high_u16(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i16x8_shuffle(a, b, 4, 12, 5, 13, 6, 14, 7, 15);
+#else
+    return _mm_unpackhi_epi16(a, b);
+#endif
+}
+
+// 32bit単位で交互に並べる(下位2つ)
+static inline simd128 simd_zip_low_u32(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i32x4_shuffle(a, b, 0, 4, 1, 5);
+#else
+    return _mm_unpacklo_epi32(a, b);
+#endif
+}
+
+// 32bit単位で交互に並べる(上位2つ)
+static inline simd128 simd_zip_high_u32(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i32x4_shuffle(a, b, 2, 6, 3, 7);
+#else
+    return _mm_unpackhi_epi32(a, b);
+#endif
+}
+
+static inline simd128 simd_xor(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_v128_xor(a, b);
+#else
+    return _mm_xor_si128(a, b);
+#endif
+}
+
+static inline simd128 simd_add_u64(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i64x2_add(a, b);
+#else
+    return _mm_add_epi64(a, b);
+#endif
+}
+
+static inline simd128 simd_shr_u64(simd128 v, int n)
+{
+#if defined(__wasm_simd128__)
+    return wasm_u64x2_shr(v, n);
+#else
+    return _mm_srli_epi64(v, n);
+#endif
+}
+
+static inline simd128 simd_shl_u64(simd128 v, int n)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i64x2_shl(v, n);
+#else
+    return _mm_slli_epi64(v, n);
+#endif
+}
+
+// 64bitごとに下位32bit同士を掛けて64bitにする
+static inline simd128 simd_mul_u32_u64(simd128 a, simd128 b)
+{
+#if defined(__wasm_simd128__)
+    simd128 mask = wasm_i64x2_splat(0xffffffff);
+    return wasm_i64x2_mul(wasm_v128_and(a, mask), wasm_v128_and(b, mask));
+#else
+    return _mm_mul_epu32(a, b);
+#endif
+}
+
+// 上下の64bitを入れ替える
+static inline simd128 simd_swap_u64(simd128 v)
+{
+#if defined(__wasm_simd128__)
+    return wasm_i64x2_shuffle(v, v, 1, 0);
+#else
+    return _mm_shuffle_epi32(v, 0x4e);
+#endif
+}
+
+#endif
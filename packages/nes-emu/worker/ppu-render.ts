@@ -0,0 +1,47 @@
+/**
+ * 描画用のWorker(Mapper.setDeferredRender)
+ * 本体のPPUが記録したフレームを、このWorkerのPPUインスタンスで再生して画面を返す
+ * 複数のWorkerで分担する場合は、担当のライン(start, count)だけ合成する
+ * PPUのwasm(ppu.js, ppu_simd.js)はこのファイルと同じassetsに置く
+ */
+let ppu: any;
+
+// 直前のreplayFrameで変わったラインの範囲(FamPPU.getDirtyRangesと同じ)
+function getDirtyRanges(): { start: number; count: number; }[] {
+    const bits = new Uint32Array(ppu.HEAPU32.buffer, ppu._getDirtyLines(), 8);
+    const ranges: { start: number; count: number; }[] = [];
+    let start = -1;
+    for (let line = 0; line <= 240; line++) {
+        const dirty = line < 240 && (bits[line >> 5] & (1 << (line & 31))) !== 0;
+        if (dirty && start < 0) {
+            start = line;
+        } else if (!dirty && start >= 0) {
+            ranges.push({ start, count: line - start });
+            start = -1;
+        }
+    }
+    return ranges;
+}
+
+self.onmessage = async (event: MessageEvent) => {
+    const data = event.data;
+    if (data.type === 'init') {
+        const url = data.simd ? './ppu_simd.js' : './ppu.js';
+        const wasmModule = await import(url);
+        ppu = await wasmModule.default();
+        const chrBankList = data.chrBankList as Uint8Array[];
+        const buf = ppu._loadChrRom(chrBankList.length * 0x2000);
+        chrBankList.forEach((bank, i) => ppu.HEAPU8.set(bank, buf + i * 0x2000));
+        ppu._setRenderBand(data.start, data.count);
+        self.postMessage({ type: 'ready' });
+    } else if (data.type === 'frame' && ppu) {
+        const log = data.log as Uint32Array;
+        // 確保でメモリが増えることがあるので、HEAPU32は後で取る
+        const ptr = ppu._getReplayBuffer();
+        ppu.HEAPU32.set(log, ptr >> 2);
+        const ret = ppu._replayFrame(log.length);
+        const image = new Uint8ClampedArray(ppu.HEAPU32.buffer, ret, 256 * 240 * 4).slice();
+        const dirty = ppu._isScreenChanged() ? getDirtyRanges() : [];
+        self.postMessage({ type: 'frame', image, dirty }, { transfer: [image.buffer] });
+    }
+};